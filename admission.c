@@ -0,0 +1,146 @@
+// admission.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "server.h"
+
+/*
+ * Admission control. Two independent checks decide whether a client gets
+ * served or a cheap rejection:
+ *
+ * Queue delay (CoDel-style, the variant used for server request queues):
+ * every socket popped from client_queue reports how long it waited. If
+ * even the shortest wait over an interval stayed above the target, the
+ * queue is standing rather than absorbing a burst, and until that changes
+ * any socket that waited longer than the target is answered with a 503.
+ * Outside overload only sockets that waited a whole interval are shed.
+ * Admitted clients therefore never queue much longer than the target. The
+ * target halves while determine_priority() reports the host saturated.
+ *
+ * Client rate (token buckets): with --rate-limit each client address gets
+ * a bucket refilled at that many requests per second, up to --rate-burst.
+ * Buckets live in a direct-mapped table indexed by a hash of the address.
+ * Addresses that collide share a bucket, level included: handing the slot
+ * to a newcomer with a full bucket would let colliding clients refill each
+ * other, and an attacker rotating addresses would never be limited. Only a
+ * slot that has never been used starts full.
+ */
+
+#define CODEL_INTERVAL_MS 100
+#define PRIORITY_REFRESH_MS 1000
+#define RATE_BUCKETS 16384
+#define RATE_SHARDS 64
+#define TOKEN 1000                      // bucket levels are kept in milli-tokens
+
+typedef struct {
+    long long tokens;
+    long long refilled_ms;
+} RateBucket;
+
+static const Server *admission_config;
+
+static long long interval_end_ns;
+static long long interval_min_ns;       // shortest sojourn seen this interval
+static int overloaded;
+static int priority;                    // ServerPriority, refreshed once a second
+static long long priority_next_ms;
+
+static RateBucket buckets[RATE_BUCKETS];
+static pthread_mutex_t bucket_mutexes[RATE_SHARDS];
+
+void admission_init(const Server *config) {
+    admission_config = config;
+    interval_end_ns = monotonic_ns() + CODEL_INTERVAL_MS * 1000000LL;
+    interval_min_ns = -1;
+    priority = HIGH_PRIORITY;
+    for (int i = 0; i < RATE_SHARDS; i++) {
+        pthread_mutex_init(&bucket_mutexes[i], NULL);
+    }
+}
+
+// getloadavg() reads /proc, so one caller per second refreshes the level for everyone.
+static int current_priority(void) {
+    long long now = monotonic_ms();
+    long long next = __atomic_load_n(&priority_next_ms, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(&priority_next_ms, &next, now + PRIORITY_REFRESH_MS, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        int level = determine_priority(get_one_minute_load(), admission_config->core_count);
+        __atomic_store_n(&priority, level, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&priority, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called for every socket taken off client_queue with the time it spent
+ * there. Returns 1 to serve it and 0 to answer it with a 503. The shared
+ * state is updated with plain atomics; a lost race only blurs one
+ * interval's minimum.
+ */
+int admission_admit(long long sojourn_ns) {
+    if (admission_config->codel_target_ms == 0) {
+        return 1;
+    }
+    long long target_ns = admission_config->codel_target_ms * 1000000LL;
+    if (current_priority() == LOW_PRIORITY) {
+        target_ns /= 2;
+    }
+
+    long long now = monotonic_ns();
+    long long end = __atomic_load_n(&interval_end_ns, __ATOMIC_RELAXED);
+    if (now >= end && __atomic_compare_exchange_n(&interval_end_ns, &end, now + CODEL_INTERVAL_MS * 1000000LL, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        long long seen = __atomic_exchange_n(&interval_min_ns, -1, __ATOMIC_RELAXED);
+        // An interval without any dequeue says nothing new about the queue.
+        if (seen >= 0) {
+            __atomic_store_n(&overloaded, seen > target_ns, __ATOMIC_RELAXED);
+        }
+    }
+
+    long long seen = __atomic_load_n(&interval_min_ns, __ATOMIC_RELAXED);
+    while ((seen < 0 || sojourn_ns < seen) &&
+           !__atomic_compare_exchange_n(&interval_min_ns, &seen, sojourn_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // A failed exchange reloaded `seen`; retry while ours is still smaller.
+    }
+
+    long long limit_ns = __atomic_load_n(&overloaded, __ATOMIC_RELAXED) ? target_ns
+                                                                          : CODEL_INTERVAL_MS * 1000000LL;
+    return sojourn_ns <= limit_ns;
+}
+
+int admission_overloaded(void) {
+    return __atomic_load_n(&overloaded, __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes one token from the bucket of `client_key`. Returns 1 when the
+ * request may proceed and 0 when the client is over its rate.
+ */
+int client_rate_allows(unsigned long long client_key) {
+    if (admission_config->rate_limit == 0) {
+        return 1;
+    }
+    long long rate = admission_config->rate_limit;
+    long long capacity = (long long)admission_config->rate_burst * TOKEN;
+    size_t index = (size_t)((client_key * 0x9E3779B97F4A7C15ULL) >> 32) % RATE_BUCKETS;
+    RateBucket *bucket = &buckets[index];
+    long long now = monotonic_ms();
+    int allowed;
+
+    pthread_mutex_lock(&bucket_mutexes[index % RATE_SHARDS]);
+    if (bucket->refilled_ms == 0) {
+        bucket->tokens = capacity;
+    } else {
+        // rate tokens per second is rate milli-tokens per millisecond.
+        long long refill = (now - bucket->refilled_ms) * rate;
+        bucket->tokens = bucket->tokens + refill > capacity ? capacity : bucket->tokens + refill;
+    }
+    bucket->refilled_ms = now;
+    allowed = bucket->tokens >= TOKEN;
+    if (allowed) {
+        bucket->tokens -= TOKEN;
+    }
+    pthread_mutex_unlock(&bucket_mutexes[index % RATE_SHARDS]);
+    return allowed;
+}
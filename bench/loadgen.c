@@ -0,0 +1,579 @@
+// bench/loadgen.c
+//
+// HTTP/1.1 load generator for benchmarking the server. Every thread owns one
+// connection and issues GETs over it, either closed-loop (next request as
+// soon as the previous response ends) or open-loop at a fixed aggregate
+// rate (-r). Latencies go into per-thread log-linear histograms that are
+// merged at the end.
+//
+// Coordinated omission: in open-loop mode latency is measured from when a
+// request was *scheduled*, not when it was sent. A stalled server therefore
+// charges the whole queueing delay to every request behind the stall. In
+// closed-loop mode the histogram is corrected after the run, HdrHistogram
+// style, using the mean service time as the expected interval.
+//
+//     ./bench/loadgen [options] path...
+//       -h HOST            server address (default 127.0.0.1)
+//       -p PORT            server port (default 8080)
+//       -c CONNECTIONS     concurrent connections/threads (default 4)
+//       -d SECONDS         measured duration (default 5)
+//       -r RATE            open loop: total requests per second (default: closed loop)
+//       -k 0|1             keep-alive (default 1)
+//       -l LABEL           scenario name for the JSON record
+//       -o FILE            append a JSON result object to FILE
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Log-linear histogram: values below 2^SUB_BITS are exact, larger ones keep
+// SUB_BITS - 1 bits of precision (under 1% error). Values are microseconds.
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define BUCKETS 40
+#define HIST_SLOTS (SUB_COUNT + BUCKETS * HALF_COUNT)
+
+typedef struct {
+    unsigned long long counts[HIST_SLOTS];
+    unsigned long long total;
+    unsigned long long max;
+} Histogram;
+
+static int hist_index(unsigned long long value) {
+    if (value < SUB_COUNT) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+    if (shift > BUCKETS) {
+        return HIST_SLOTS - 1;
+    }
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + (int)((value >> shift) - HALF_COUNT);
+}
+
+// Highest value that maps to slot `index`.
+static unsigned long long hist_value(int index) {
+    if (index < SUB_COUNT) {
+        return (unsigned long long)index;
+    }
+    int shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    unsigned long long sub = (unsigned long long)((index - SUB_COUNT) % HALF_COUNT + HALF_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *h, unsigned long long value, unsigned long long count) {
+    h->counts[hist_index(value)] += count;
+    h->total += count;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_SLOTS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/*
+ * Back-fills the samples a closed-loop client never took while it was
+ * blocked: a response that took k expected intervals stands in for k
+ * requests, with latencies value, value - interval, value - 2*interval, ...
+ */
+static void hist_correct(Histogram *out, const Histogram *in, unsigned long long interval) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < HIST_SLOTS; i++) {
+        if (in->counts[i] == 0) {
+            continue;
+        }
+        unsigned long long value = hist_value(i);
+        hist_record(out, value, in->counts[i]);
+        if (interval == 0) {
+            continue;
+        }
+        for (unsigned long long missing = value > interval ? value - interval : 0;
+             missing >= interval; missing -= interval) {
+            hist_record(out, missing, in->counts[i]);
+        }
+    }
+    if (in->max > out->max) {
+        out->max = in->max;
+    }
+}
+
+static unsigned long long hist_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_SLOTS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            unsigned long long value = hist_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+typedef struct {
+    const char *host;
+    int port;
+    int connections;
+    double duration;
+    double rate;
+    int keep_alive;
+    const char *label;
+    const char *output;
+    char **paths;
+    int path_count;
+} Options;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    const Options *options;
+    struct sockaddr_in address;
+    long long start_ns;
+    long long end_ns;
+    int fd;
+    char buffer[65536];
+    Histogram latency;          // from send (closed) or schedule (open)
+    Histogram service;          // from send, open loop only
+    unsigned long long requests;
+    unsigned long long bytes;
+    unsigned long long status[6];   // by class, 1xx..5xx; [0] unparsable
+    unsigned long long errors;
+    unsigned long long reconnects;
+} Client;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int client_connect(Client *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(client->fd, (struct sockaddr *)&client->address, sizeof(client->address)) < 0) {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+    client->reconnects++;
+    return 0;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Returns the next CRLF-terminated line of a chunked body, NUL-terminated in
+ * place, reading more when buffer[*pos, *len) holds no complete line.
+ */
+static char *next_line(Client *client, size_t *pos, size_t *len) {
+    char *buf = client->buffer;
+    while (1) {
+        char *end = memmem(buf + *pos, *len - *pos, "\r\n", 2);
+        if (end != NULL) {
+            char *line = buf + *pos;
+            *end = '\0';
+            *pos = (size_t)(end - buf) + 2;
+            return line;
+        }
+        memmove(buf, buf + *pos, *len - *pos);
+        *len -= *pos;
+        *pos = 0;
+        if (*len == sizeof(client->buffer) - 1) {
+            return NULL;
+        }
+        ssize_t n = recv(client->fd, buf + *len, sizeof(client->buffer) - 1 - *len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        client->bytes += (size_t)n;
+        *len += (size_t)n;
+    }
+}
+
+// Skips `count` body bytes, first from buffer[*pos, *len), then from the socket.
+static int skip_bytes(Client *client, size_t *pos, size_t *len, long long count) {
+    if ((long long)(*len - *pos) >= count) {
+        *pos += (size_t)count;
+        return 0;
+    }
+    count -= (long long)(*len - *pos);
+    *pos = *len = 0;
+    while (count > 0) {
+        size_t want = count < (long long)sizeof(client->buffer) ? (size_t)count : sizeof(client->buffer);
+        ssize_t n = recv(client->fd, client->buffer, want, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        count -= n;
+        client->bytes += (size_t)n;
+    }
+    return 0;
+}
+
+// Reads a chunked body through its trailers; buffer[pos, len) is what came with the header.
+static int read_chunked(Client *client, size_t pos, size_t len) {
+    while (1) {
+        char *line = next_line(client, &pos, &len);
+        if (line == NULL) {
+            return -1;
+        }
+        char *end;
+        long long size = strtoll(line, &end, 16);
+        if (end == line || size < 0) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (skip_bytes(client, &pos, &len, size + 2) < 0) {    // data and its CRLF
+            return -1;
+        }
+    }
+    while (1) {
+        char *line = next_line(client, &pos, &len);
+        if (line == NULL) {
+            return -1;
+        }
+        if (*line == '\0') {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Reads one response. Returns its status code, or -1 on a transport error.
+ * *closed is set when the server will not reuse the connection.
+ */
+static int read_response(Client *client, int *closed) {
+    char *buf = client->buffer;
+    size_t len = 0;
+    char *header_end = NULL;
+    while (header_end == NULL) {
+        if (len == sizeof(client->buffer) - 1) {
+            return -1;
+        }
+        ssize_t n = recv(client->fd, buf + len, sizeof(client->buffer) - 1 - len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        len += (size_t)n;
+        buf[len] = '\0';
+        header_end = strstr(buf, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if (strncmp(buf, "HTTP/1.", 7) == 0 && len > 12) {
+        status = atoi(buf + 9);
+    }
+
+    long long content_length = -1;
+    int chunked = 0;
+    *closed = 0;
+    for (char *line = strstr(buf, "\r\n") + 2; line < header_end; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = atoll(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked") != NULL) {
+            chunked = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strncasecmp(line + 11, " close", 6) == 0) {
+            *closed = 1;
+        }
+    }
+
+    size_t header_len = (size_t)(header_end - buf) + 4;
+    client->bytes += len;
+    if (chunked) {
+        return read_chunked(client, header_len, len) < 0 ? -1 : status;
+    }
+    if (content_length < 0) {
+        // No length to go by: the body runs until the server closes.
+        *closed = 1;
+        ssize_t n;
+        while ((n = recv(client->fd, buf, sizeof(client->buffer), 0)) > 0) {
+            client->bytes += (size_t)n;
+        }
+        return status;
+    }
+
+    long long remaining = content_length - (long long)(len - header_len);
+    while (remaining > 0) {
+        size_t want = remaining < (long long)sizeof(client->buffer) ? (size_t)remaining : sizeof(client->buffer);
+        ssize_t n = recv(client->fd, buf, want, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        remaining -= n;
+        client->bytes += (size_t)n;
+    }
+    return status;
+}
+
+static void *client_thread(void *arg) {
+    Client *client = arg;
+    const Options *options = client->options;
+    char request[2048];
+    double per_client_rate = options->rate / options->connections;
+    long long interval_ns = per_client_rate > 0 ? (long long)(1e9 / per_client_rate) : 0;
+    // Stagger open-loop clients so their schedules interleave.
+    long long scheduled = client->start_ns + (interval_ns * client->id) / options->connections;
+
+    for (unsigned long long n = 0; ; n++) {
+        if (interval_ns > 0) {
+            if (scheduled >= client->end_ns) {
+                break;
+            }
+            sleep_until(scheduled);
+        } else if (now_ns() >= client->end_ns) {
+            break;
+        }
+
+        // With keep-alive off the connect is part of each request's latency.
+        long long sent = now_ns();
+        if (client->fd < 0 && client_connect(client) < 0) {
+            client->errors++;
+            if (interval_ns > 0) {
+                scheduled += interval_ns;
+            }
+            continue;
+        }
+
+        const char *path = options->paths[(n + (unsigned long long)client->id) % (unsigned long long)options->path_count];
+        int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                   path, options->host, options->keep_alive ? "keep-alive" : "close");
+
+        int closed = 0;
+        int status = -1;
+        if (send_all(client->fd, request, (size_t)request_len) == 0) {
+            status = read_response(client, &closed);
+        }
+        long long done = now_ns();
+
+        if (status < 0) {
+            client->errors++;
+            close(client->fd);
+            client->fd = -1;
+        } else {
+            client->requests++;
+            client->status[status >= 100 && status < 600 ? status / 100 : 0]++;
+            unsigned long long service_us = (unsigned long long)(done - sent) / 1000;
+            if (interval_ns > 0) {
+                hist_record(&client->latency, (unsigned long long)(done - scheduled) / 1000, 1);
+                hist_record(&client->service, service_us, 1);
+            } else {
+                hist_record(&client->latency, service_us, 1);
+            }
+            if (closed || !options->keep_alive) {
+                close(client->fd);
+                client->fd = -1;
+            }
+        }
+
+        if (interval_ns > 0) {
+            scheduled += interval_ns;
+        }
+    }
+
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    return NULL;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] [-r rate] [-k 0|1] "
+                    "[-l label] [-o results.json] path...\n", program);
+    exit(EXIT_FAILURE);
+}
+
+static void print_json(FILE *out, const Options *options, double elapsed, const Client *total,
+                       const Histogram *latency, const Histogram *corrected, const Histogram *service) {
+    fprintf(out, "{\"label\": \"%s\", \"mode\": \"%s\", \"connections\": %d, \"keep_alive\": %s, "
+                 "\"target_rate\": %.0f, \"duration_s\": %.3f, \"requests\": %llu, \"errors\": %llu, "
+                 "\"connects\": %llu, \"bytes\": %llu, \"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+                 "\"status\": {\"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu}, ",
+            options->label, options->rate > 0 ? "open" : "closed", options->connections,
+            options->keep_alive ? "true" : "false", options->rate, elapsed,
+            total->requests, total->errors, total->reconnects, total->bytes,
+            total->requests / elapsed, total->bytes / elapsed / 1e6,
+            total->status[2], total->status[3], total->status[4], total->status[5],
+            total->status[0] + total->status[1]);
+
+    const Histogram *sets[3] = {latency, corrected, service};
+    const char *names[3] = {"latency_us", "corrected_latency_us", "service_time_us"};
+    for (int s = 0; s < 3; s++) {
+        if (sets[s] == NULL) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+                s == 0 ? "" : ", ", names[s],
+                hist_percentile(sets[s], 50), hist_percentile(sets[s], 90), hist_percentile(sets[s], 99),
+                hist_percentile(sets[s], 99.9), sets[s]->max);
+    }
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options = {"127.0.0.1", 8080, 4, 5.0, 0.0, 1, "run", NULL, NULL, 0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:r:k:l:o:")) != -1) {
+        switch (opt) {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = atoi(optarg); break;
+        case 'c': options.connections = atoi(optarg); break;
+        case 'd': options.duration = atof(optarg); break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'k': options.keep_alive = atoi(optarg) != 0; break;
+        case 'l': options.label = optarg; break;
+        case 'o': options.output = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || options.connections <= 0 || options.duration <= 0 || options.port <= 0) {
+        usage(argv[0]);
+    }
+    options.paths = argv + optind;
+    options.path_count = argc - optind;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)options.port);
+    if (inet_pton(AF_INET, options.host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", options.host);
+        return EXIT_FAILURE;
+    }
+
+    Client *clients = calloc((size_t)options.connections, sizeof(Client));
+    if (clients == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    long long start = now_ns() + 10000000LL;
+    long long end = start + (long long)(options.duration * 1e9);
+    for (int i = 0; i < options.connections; i++) {
+        clients[i].id = i;
+        clients[i].options = &options;
+        clients[i].address = address;
+        clients[i].start_ns = start;
+        clients[i].end_ns = end;
+        clients[i].fd = -1;
+        if (pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    static Client total;
+    static Histogram latency, corrected, service;
+    for (int i = 0; i < options.connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        hist_merge(&latency, &clients[i].latency);
+        hist_merge(&service, &clients[i].service);
+        total.requests += clients[i].requests;
+        total.bytes += clients[i].bytes;
+        total.errors += clients[i].errors;
+        total.reconnects += clients[i].reconnects;
+        for (int s = 0; s < 6; s++) {
+            total.status[s] += clients[i].status[s];
+        }
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    if (elapsed < options.duration) {
+        elapsed = options.duration;
+    }
+
+    // Open-loop latencies are already measured from the schedule.
+    const Histogram *corrected_set = NULL;
+    if (options.rate <= 0 && total.requests > 0) {
+        unsigned long long expected_us = (unsigned long long)(elapsed * 1e6 * options.connections / total.requests);
+        hist_correct(&corrected, &latency, expected_us);
+        corrected_set = &corrected;
+    }
+
+    printf("%-24s %10.0f req/s %8.2f MB/s  p50 %6llu  p99 %7llu  p999 %7llu us  errors %llu",
+           options.label, total.requests / elapsed, total.bytes / elapsed / 1e6,
+           hist_percentile(corrected_set ? corrected_set : &latency, 50),
+           hist_percentile(corrected_set ? corrected_set : &latency, 99),
+           hist_percentile(corrected_set ? corrected_set : &latency, 99.9), total.errors);
+    printf("  (2xx %llu, 4xx %llu)\n", total.status[2], total.status[4]);
+
+    if (options.output != NULL) {
+        FILE *out = fopen(options.output, "a");
+        if (out == NULL) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+        print_json(out, &options, elapsed, &total, &latency, corrected_set,
+                   options.rate > 0 ? &service : NULL);
+        fclose(out);
+    }
+
+    free(clients);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+// bench/queue_bench.c
+//
+// Microbenchmark for the client hand-off queue: the lock-free ring in
+// queue.c against the semaphore + mutex ring it replaced. Producers push
+// dummy descriptors through client_queue_push(), consumers drain them with
+// client_queue_pop(), and the wall time for a fixed number of items is
+// reported as millions of hand-offs per second. The eventfd column runs
+// the ring with its eventfd live and consumers that poll it and take
+// sockets with client_queue_pop_woken(), as the event loops do.
+//
+//     make queue_bench && ./bench/queue_bench [items] [max_threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "../server.h"
+
+ClientQueue client_queue;
+
+typedef struct {
+    int sockets[MAX_QUEUE_SIZE];
+    int front;
+    int rear;
+    sem_t filled;
+    sem_t empty;
+    pthread_mutex_t mutex;
+} LegacyQueue;
+
+static void legacy_init(LegacyQueue *q) {
+    q->front = 0;
+    q->rear = 0;
+    sem_init(&q->filled, 0, 0);
+    sem_init(&q->empty, 0, MAX_QUEUE_SIZE);
+    pthread_mutex_init(&q->mutex, NULL);
+}
+
+static void legacy_push(LegacyQueue *q, int client_fd) {
+    sem_wait(&q->empty);
+    pthread_mutex_lock(&q->mutex);
+    q->sockets[q->rear] = client_fd;
+    q->rear = (q->rear + 1) % MAX_QUEUE_SIZE;
+    pthread_mutex_unlock(&q->mutex);
+    sem_post(&q->filled);
+}
+
+static int legacy_pop(LegacyQueue *q) {
+    sem_wait(&q->filled);
+    pthread_mutex_lock(&q->mutex);
+    int client_fd = q->sockets[q->front];
+    q->front = (q->front + 1) % MAX_QUEUE_SIZE;
+    pthread_mutex_unlock(&q->mutex);
+    sem_post(&q->empty);
+    return client_fd;
+}
+
+enum { MODE_LEGACY, MODE_LOCKFREE, MODE_EVENTFD };
+
+typedef struct {
+    int mode;
+    void *queue;
+    long items;
+    long long checksum;
+} Job;
+
+static void *producer(void *arg) {
+    Job *job = arg;
+    for (long i = 0; i < job->items; i++) {
+        if (job->mode == MODE_LEGACY) {
+            legacy_push(job->queue, (int)(i & 0xffff));
+        } else {
+            client_queue_push(job->queue, (int)(i & 0xffff));
+        }
+    }
+    return NULL;
+}
+
+// Waits on the eventfd like an event loop; the ring never blocks here.
+static int woken_pop(ClientQueue *q) {
+    struct pollfd pfd = {.fd = q->event_fd, .events = POLLIN};
+    while (1) {
+        int client_fd = client_queue_pop_woken(q, NULL);
+        if (client_fd >= 0) {
+            return client_fd;
+        }
+        client_queue_loop_sleeping(q, 1);
+        poll(&pfd, 1, -1);
+        client_queue_loop_sleeping(q, 0);
+    }
+}
+
+static void *consumer(void *arg) {
+    Job *job = arg;
+    long long sum = 0;
+    for (long i = 0; i < job->items; i++) {
+        if (job->mode == MODE_LEGACY) {
+            sum += legacy_pop(job->queue);
+        } else if (job->mode == MODE_LOCKFREE) {
+            sum += client_queue_pop(job->queue);
+        } else {
+            sum += woken_pop(job->queue);
+        }
+    }
+    job->checksum = sum;
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int mode, int threads, long items) {
+    static LegacyQueue legacy_queue;
+    void *queue;
+    if (mode == MODE_LEGACY) {
+        legacy_init(&legacy_queue);
+        queue = &legacy_queue;
+    } else {
+        client_queue_init(&client_queue);
+        if (mode == MODE_LOCKFREE) {
+            // Measure the ring itself, not the event-loop wakeup syscall.
+            close(client_queue.event_fd);
+            client_queue.event_fd = -1;
+        }
+        queue = &client_queue;
+    }
+
+    long per_thread = items / threads;
+    pthread_t *handles = malloc(sizeof(pthread_t) * 2 * threads);
+    Job *jobs = malloc(sizeof(Job) * 2 * threads);
+
+    double start = now_seconds();
+    for (int i = 0; i < 2 * threads; i++) {
+        jobs[i].mode = mode;
+        jobs[i].queue = queue;
+        jobs[i].items = per_thread;
+        jobs[i].checksum = 0;
+        pthread_create(&handles[i], NULL, i < threads ? producer : consumer, &jobs[i]);
+    }
+    long long checksum = 0;
+    for (int i = 0; i < 2 * threads; i++) {
+        pthread_join(handles[i], NULL);
+        checksum += jobs[i].checksum;
+    }
+    double elapsed = now_seconds() - start;
+
+    long long expected = 0;
+    for (long i = 0; i < per_thread; i++) {
+        expected += i & 0xffff;
+    }
+    if (checksum != expected * threads) {
+        fprintf(stderr, "checksum mismatch: %lld != %lld\n", checksum, expected * threads);
+        exit(EXIT_FAILURE);
+    }
+
+    if (client_queue.event_fd >= 0) {
+        close(client_queue.event_fd);
+        client_queue.event_fd = -1;
+    }
+    free(handles);
+    free(jobs);
+    return (double)(per_thread * threads) / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    long items = argc > 1 ? atol(argv[1]) : 2000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 16;
+
+    printf("%-22s %14s %14s %8s %14s\n", "producers/consumers", "legacy Mops/s", "lockfree Mops/s", "speedup",
+           "eventfd Mops/s");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double legacy = run(MODE_LEGACY, threads, items);
+        double lockfree = run(MODE_LOCKFREE, threads, items);
+        double eventfd = run(MODE_EVENTFD, threads, items);
+        printf("%-22d %14.2f %14.2f %7.2fx %14.2f\n", threads, legacy, lockfree, lockfree / legacy, eventfd);
+    }
+    return 0;
+}
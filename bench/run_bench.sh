@@ -0,0 +1,86 @@
+#!/bin/bash
+# bench/run_bench.sh
+#
+# Runs the load generator against a freshly started webserver over a fixture
+# docroot and writes one JSON document per run to bench/results/. Invoked by
+# `make bench`; tune with environment variables:
+#
+#   BENCH_DURATION     seconds per scenario (default 5)
+#   BENCH_CONNECTIONS  concurrent connections (default 32)
+#   BENCH_RATE         open-loop request rate for the mixed scenario (default 5000)
+#   BENCH_PORT         port for the server under test (default 18480)
+#   BENCH_THREADS      server worker threads (default 8)
+#   BENCH_SERVER_ARGS  extra server options (default --no-access-log)
+
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-32}
+RATE=${BENCH_RATE:-5000}
+PORT=${BENCH_PORT:-18480}
+THREADS=${BENCH_THREADS:-8}
+SERVER_ARGS=${BENCH_SERVER_ARGS:---no-access-log}
+
+WORKDIR=$(mktemp -d)
+DOCROOT="$WORKDIR/www"
+RAW="$WORKDIR/results.jsonl"
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill -INT "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Fixture: tiny (served from the file cache), medium and large (sendfile),
+# and a directory whose --autoindex listing is a streamed, chunked body.
+mkdir -p "$DOCROOT/listing"
+head -c 128 /dev/zero | tr '\0' 'x' > "$DOCROOT/tiny.html"
+head -c $((64 * 1024)) /dev/urandom > "$DOCROOT/medium.bin"
+head -c $((8 * 1024 * 1024)) /dev/urandom > "$DOCROOT/large.bin"
+(cd "$DOCROOT/listing" && seq -f "entry-%04g.html" 2000 | xargs touch)
+
+# The server writes its logs to the working directory; keep them out of the tree.
+(cd "$WORKDIR" && exec "$ROOT/webserver" --autoindex $SERVER_ARGS tiny.html "$PORT" "$(nproc)" "$THREADS" 5000 2043 "$DOCROOT" \
+    > "$WORKDIR/server.out" 2>&1) &
+SERVER_PID=$!
+
+for _ in $(seq 50); do
+    if grep -q "listening" "$WORKDIR/server.out" 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+if ! grep -q "listening" "$WORKDIR/server.out"; then
+    echo "webserver did not start:" >&2
+    cat "$WORKDIR/server.out" >&2
+    exit 1
+fi
+
+run() {
+    "$ROOT/bench/loadgen" -p "$PORT" -d "$DURATION" -o "$RAW" "$@"
+}
+
+run -l tiny-keepalive    -c "$CONNECTIONS" /tiny.html
+run -l tiny-close        -c "$CONNECTIONS" -k 0 /tiny.html
+run -l medium-keepalive  -c "$CONNECTIONS" /medium.bin
+run -l large-keepalive   -c 4 /large.bin
+run -l listing-keepalive -c "$CONNECTIONS" /listing/
+run -l notfound          -c "$CONNECTIONS" /missing.html
+run -l mixed-open-loop   -c "$CONNECTIONS" -r "$RATE" /tiny.html /medium.bin /tiny.html /missing.html
+
+mkdir -p "$ROOT/bench/results"
+REVISION=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+STAMP=$(date -u +%Y%m%dT%H%M%SZ)
+OUT="$ROOT/bench/results/$STAMP-$REVISION.json"
+{
+    printf '{"revision": "%s", "timestamp": "%s", "host": "%s", "cpus": %s, "server_threads": %s, "results": [\n' \
+        "$REVISION" "$STAMP" "$(hostname)" "$(nproc)" "$THREADS"
+    sed '$!s/$/,/' "$RAW"
+    printf ']}\n'
+} > "$OUT"
+echo "Results written to $OUT"
@@ -0,0 +1,257 @@
+// bench/utf_bench.c
+//
+// Throughput of the validators in parseutf.c for every kernel this CPU can
+// run. Each corpus is validated repeatedly and reported in GB/s. Before
+// timing, each corpus is corrupted at random offsets and every kernel must
+// return the same result as the scalar one, both in one call and streamed
+// in pieces of several sizes.
+//
+//     make utf_bench && ./bench/utf_bench [megabytes] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../server.h"
+
+static const char *kernel_names[] = {"scalar", "sse2", "avx2"};
+#define NUM_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+typedef enum { ENC_UTF8, ENC_UTF16, ENC_UTF32 } Encoding;
+
+typedef struct {
+    const char *name;
+    Encoding encoding;
+    unsigned char *data;
+    size_t len;
+} Corpus;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills len bytes by repeating sample, cut at a character boundary.
+static unsigned char *repeat_sample(const char *sample, size_t unit, size_t len, size_t *out_len) {
+    size_t sample_len = strlen(sample);
+    unsigned char *buffer = malloc(len + 4);
+    size_t used = 0;
+    while (used + sample_len <= len) {
+        memcpy(buffer + used, sample, sample_len);
+        used += sample_len;
+    }
+    used -= used % unit;
+    memset(buffer + used, 0, 4);
+    *out_len = used;
+    return buffer;
+}
+
+// Widens a UTF-8 sample to little-endian UTF-16 or UTF-32.
+static unsigned char *widen(const char *sample, Encoding encoding, size_t len, size_t *out_len) {
+    const unsigned char *s = (const unsigned char *)sample;
+    unsigned code_points[256];
+    size_t count = 0;
+    while (*s && count < 256) {
+        unsigned cp;
+        int extra;
+        if (*s < 0x80) { cp = *s; extra = 0; }
+        else if (*s < 0xE0) { cp = *s & 0x1F; extra = 1; }
+        else if (*s < 0xF0) { cp = *s & 0x0F; extra = 2; }
+        else { cp = *s & 0x07; extra = 3; }
+        s++;
+        while (extra-- > 0) {
+            cp = (cp << 6) | (*s++ & 0x3F);
+        }
+        code_points[count++] = cp;
+    }
+
+    unsigned char *buffer = malloc(len + 4);
+    size_t used = 0;
+    for (size_t i = 0; ; i = (i + 1) % count) {
+        unsigned cp = code_points[i];
+        if (encoding == ENC_UTF32) {
+            if (used + 4 > len) break;
+            buffer[used++] = cp & 0xFF;
+            buffer[used++] = (cp >> 8) & 0xFF;
+            buffer[used++] = (cp >> 16) & 0xFF;
+            buffer[used++] = cp >> 24;
+        } else if (cp >= 0x10000) {
+            if (used + 4 > len) break;
+            unsigned v = cp - 0x10000;
+            unsigned high = 0xD800 | (v >> 10), low = 0xDC00 | (v & 0x3FF);
+            buffer[used++] = high & 0xFF;
+            buffer[used++] = high >> 8;
+            buffer[used++] = low & 0xFF;
+            buffer[used++] = low >> 8;
+        } else {
+            if (used + 2 > len) break;
+            buffer[used++] = cp & 0xFF;
+            buffer[used++] = cp >> 8;
+        }
+    }
+    memset(buffer + used, 0, 4);
+    *out_len = used;
+    return buffer;
+}
+
+static int validate(const Corpus *corpus, const unsigned char *data) {
+    switch (corpus->encoding) {
+    case ENC_UTF16: return validate_utf16(data, (unsigned)corpus->len, 0);
+    case ENC_UTF32: return validate_utf32(data, (unsigned)corpus->len, 0);
+    default:        return validate_utf8(data, (unsigned)corpus->len);
+    }
+}
+
+// Corrupts one or two bytes of copy[0..len) at a random offset, as cross_check() does.
+static void damage(unsigned char *copy, size_t len, int trial) {
+    size_t at = (size_t)rand() % len;
+    copy[at] = (unsigned char)rand();
+    if (trial % 3 == 0 && at + 1 < len) {
+        copy[at + 1] = (unsigned char)rand();
+    }
+}
+
+// Every kernel must agree with the scalar one on clean and damaged input.
+static void cross_check(const Corpus *corpus, int trials) {
+    unsigned char *copy = malloc(corpus->len + 4);
+    for (int t = 0; t <= trials; t++) {
+        memcpy(copy, corpus->data, corpus->len + 4);
+        if (t > 0) {
+            damage(copy, corpus->len, t);
+        }
+
+        utf_select_kernel("scalar");
+        int expected = validate(corpus, copy);
+        for (size_t k = 1; k < NUM_KERNELS; k++) {
+            if (utf_select_kernel(kernel_names[k]) != 0) {
+                continue;
+            }
+            int got = validate(corpus, copy);
+            if (got != expected) {
+                fprintf(stderr, "%s: %s returned %d, scalar returned %d\n",
+                        corpus->name, kernel_names[k], got, expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    free(copy);
+}
+
+// Streams data in piece-byte calls; returns 0 if valid, else 1 + the reported error offset.
+static size_t stream_verdict(const unsigned char *data, size_t len, size_t piece) {
+    Utf8Stream stream;
+    utf8_stream_init(&stream);
+    int result = 0;
+    for (size_t at = 0; at < len && result == 0; at += piece) {
+        size_t n = len - at < piece ? len - at : piece;
+        result = utf8_stream_feed(&stream, data + at, n);
+    }
+    if (result == 0) {
+        result = utf8_stream_finish(&stream);
+    }
+    return result == 0 ? 0 : 1 + stream.error_offset;
+}
+
+/*
+ * The streaming API must give every kernel the scalar verdict and error
+ * offset however the input is cut, on clean and damaged input. Pieces that
+ * end inside a character exercise the state carried between calls. Runs on
+ * the first STREAM_WINDOW bytes, as one-byte pieces over a whole corpus
+ * would take too long.
+ */
+#define STREAM_WINDOW (64 * 1024)
+
+static void stream_check(const Corpus *corpus, int trials) {
+    size_t len = corpus->len < STREAM_WINDOW ? corpus->len : STREAM_WINDOW;
+    unsigned char *copy = malloc(len);
+    for (int t = 0; t <= trials; t++) {
+        memcpy(copy, corpus->data, len);
+        if (t > 0) {
+            damage(copy, len, t);
+        }
+
+        utf_select_kernel("scalar");
+        size_t expected = stream_verdict(copy, len, len);
+        for (size_t k = 0; k < NUM_KERNELS; k++) {
+            if (utf_select_kernel(kernel_names[k]) != 0) {
+                continue;
+            }
+            for (size_t piece = 1; piece <= 4099; piece = piece * 3 + 2) {
+                size_t got = stream_verdict(copy, len, piece);
+                if (got != expected) {
+                    fprintf(stderr, "%s: %s stream with %zu-byte pieces returned %zu, scalar returned %zu\n",
+                            corpus->name, kernel_names[k], piece, got, expected);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    free(copy);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 16;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    size_t len = megabytes << 20;
+
+    const char *ascii = "GET /static/app.js HTTP/1.1 plain ASCII text, headers and paths. ";
+    const char *latin = "Größe, café, naïve façade, Ærø, señor. ";
+    const char *cjk = "日本語のテキスト、中文文本。한국어 텍스트. ";
+    const char *emoji = "emoji \xF0\x9F\x98\x80\xF0\x9F\x9A\x80\xF0\x9F\x8C\x8D mixed text \xF0\x9F\x8E\x89 ";
+
+    Corpus corpora[8];
+    int n = 0;
+    corpora[n].name = "utf8-ascii"; corpora[n].encoding = ENC_UTF8;
+    corpora[n].data = repeat_sample(ascii, 1, len, &corpora[n].len); n++;
+    corpora[n].name = "utf8-latin"; corpora[n].encoding = ENC_UTF8;
+    corpora[n].data = repeat_sample(latin, strlen(latin), len, &corpora[n].len); n++;
+    corpora[n].name = "utf8-cjk"; corpora[n].encoding = ENC_UTF8;
+    corpora[n].data = repeat_sample(cjk, strlen(cjk), len, &corpora[n].len); n++;
+    corpora[n].name = "utf8-emoji"; corpora[n].encoding = ENC_UTF8;
+    corpora[n].data = repeat_sample(emoji, strlen(emoji), len, &corpora[n].len); n++;
+    corpora[n].name = "utf16-latin"; corpora[n].encoding = ENC_UTF16;
+    corpora[n].data = widen(latin, ENC_UTF16, len, &corpora[n].len); n++;
+    corpora[n].name = "utf16-emoji"; corpora[n].encoding = ENC_UTF16;
+    corpora[n].data = widen(emoji, ENC_UTF16, len, &corpora[n].len); n++;
+    corpora[n].name = "utf32-cjk"; corpora[n].encoding = ENC_UTF32;
+    corpora[n].data = widen(cjk, ENC_UTF32, len, &corpora[n].len); n++;
+
+    srand(1);
+    for (int c = 0; c < n; c++) {
+        cross_check(&corpora[c], 50);
+        if (corpora[c].encoding == ENC_UTF8) {
+            stream_check(&corpora[c], 50);
+        }
+    }
+
+    printf("%-14s", "corpus");
+    for (size_t k = 0; k < NUM_KERNELS; k++) {
+        printf(" %10s", kernel_names[k]);
+    }
+    printf("   (GB/s, %zu MB x %d)\n", megabytes, rounds);
+
+    for (int c = 0; c < n; c++) {
+        printf("%-14s", corpora[c].name);
+        for (size_t k = 0; k < NUM_KERNELS; k++) {
+            if (utf_select_kernel(kernel_names[k]) != 0) {
+                printf(" %10s", "n/a");
+                continue;
+            }
+            double start = now_seconds();
+            long long sink = 0;
+            for (int r = 0; r < rounds; r++) {
+                sink += validate(&corpora[c], corpora[c].data);
+            }
+            double elapsed = now_seconds() - start;
+            if (sink <= 0) {
+                fprintf(stderr, "%s: corpus rejected\n", corpora[c].name);
+                return EXIT_FAILURE;
+            }
+            printf(" %10.2f", (double)corpora[c].len * rounds / elapsed / 1e9);
+        }
+        printf("\n");
+        free(corpora[c].data);
+    }
+    return 0;
+}
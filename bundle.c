@@ -0,0 +1,717 @@
+// bundle.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "server.h"
+
+/*
+ * Docroot bundles. `--pack` compiles a docroot into one immutable file:
+ * an open-addressed hash index of the request paths, and per file the
+ * header lines that do not depend on the server's options (Content-Type,
+ * Content-Length, ETag, Last-Modified, Content-Encoding / Vary), its
+ * validators, and the bytes of the file and of its precompressed sidecars.
+ * With `--bundle` the server maps that file read-only at startup and
+ * answers every request from the mapping through send_cached(): a lookup
+ * is one hash probe, and no request makes a file system call.
+ *
+ * SIGHUP maps the bundle path again and swaps it in. Each worker keeps a
+ * reference to the bundle it last used and picks up the new one on its
+ * next request; connections hold a reference while they send, so the old
+ * mapping goes away once its last response is out. The packer writes a
+ * temporary file and renames it over the output, so a deploy is: pack,
+ * then SIGHUP.
+ */
+
+#define BUNDLE_MAGIC "WSBUNDLE"
+#define BUNDLE_VERSION 1
+#define BUNDLE_CODINGS 4            // variant slots per entry; content_codings[] must fit
+#define BUNDLE_BODY_ALIGN 64
+#define PACK_COPY_SIZE 65536
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;       // files and their precompressed variants
+    uint32_t slot_count;        // index size, a power of two
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t slots_offset;      // slot_count uint32_t: entry index + 1, 0 when empty
+    uint64_t entries_offset;
+} BundleHeader;
+
+/*
+ * One representation. `head` holds the header lines that go between the
+ * status line and Cache-Control, `tail` those between Cache-Control and
+ * Connection. Variants are not in the index; they hang off the entry of
+ * the file they were made from.
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t path_offset;
+    uint64_t head_offset;
+    uint64_t tail_offset;
+    uint64_t body_offset;
+    uint64_t body_length;
+    int64_t mtime;
+    uint32_t path_length;
+    uint32_t head_length;
+    uint32_t tail_length;
+    uint32_t encodings;                 // ENCODING_* of the file's variants, also set on them
+    uint32_t variants[BUNDLE_CODINGS];  // entry index + 1, in content_codings[] order
+    char etag[ETAG_SIZE];
+} BundleEntry;
+
+typedef struct Bundle {
+    char *map;
+    size_t size;
+    const BundleHeader *header;
+    const uint32_t *slots;
+    const BundleEntry *entries;
+    FileCacheEntry *files;      // one per entry, header and body pointing into the mapping
+    char *headers;              // the files' 200 headers
+    int refs;
+} Bundle;
+
+static pthread_mutex_t bundle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Bundle *current_bundle;          // holds a reference
+static unsigned long bundle_generation;
+
+static __thread Bundle *thread_bundle;  // holds a reference
+static __thread unsigned long thread_generation;
+
+static uint64_t hash_bytes(const char *data, size_t len) {
+    // FNV-1a
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes (or, with a NULL dst, measures) a 200 header up to the Date line.
+static size_t build_header(char *dst, const Bundle *bundle, const BundleEntry *entry,
+                           const char *cache_control, const char *connection) {
+    const char *parts[] = {
+        "HTTP/1.1 200 OK\r\n", NULL, "Cache-Control: ", cache_control, "\r\n", NULL,
+        "Connection: ", connection, "\r\n"
+    };
+    size_t lengths[sizeof(parts) / sizeof(parts[0])];
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        lengths[i] = parts[i] ? strlen(parts[i]) : 0;
+    }
+    parts[1] = bundle->map + entry->head_offset;
+    lengths[1] = entry->head_length;
+    parts[5] = bundle->map + entry->tail_offset;
+    lengths[5] = entry->tail_length;
+
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (dst != NULL) {
+            memcpy(dst + len, parts[i], lengths[i]);
+        }
+        len += lengths[i];
+    }
+    return len;
+}
+
+static int range_valid(uint64_t offset, uint64_t length, size_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+// Checks that every offset in the mapping stays inside it.
+static int bundle_valid(const Bundle *bundle) {
+    const BundleHeader *header = bundle->header;
+    if (bundle->size < sizeof(BundleHeader) || memcmp(header->magic, BUNDLE_MAGIC, 8) != 0 ||
+        header->version != BUNDLE_VERSION || header->file_size != bundle->size ||
+        header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+        header->slots_offset % sizeof(uint32_t) != 0 || header->entries_offset % sizeof(uint64_t) != 0 ||
+        !range_valid(header->slots_offset, (uint64_t)header->slot_count * sizeof(uint32_t), bundle->size) ||
+        !range_valid(header->entries_offset, (uint64_t)header->entry_count * sizeof(BundleEntry), bundle->size)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        if (bundle->slots[i] > header->entry_count) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        const BundleEntry *entry = &bundle->entries[i];
+        if (!range_valid(entry->path_offset, entry->path_length, bundle->size) ||
+            !range_valid(entry->head_offset, entry->head_length, bundle->size) ||
+            !range_valid(entry->tail_offset, entry->tail_length, bundle->size) ||
+            !range_valid(entry->body_offset, entry->body_length, bundle->size) ||
+            memchr(entry->etag, '\0', ETAG_SIZE) == NULL) {
+            return 0;
+        }
+        for (int c = 0; c < BUNDLE_CODINGS; c++) {
+            if (entry->variants[c] > header->entry_count) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void bundle_free(Bundle *bundle) {
+    if (bundle->map != NULL) {
+        munmap(bundle->map, bundle->size);
+    }
+    free(bundle->files);
+    free(bundle->headers);
+    free(bundle);
+}
+
+void bundle_release(Bundle *bundle) {
+    if (__atomic_sub_fetch(&bundle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        bundle_free(bundle);
+    }
+}
+
+// Maps and checks the bundle at `path` and builds its responses. Returns NULL on failure.
+static Bundle *bundle_open(const char *path, const Server *config) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(BundleHeader)) {
+        close(fd);
+        log_error("Bundle is not a regular file or too short");
+        return NULL;
+    }
+
+    Bundle *bundle = calloc(1, sizeof(Bundle));
+    if (bundle == NULL) {
+        close(fd);
+        perror("malloc failed");
+        return NULL;
+    }
+    bundle->size = (size_t)st.st_size;
+    bundle->map = mmap(NULL, bundle->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bundle->map == MAP_FAILED) {
+        perror("mmap(bundle)");
+        bundle->map = NULL;
+        bundle_free(bundle);
+        return NULL;
+    }
+    // Start reading the whole file in now rather than on the first
+    // requests. Huge pages only take where the file system supports them
+    // for the page cache, so a refusal is not an error.
+    madvise(bundle->map, bundle->size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    madvise(bundle->map, bundle->size, MADV_HUGEPAGE);
+#endif
+
+    bundle->header = (const BundleHeader *)bundle->map;
+    bundle->slots = (const uint32_t *)(bundle->map + bundle->header->slots_offset);
+    bundle->entries = (const BundleEntry *)(bundle->map + bundle->header->entries_offset);
+    if (!bundle_valid(bundle)) {
+        log_error("Bundle is corrupt or was packed by another version");
+        bundle_free(bundle);
+        return NULL;
+    }
+
+    uint32_t count = bundle->header->entry_count;
+    size_t headers_size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        headers_size += build_header(NULL, bundle, &bundle->entries[i], config->cache_control, "close") +
+                        build_header(NULL, bundle, &bundle->entries[i], config->cache_control, "keep-alive");
+    }
+    bundle->files = calloc(count ? count : 1, sizeof(FileCacheEntry));
+    bundle->headers = malloc(headers_size ? headers_size : 1);
+    if (bundle->files == NULL || bundle->headers == NULL) {
+        perror("malloc failed");
+        bundle_free(bundle);
+        return NULL;
+    }
+
+    char *next = bundle->headers;
+    for (uint32_t i = 0; i < count; i++) {
+        const BundleEntry *entry = &bundle->entries[i];
+        FileCacheEntry *file = &bundle->files[i];
+        for (int keep_alive = 0; keep_alive <= 1; keep_alive++) {
+            file->header[keep_alive] = next;
+            file->header_len[keep_alive] = build_header(next, bundle, entry, config->cache_control,
+                                                        keep_alive ? "keep-alive" : "close");
+            next += file->header_len[keep_alive];
+        }
+        file->body = bundle->map + entry->body_offset;
+        file->body_len = (size_t)entry->body_length;
+        file->encodings = (int)entry->encodings;
+        memcpy(file->etag, entry->etag, ETAG_SIZE);
+        file->mtime = (time_t)entry->mtime;
+        file->bundle = bundle;
+    }
+    bundle->refs = 1;
+    return bundle;
+}
+
+/*
+ * Maps config->bundle_path and makes it the bundle new requests are served
+ * from. Returns 0, or -1 with the previous bundle (if any) still in place.
+ */
+int bundle_load(const Server *config) {
+    Bundle *bundle = bundle_open(config->bundle_path, config);
+    if (bundle == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&bundle_mutex);
+    Bundle *old = current_bundle;
+    current_bundle = bundle;
+    __atomic_add_fetch(&bundle_generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&bundle_mutex);
+    if (old != NULL) {
+        bundle_release(old);
+    }
+
+    printf("Serving %u responses from bundle %s\r\n", bundle->header->entry_count, config->bundle_path);
+    fflush(stdout);
+    return 0;
+}
+
+// The calling thread's bundle, refreshed after a reload.
+static Bundle *thread_current(void) {
+    unsigned long generation = __atomic_load_n(&bundle_generation, __ATOMIC_ACQUIRE);
+    if (thread_bundle == NULL || thread_generation != generation) {
+        pthread_mutex_lock(&bundle_mutex);
+        Bundle *bundle = current_bundle;
+        if (bundle != NULL) {
+            __atomic_add_fetch(&bundle->refs, 1, __ATOMIC_RELAXED);
+        }
+        generation = bundle_generation;
+        pthread_mutex_unlock(&bundle_mutex);
+
+        if (thread_bundle != NULL) {
+            bundle_release(thread_bundle);
+        }
+        thread_bundle = bundle;
+        thread_generation = generation;
+    }
+    return thread_bundle;
+}
+
+// Drops the calling thread's reference; for a worker on its way out.
+void bundle_thread_release(void) {
+    if (thread_bundle != NULL) {
+        bundle_release(thread_bundle);
+        thread_bundle = NULL;
+    }
+}
+
+/*
+ * Resolves "." and ".." segments and repeated slashes in place, as
+ * realpath() would for a directory tree without symlinks. A path that ends
+ * in a slash, "." or ".." names a directory and keeps a trailing slash, so
+ * no file is found under it. Returns the new length, or -1 if the path
+ * climbs above the docroot.
+ */
+static int normalize_path(char *path) {
+    size_t in = 0, out = 0;
+    size_t len = strlen(path);
+    int directory = 0;
+    while (in < len) {
+        size_t end = in;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+        size_t segment = end - in;
+        directory = 1;
+        if (segment == 0 || (segment == 1 && path[in] == '.')) {
+            // empty or "."
+        } else if (segment == 2 && path[in] == '.' && path[in + 1] == '.') {
+            if (out == 0) {
+                return -1;
+            }
+            out--;      // drop the previous segment, keeping the slash before it
+            while (out > 0 && path[out - 1] != '/') {
+                out--;
+            }
+        } else {
+            memmove(path + out, path + in, segment);
+            out += segment;
+            path[out++] = '/';
+            directory = end < len;
+        }
+        in = end + 1;
+    }
+    if (out > 0 && !directory) {
+        out--;
+    }
+    path[out] = '\0';
+    return (int)out;
+}
+
+/*
+ * Finds the docroot-relative `path` in the current bundle and picks the
+ * variant `request` accepts best. Returns the response with a reference on
+ * its bundle, released with file_cache_release(), or NULL for a 404.
+ */
+FileCacheEntry *bundle_lookup(const char *path, const HttpRequest *request) {
+    Bundle *bundle = thread_current();
+    if (bundle == NULL) {
+        return NULL;
+    }
+
+    char key[BUFFER_SIZE];
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(key)) {
+        return NULL;
+    }
+    memcpy(key, path, path_len + 1);
+    int key_len = normalize_path(key);
+    if (key_len <= 0) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_bytes(key, (size_t)key_len);
+    uint32_t mask = bundle->header->slot_count - 1;
+    const BundleEntry *entry = NULL;
+    for (uint32_t slot = (uint32_t)hash & mask; bundle->slots[slot] != 0; slot = (slot + 1) & mask) {
+        const BundleEntry *candidate = &bundle->entries[bundle->slots[slot] - 1];
+        if (candidate->hash == hash && candidate->path_length == (uint32_t)key_len &&
+            memcmp(bundle->map + candidate->path_offset, key, (size_t)key_len) == 0) {
+            entry = candidate;
+            break;
+        }
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    size_t index = (size_t)(entry - bundle->entries);
+    int accepted = entry->encodings ? accepted_encodings(request) : 0;
+    for (int c = 0; content_codings[c].flag != 0 && c < BUNDLE_CODINGS; c++) {
+        if ((accepted & content_codings[c].flag) && entry->variants[c] != 0) {
+            index = entry->variants[c] - 1;
+            break;
+        }
+    }
+    __atomic_add_fetch(&bundle->refs, 1, __ATOMIC_RELAXED);
+    return &bundle->files[index];
+}
+
+/*
+ * Packer. Walks the docroot, collects every regular file (and every symlink
+ * that resolves to one inside the docroot) with its metadata, then writes
+ * the index, the entries, their strings and finally the bodies.
+ */
+
+typedef struct {
+    BundleEntry entry;
+    char *source;               // file the body is copied from
+    off_t size;                 // as walked; a file that changes is an error
+    struct timespec mtim;
+} PackFile;
+
+static const Server *pack_config;
+static PackFile *pack_files;
+static size_t pack_count;
+static size_t pack_capacity;
+static char *pack_strings;
+static size_t pack_strings_len;
+static size_t pack_strings_cap;
+static struct stat pack_output;     // an earlier bundle inside the docroot is not packed
+static int pack_output_exists;
+
+// Appends to the string area; returns its offset from the start of the area.
+static uint64_t pack_string(const char *text, size_t len) {
+    if (pack_strings_len + len > pack_strings_cap) {
+        size_t cap = pack_strings_cap ? pack_strings_cap * 2 : 65536;
+        while (cap < pack_strings_len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(pack_strings, cap);
+        if (grown == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        pack_strings = grown;
+        pack_strings_cap = cap;
+    }
+    memcpy(pack_strings + pack_strings_len, text, len);
+    pack_strings_len += len;
+    return pack_strings_len - len;
+}
+
+// Adds one representation of `source`; `path` is NULL for a variant. Returns its index.
+static size_t pack_add(const char *path, const char *source, const struct stat *st, const char *mime_type,
+                       const char *tail, int encodings) {
+    if (pack_count == pack_capacity) {
+        size_t capacity = pack_capacity ? pack_capacity * 2 : 256;
+        PackFile *grown = realloc(pack_files, capacity * sizeof(PackFile));
+        if (grown == NULL || capacity > UINT32_MAX - 1) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        pack_files = grown;
+        pack_capacity = capacity;
+    }
+    PackFile *file = &pack_files[pack_count];
+    memset(file, 0, sizeof(*file));
+    file->source = strdup(source);
+    if (file->source == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    file->size = st->st_size;
+    file->mtim = st->st_mtim;
+
+    BundleEntry *entry = &file->entry;
+    format_etag(entry->etag, sizeof(entry->etag), st);
+    entry->mtime = (int64_t)st->st_mtime;
+    entry->body_length = (uint64_t)st->st_size;
+    entry->encodings = (uint32_t)encodings;
+    if (path != NULL) {
+        entry->path_length = (uint32_t)strlen(path);
+        entry->path_offset = pack_string(path, entry->path_length);
+        entry->hash = hash_bytes(path, entry->path_length);
+    }
+
+    char date[40];
+    char head[512];
+    format_http_date(date, sizeof(date), st->st_mtime);
+    int n = snprintf(head, sizeof(head), "Content-Type: %s\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n",
+                     mime_type, (long long)st->st_size, entry->etag, date);
+    entry->head_length = (uint32_t)n;
+    entry->head_offset = pack_string(head, (size_t)n);
+    entry->tail_length = (uint32_t)strlen(tail);
+    entry->tail_offset = pack_string(tail, entry->tail_length);
+    return pack_count++;
+}
+
+// Same rule as the server's sidecar probe: a regular file no older than its source.
+static int sidecar_usable(const char *sidecar, const struct stat *source, struct stat *st) {
+    return lstat(sidecar, st) == 0 && S_ISREG(st->st_mode) &&
+           (st->st_mtim.tv_sec > source->st_mtim.tv_sec ||
+            (st->st_mtim.tv_sec == source->st_mtim.tv_sec && st->st_mtim.tv_nsec >= source->st_mtim.tv_nsec));
+}
+
+static int pack_tree_entry(const char *fpath, const struct stat *walked, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F && type != FTW_SL) {
+        return 0;
+    }
+    if (type == FTW_F && pack_output_exists && walked->st_dev == pack_output.st_dev &&
+        walked->st_ino == pack_output.st_ino) {
+        return 0;
+    }
+
+    // Serve what a request for this path would get from the docroot: the
+    // file realpath() leads to, if it is inside.
+    char resolved[PATH_MAX];
+    struct stat st;
+    const char *docroot = pack_config->docroot;
+    size_t docroot_len = strlen(docroot);
+    int docroot_is_root = (docroot_len == 1 && docroot[0] == '/');
+    if (realpath(fpath, resolved) == NULL || stat(resolved, &st) != 0 || !S_ISREG(st.st_mode) ||
+        strncmp(resolved, docroot, docroot_len) != 0 ||
+        (!docroot_is_root && resolved[docroot_len] != '/')) {
+        return 0;
+    }
+    if (pack_output_exists && st.st_dev == pack_output.st_dev && st.st_ino == pack_output.st_ino) {
+        return 0;
+    }
+
+    const char *path = fpath + docroot_len;
+    while (*path == '/') {
+        path++;
+    }
+    const char *mime_type = get_mime_type(resolved);
+
+    // Variants first, so the file's entry can point at them.
+    uint32_t variants[BUNDLE_CODINGS] = {0};
+    int encodings = 0;
+    if (is_compressible_type(mime_type)) {
+        for (int c = 0; content_codings[c].flag != 0 && c < BUNDLE_CODINGS; c++) {
+            char sidecar[PATH_MAX];
+            struct stat sidecar_st;
+            if (snprintf(sidecar, sizeof(sidecar), "%s%s", resolved, content_codings[c].suffix) < (int)sizeof(sidecar) &&
+                sidecar_usable(sidecar, &st, &sidecar_st)) {
+                variants[c] = (uint32_t)pack_add(NULL, sidecar, &sidecar_st, mime_type, content_codings[c].headers, 0) + 1;
+                encodings |= content_codings[c].flag;
+            }
+        }
+    }
+    for (int c = 0; c < BUNDLE_CODINGS; c++) {
+        if (variants[c] != 0) {
+            pack_files[variants[c] - 1].entry.encodings = (uint32_t)encodings;
+        }
+    }
+
+    size_t index = pack_add(path, resolved, &st, mime_type, encodings ? vary_header : "", encodings);
+    memcpy(pack_files[index].entry.variants, variants, sizeof(variants));
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Appends the bytes of pack_files[i]'s source, which must still be as walked.
+static int copy_body(int out_fd, const PackFile *file, char *buf) {
+    int fd = open(file->source, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(file->source);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (st.st_size != file->size || st.st_mtim.tv_sec != file->mtim.tv_sec ||
+        st.st_mtim.tv_nsec != file->mtim.tv_nsec) {
+        fprintf(stderr, "%s changed while packing\n", file->source);
+        close(fd);
+        return -1;
+    }
+    off_t left = file->size;
+    while (left > 0) {
+        ssize_t n = read(fd, buf, PACK_COPY_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || write_all(out_fd, buf, (size_t)(n < left ? n : left)) < 0) {
+            perror(file->source);
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Packs config->docroot into config->pack_path. The bundle is written to a
+ * temporary file beside the output and renamed over it, so a server
+ * reloading on SIGHUP never maps a half-written bundle. Returns 0 or -1.
+ */
+int bundle_pack(const Server *config) {
+    pack_config = config;
+    if (config->mime_types != NULL && load_mime_types(config->mime_types) < 0) {
+        perror(config->mime_types);
+        return -1;
+    }
+    pack_output_exists = stat(config->pack_path, &pack_output) == 0;
+    if (nftw(config->docroot, pack_tree_entry, 32, FTW_PHYS) != 0) {
+        perror(config->docroot);
+        return -1;
+    }
+
+    // Index at most half full, so probes stay short.
+    uint32_t slot_count = 16;
+    while (slot_count < pack_count * 2) {
+        slot_count *= 2;
+    }
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    for (size_t i = 0; i < pack_count; i++) {
+        const BundleEntry *entry = &pack_files[i].entry;
+        if (entry->path_length == 0) {
+            continue;       // a variant
+        }
+        uint32_t slot = (uint32_t)entry->hash & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = (uint32_t)i + 1;
+    }
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, 8);
+    header.version = BUNDLE_VERSION;
+    header.entry_count = (uint32_t)pack_count;
+    header.slot_count = slot_count;
+    header.slots_offset = sizeof(BundleHeader);
+    header.entries_offset = header.slots_offset + (uint64_t)slot_count * sizeof(uint32_t);
+    uint64_t strings_offset = header.entries_offset + (uint64_t)pack_count * sizeof(BundleEntry);
+    uint64_t offset = strings_offset + pack_strings_len;
+    for (size_t i = 0; i < pack_count; i++) {
+        BundleEntry *entry = &pack_files[i].entry;
+        entry->path_offset += strings_offset;
+        entry->head_offset += strings_offset;
+        entry->tail_offset += strings_offset;
+        offset = (offset + BUNDLE_BODY_ALIGN - 1) & ~(uint64_t)(BUNDLE_BODY_ALIGN - 1);
+        entry->body_offset = offset;
+        offset += entry->body_length;
+    }
+    header.file_size = offset;
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", config->pack_path) >= (int)sizeof(temp_path)) {
+        fprintf(stderr, "Bundle path too long: %s\n", config->pack_path);
+        free(slots);
+        return -1;
+    }
+    int fd = mkostemp(temp_path, O_CLOEXEC);
+    if (fd < 0) {
+        perror(temp_path);
+        free(slots);
+        return -1;
+    }
+
+    char *buf = malloc(PACK_COPY_SIZE);
+    static const char padding[BUNDLE_BODY_ALIGN];
+    int failed = buf == NULL || fchmod(fd, 0644) != 0 ||
+                 write_all(fd, &header, sizeof(header)) < 0 ||
+                 write_all(fd, slots, (size_t)slot_count * sizeof(uint32_t)) < 0;
+    for (size_t i = 0; !failed && i < pack_count; i++) {
+        failed = write_all(fd, &pack_files[i].entry, sizeof(BundleEntry)) < 0;
+    }
+    if (!failed) {
+        failed = write_all(fd, pack_strings, pack_strings_len) < 0;
+    }
+    uint64_t written = strings_offset + pack_strings_len;
+    for (size_t i = 0; !failed && i < pack_count; i++) {
+        const BundleEntry *entry = &pack_files[i].entry;
+        failed = write_all(fd, padding, (size_t)(entry->body_offset - written)) < 0 ||
+                 copy_body(fd, &pack_files[i], buf) < 0;
+        written = entry->body_offset + entry->body_length;
+    }
+    if (!failed && (fsync(fd) != 0 || rename(temp_path, config->pack_path) != 0)) {
+        failed = 1;
+    }
+    if (failed) {
+        perror(config->pack_path);
+        unlink(temp_path);
+    }
+    close(fd);
+    free(buf);
+    free(slots);
+    if (failed) {
+        return -1;
+    }
+
+    printf("Packed %zu responses into %s (%llu bytes)\n", pack_count, config->pack_path,
+           (unsigned long long)header.file_size);
+    return 0;
+}
@@ -0,0 +1,556 @@
+// cache.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "server.h"
+
+/*
+ * Sharded in-memory cache of small static files. Each entry holds the file
+ * bytes and the complete response header (one per Connection token), so a
+ * hit is served with a single writev() and no file syscalls. Every shard
+ * evicts with the CLOCK algorithm once it exceeds its share of the byte
+ * budget; entries are reference counted so eviction never frees memory a
+ * connection is still sending from.
+ */
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    pthread_mutex_t mutex;
+    FileCacheEntry *buckets[CACHE_BUCKETS];
+    FileCacheEntry **clock;     // resident entries in CLOCK order
+    size_t clock_len;
+    size_t clock_cap;
+    size_t hand;
+    size_t bytes;
+} CacheShard;
+
+static CacheShard shards[CACHE_SHARDS];
+static size_t shard_capacity;
+static size_t max_entry_size;
+static volatile int cache_enabled;
+
+// Bumped by every invalidation so a fill that raced with a change is dropped.
+static unsigned long cache_generation;
+
+typedef struct {
+    int wd;
+    char *path;
+} Watch;
+
+static int inotify_fd = -1;
+static Watch *watches;
+static size_t watch_count;
+static size_t watch_cap;
+
+static unsigned long hash_path(const char *path) {
+    // FNV-1a
+    unsigned long hash = 1469598103934665603UL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static CacheShard *shard_for(unsigned long hash) {
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static void entry_free(FileCacheEntry *entry) {
+    free(entry->path);
+    free(entry->header[0]);
+    free(entry->header[1]);
+    free(entry->body);
+    free(entry);
+}
+
+void file_cache_release(FileCacheEntry *entry) {
+    if (entry->bundle != NULL) {
+        bundle_release(entry->bundle);
+    } else if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        entry_free(entry);
+    }
+}
+
+// Unlinks an entry from its shard; caller holds the shard mutex.
+static void shard_remove(CacheShard *shard, size_t clock_index) {
+    FileCacheEntry *entry = shard->clock[clock_index];
+
+    FileCacheEntry **link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    shard->clock[clock_index] = shard->clock[--shard->clock_len];
+    if (shard->hand >= shard->clock_len) {
+        shard->hand = 0;
+    }
+    shard->bytes -= entry->body_len;
+    file_cache_release(entry);
+}
+
+static void shard_evict_until(CacheShard *shard, size_t incoming) {
+    while (shard->clock_len > 0 && shard->bytes + incoming > shard_capacity) {
+        FileCacheEntry *entry = shard->clock[shard->hand];
+        if (entry->referenced) {
+            entry->referenced = 0;
+            shard->hand = (shard->hand + 1) % shard->clock_len;
+        } else {
+            shard_remove(shard, shard->hand);
+        }
+    }
+}
+
+FileCacheEntry *file_cache_lookup(const char *path) {
+    if (!cache_enabled) {
+        return NULL;
+    }
+
+    unsigned long hash = hash_path(path);
+    CacheShard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    FileCacheEntry *entry = shard->buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        entry->referenced = 1;
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return entry;
+}
+
+// The stored header stops before the Date line; send_cached() adds a fresh one.
+static char *format_header(const char *mime_type, off_t size, const char *extra_headers,
+                           const char *connection, size_t *len) {
+    char header[512];
+    int n = snprintf(header, sizeof(header), http_200, mime_type, (long long)size, extra_headers, connection);
+    if (n < 0 || (size_t)n >= sizeof(header)) {
+        return NULL;
+    }
+    *len = (size_t)n;
+    return strdup(header);
+}
+
+/*
+ * Wraps a malloc()ed body in an entry that is never published, so generated
+ * responses can go out through send_cached(). Takes ownership of `body`; the
+ * entry frees itself on the caller's file_cache_release(). Returns NULL (with
+ * `body` freed) if memory runs out.
+ */
+FileCacheEntry *file_cache_detached(char *body, size_t body_len, const char *mime_type, const char *extra_headers) {
+    FileCacheEntry *entry = calloc(1, sizeof(FileCacheEntry));
+    if (entry == NULL) {
+        free(body);
+        return NULL;
+    }
+    entry->body = body;
+    entry->body_len = body_len;
+    entry->refs = 1;
+    entry->header[0] = format_header(mime_type, (off_t)body_len, extra_headers, "close", &entry->header_len[0]);
+    entry->header[1] = format_header(mime_type, (off_t)body_len, extra_headers, "keep-alive", &entry->header_len[1]);
+    if (entry->header[0] == NULL || entry->header[1] == NULL) {
+        entry_free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/*
+ * Reads an already opened file into a new entry and publishes it. Returns
+ * the entry with a reference held for the caller, or NULL when the file is
+ * not cacheable; the caller then serves it from disk as usual.
+ * extra_headers go into the stored 200 header; encodings records which
+ * precompressed sidecars were found next to the file. `generation` is
+ * file_cache_generation() from before the file was opened: if anything
+ * under the docroot changed since, fd may be a file that was already
+ * replaced, so the entry is served once and not published.
+ */
+FileCacheEntry *file_cache_insert(const char *path, int fd, const struct stat *st, const char *mime_type,
+                                  const char *extra_headers, int encodings, unsigned long generation) {
+    if (!cache_enabled || (size_t)st->st_size > max_entry_size || (size_t)st->st_size > shard_capacity) {
+        return NULL;
+    }
+
+    FileCacheEntry *entry = calloc(1, sizeof(FileCacheEntry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash_path(path);
+    entry->path = strdup(path);
+    entry->body_len = (size_t)st->st_size;
+    entry->body = malloc(entry->body_len > 0 ? entry->body_len : 1);
+    entry->encodings = encodings;
+    format_etag(entry->etag, sizeof(entry->etag), st);
+    entry->mtime = st->st_mtime;
+    entry->header[0] = format_header(mime_type, st->st_size, extra_headers, "close", &entry->header_len[0]);
+    entry->header[1] = format_header(mime_type, st->st_size, extra_headers, "keep-alive", &entry->header_len[1]);
+    if (entry->path == NULL || entry->body == NULL || entry->header[0] == NULL || entry->header[1] == NULL) {
+        entry_free(entry);
+        return NULL;
+    }
+
+    size_t filled = 0;
+    while (filled < entry->body_len) {
+        ssize_t n = pread(fd, entry->body + filled, entry->body_len - filled, (off_t)filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            entry_free(entry);
+            return NULL;
+        }
+        filled += (size_t)n;
+    }
+
+    // One reference for the shard, one for the caller.
+    entry->refs = 2;
+    entry->referenced = 1;
+
+    CacheShard *shard = shard_for(entry->hash);
+    pthread_mutex_lock(&shard->mutex);
+
+    FileCacheEntry *existing = shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (existing != NULL && (existing->hash != entry->hash || strcmp(existing->path, path) != 0)) {
+        existing = existing->next;
+    }
+
+    if (existing != NULL || generation != __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE)) {
+        // Lost a race with another filler or with an invalidation: serve
+        // this copy once without publishing it.
+        pthread_mutex_unlock(&shard->mutex);
+        entry->refs = 1;
+        return entry;
+    }
+
+    if (shard->clock_len == shard->clock_cap) {
+        size_t cap = shard->clock_cap ? shard->clock_cap * 2 : 64;
+        FileCacheEntry **clock = realloc(shard->clock, cap * sizeof(*clock));
+        if (clock == NULL) {
+            pthread_mutex_unlock(&shard->mutex);
+            entry->refs = 1;
+            return entry;
+        }
+        shard->clock = clock;
+        shard->clock_cap = cap;
+    }
+
+    shard_evict_until(shard, entry->body_len);
+
+    entry->next = shard->buckets[entry->hash % CACHE_BUCKETS];
+    shard->buckets[entry->hash % CACHE_BUCKETS] = entry;
+    shard->clock[shard->clock_len++] = entry;
+    shard->bytes += entry->body_len;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return entry;
+}
+
+/*
+ * Drops every entry whose path equals `path` or lies beneath it. A NULL
+ * path empties the whole cache. A changed sidecar (foo.js.gz) also drops
+ * foo.js, whose entry records which sidecars exist.
+ */
+void file_cache_invalidate(const char *path) {
+    __atomic_add_fetch(&cache_generation, 1, __ATOMIC_ACQ_REL);
+
+    size_t path_len = path ? strlen(path) : 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        size_t j = 0;
+        while (j < shard->clock_len) {
+            const char *entry_path = shard->clock[j]->path;
+            if (path == NULL ||
+                (strncmp(entry_path, path, path_len) == 0 &&
+                 (entry_path[path_len] == '\0' || entry_path[path_len] == '/'))) {
+                // shard_remove() moves the last entry into slot j.
+                shard_remove(shard, j);
+            } else {
+                j++;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    for (const ContentCoding *coding = content_codings; path != NULL && coding->flag != 0; coding++) {
+        size_t suffix_len = strlen(coding->suffix);
+        if (path_len > suffix_len && strcmp(path + path_len - suffix_len, coding->suffix) == 0) {
+            char *base = strndup(path, path_len - suffix_len);
+            if (base != NULL) {
+                file_cache_invalidate(base);
+                free(base);
+            }
+            break;
+        }
+    }
+}
+
+unsigned long file_cache_generation(void) {
+    return __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Resolved-path cache: remembers what realpath() and the docroot check made
+ * of each docroot-joined request path, so a repeated URL skips the lstat()
+ * of every path component. An entry dies with any change under the docroot
+ * (it records the cache generation it was filled in) or after
+ * PATH_CACHE_TTL_MS, which covers symlink targets outside the watched tree
+ * and running without inotify. The table is direct-mapped and fixed in
+ * size: a colliding path replaces the previous occupant.
+ */
+
+typedef struct {
+    unsigned long hash;
+    char *key;
+    char *resolved;
+    int error;
+    int encodings;
+    unsigned long generation;
+    long long expires_ms;
+} PathCacheEntry;
+
+static PathCacheEntry path_entries[PATH_CACHE_ENTRIES];
+static pthread_mutex_t path_mutexes[CACHE_SHARDS];
+
+static pthread_mutex_t *path_mutex_for(size_t index) {
+    return &path_mutexes[index % CACHE_SHARDS];
+}
+
+// Copies a live entry for key into *out; returns 0 on a miss.
+int path_cache_lookup(const char *key, ResolvedPath *out) {
+    unsigned long hash = hash_path(key);
+    size_t index = hash % PATH_CACHE_ENTRIES;
+    PathCacheEntry *entry = &path_entries[index];
+    int hit = 0;
+
+    pthread_mutex_lock(path_mutex_for(index));
+    if (entry->key != NULL && entry->hash == hash &&
+        entry->generation == __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE) &&
+        entry->expires_ms > monotonic_ms() && strcmp(entry->key, key) == 0) {
+        out->error = entry->error;
+        out->encodings = entry->encodings;
+        strcpy(out->resolved, entry->resolved);
+        hit = 1;
+    }
+    pthread_mutex_unlock(path_mutex_for(index));
+    return hit;
+}
+
+/*
+ * Records how key resolved. `generation` is file_cache_generation() from
+ * before the lookup began; if anything changed since, the result may
+ * already be stale and is not kept.
+ */
+void path_cache_store(const char *key, const ResolvedPath *value, unsigned long generation) {
+    if (generation != __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    char *key_copy = strdup(key);
+    char *resolved_copy = strdup(value->resolved);
+    if (key_copy == NULL || resolved_copy == NULL) {
+        free(key_copy);
+        free(resolved_copy);
+        return;
+    }
+
+    unsigned long hash = hash_path(key);
+    size_t index = hash % PATH_CACHE_ENTRIES;
+    PathCacheEntry *entry = &path_entries[index];
+
+    pthread_mutex_lock(path_mutex_for(index));
+    char *old_key = entry->key;
+    char *old_resolved = entry->resolved;
+    entry->hash = hash;
+    entry->key = key_copy;
+    entry->resolved = resolved_copy;
+    entry->error = value->error;
+    entry->encodings = value->encodings;
+    entry->generation = generation;
+    entry->expires_ms = monotonic_ms() + PATH_CACHE_TTL_MS;
+    pthread_mutex_unlock(path_mutex_for(index));
+
+    free(old_key);
+    free(old_resolved);
+}
+
+static void disable_cache(const char *reason) {
+    log_error(reason);
+    cache_enabled = 0;
+    file_cache_invalidate(NULL);
+}
+
+static const char *watch_path(int wd) {
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            return watches[i].path;
+        }
+    }
+    return NULL;
+}
+
+static int add_watch(const char *path) {
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            // Same directory reached again (e.g. after a rename).
+            free(watches[i].path);
+            watches[i].path = strdup(path);
+            return 0;
+        }
+    }
+    if (watch_count == watch_cap) {
+        size_t cap = watch_cap ? watch_cap * 2 : 64;
+        Watch *grown = realloc(watches, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        watches = grown;
+        watch_cap = cap;
+    }
+    watches[watch_count].wd = wd;
+    watches[watch_count].path = strdup(path);
+    watch_count++;
+    return 0;
+}
+
+static void remove_watch(int wd) {
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            free(watches[i].path);
+            watches[i] = watches[--watch_count];
+            return;
+        }
+    }
+}
+
+static int watch_tree_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_D && add_watch(path) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int watch_tree(const char *root) {
+    return nftw(root, watch_tree_entry, 32, FTW_PHYS);
+}
+
+static void handle_watch_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        file_cache_invalidate(NULL);
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        remove_watch(event->wd);
+        return;
+    }
+
+    const char *dir = watch_path(event->wd);
+    if (dir == NULL) {
+        return;
+    }
+
+    if (event->len == 0) {
+        // The watched directory itself was deleted or moved.
+        file_cache_invalidate(dir);
+        return;
+    }
+
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        file_cache_invalidate(dir);
+        return;
+    }
+
+    file_cache_invalidate(path);
+
+    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        if (watch_tree(path) != 0) {
+            disable_cache("Failed to watch new directory; file cache disabled");
+        }
+    }
+}
+
+static void *watch_thread(void *arg) {
+    (void)arg;
+    char events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (cache_enabled) {
+        ssize_t len = read(inotify_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            disable_cache("inotify read failed; file cache disabled");
+            break;
+        }
+
+        for (char *p = events; p < events + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handle_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+void file_cache_init(const Server *config) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        pthread_mutex_init(&path_mutexes[i], NULL);
+    }
+
+    if (config->cache_size == 0) {
+        return;
+    }
+    shard_capacity = config->cache_size / CACHE_SHARDS;
+    max_entry_size = config->cache_max_file;
+
+    // Without change notifications the cache could serve stale files, so
+    // any failure to watch the docroot leaves it switched off.
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1");
+        log_error("inotify unavailable; file cache disabled");
+        return;
+    }
+    if (watch_tree(config->docroot) != 0) {
+        perror("inotify_add_watch");
+        log_error("Failed to watch docroot; file cache disabled");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return;
+    }
+
+    cache_enabled = 1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+        log_error("Failed to start file cache watcher; file cache disabled");
+        cache_enabled = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
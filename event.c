@@ -0,0 +1,447 @@
+// event.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "server.h"
+
+// Resets every field of a freshly accepted connection except the loop links
+// and the buffers.
+void connection_init(Connection *conn, int client_fd, const Server *config) {
+    conn->fd = client_fd;
+    conn->state = CONN_READING;
+    conn->in_len = 0;
+    conn->request_len = 0;
+    http_request_reset(&conn->request);
+    conn->request_started_ms = 0;
+    conn->request_started_ns = 0;
+    conn->response_started_ns = 0;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->file_fd = -1;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->copy_fallback = 0;
+    conn->stream = NULL;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    conn->pipe_pending = 0;
+    conn->range_count = 0;
+    conn->range_next = 0;
+    conn->range_mime = NULL;
+    conn->range_total = 0;
+    conn->cached = NULL;
+    conn->cached_sent = 0;
+    conn->status = 0;
+    conn->response_bytes = 0;
+    conn->client_ip[0] = '\0';
+    conn->client_key = 0;
+    conn->proxy = NULL;
+    conn->timer.prev = NULL;
+    conn->timer.next = NULL;
+    int want_ip = config->access_log || config->upstream_count > 0;     // logged / X-Forwarded-For
+    if (want_ip || config->rate_limit) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(client_fd, (struct sockaddr *)&peer, &peer_len) == 0) {
+            if (peer.ss_family == AF_INET) {
+                struct in_addr *addr = &((struct sockaddr_in *)&peer)->sin_addr;
+                conn->client_key = addr->s_addr;
+                if (want_ip) {
+                    inet_ntop(AF_INET, addr, conn->client_ip, sizeof(conn->client_ip));
+                }
+            } else if (peer.ss_family == AF_INET6) {
+                // One bucket per /64: a single host can pick any address inside it.
+                struct in6_addr *addr = &((struct sockaddr_in6 *)&peer)->sin6_addr;
+                memcpy(&conn->client_key, addr->s6_addr, sizeof(conn->client_key));
+                if (want_ip) {
+                    inet_ntop(AF_INET6, addr, conn->client_ip, sizeof(conn->client_ip));
+                }
+            }
+        }
+    }
+    conn->keep_alive = 0;
+    conn->requests_served = 0;
+    conn->last_request = 0;
+    conn->last_active_ms = monotonic_ms();
+    stats_add(STAT_CONNECTIONS_OPENED, 1);
+}
+
+Connection *connection_open(EventLoop *loop, int client_fd) {
+    Connection *conn = loop->free_connections;
+    if (conn != NULL) {
+        loop->free_connections = conn->next;
+        loop->free_count--;
+    } else {
+        conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            log_error("Failed to allocate connection state");
+            close(client_fd);
+            return NULL;
+        }
+    }
+    connection_init(conn, client_fd, loop->config);
+    // in[] and out[] are taken from the pool when the first bytes arrive.
+    conn->in = NULL;
+    conn->out = NULL;
+
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+
+    // Registered once, edge-triggered for both directions: handle_connection()
+    // always runs its current phase until EAGAIN, so no re-arming is needed.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+        perror("epoll_ctl(EPOLL_CTL_ADD)");
+        log_error("Failed to register client socket with event loop");
+        connection_close(loop, conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void connection_close(EventLoop *loop, Connection *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    close_file(conn);
+    if (conn->proxy != NULL) {
+        proxy_close(conn);
+    }
+    if (conn->cached != NULL) {
+        file_cache_release(conn->cached);
+    }
+    stream_close(conn);
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    // close() also drops the descriptor from the epoll set.
+    close(conn->fd);
+    timer_cancel(&conn->timer);
+    connection_release_buffers(conn);
+    stats_add(STAT_CONNECTIONS_CLOSED, 1);
+    if (loop->free_count < CONNECTION_FREE_MAX) {
+        conn->next = loop->free_connections;
+        loop->free_connections = conn;
+        loop->free_count++;
+    } else {
+        free(conn);
+    }
+}
+
+/*
+ * Returns 1 if the connection was closed and freed. A connection holds its
+ * pooled buffers only while a request is in flight: they are attached here
+ * when it becomes ready and handed back once it is waiting for the next
+ * request with nothing buffered, so idle keep-alive clients cost no page.
+ */
+static int dispatch(EventLoop *loop, Connection *conn) {
+    conn->last_active_ms = monotonic_ms();
+    if (conn->in == NULL && connection_attach_buffers(conn) < 0) {
+        connection_close(loop, conn);
+        return 1;
+    }
+    handle_connection(conn, loop->config);
+    if (conn->state == CONN_CLOSED) {
+        connection_close(loop, conn);
+        return 1;
+    }
+    if (conn->state == CONN_READING && conn->in_len == 0) {
+        connection_release_buffers(conn);
+    }
+    connection_schedule(&loop->timers, conn, loop->config);
+    return 0;
+}
+
+static void accept_from_queue(EventLoop *loop) {
+    long long enqueued_ns;
+    int client_fd = client_queue_pop_woken(&client_queue, &enqueued_ns);
+    if (client_fd < 0) {
+        return;
+    }
+    long long sojourn_ns = monotonic_ns() - enqueued_ns;
+    stats_record(STAGE_QUEUE, sojourn_ns);
+    if (!admission_admit(sojourn_ns)) {
+        reject_overloaded(client_fd);
+        stats_add(STAT_SHED_QUEUE_DELAY, 1);
+        return;
+    }
+
+    Connection *conn = connection_open(loop, client_fd);
+    if (conn != NULL) {
+        // The request may already be waiting in the socket buffer.
+        dispatch(loop, conn);
+    }
+}
+
+// Accepts directly from this worker's own SO_REUSEPORT listener.
+static void accept_from_listener(EventLoop *loop) {
+    while (1) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        Connection *conn = connection_open(loop, client_fd);
+        if (conn != NULL) {
+            dispatch(loop, conn);
+        }
+    }
+}
+
+/*
+ * Fires the timers that came due: idle keep-alive connections and clients
+ * that stopped reading are closed, requests taking too long to arrive get
+ * a 408 and silent upstreams a 504. A timer whose connection moved on
+ * since it was armed is simply re-armed for the new deadline.
+ */
+static void expire_timers(EventLoop *loop) {
+    long long now = monotonic_ms();
+    Connection *conn;
+    while ((conn = timer_wheel_expired(&loop->timers, now)) != NULL) {
+        TimeoutKind kind;
+        long long deadline = connection_deadline(conn, loop->config, &kind);
+        if (deadline > now) {
+            timer_arm(&loop->timers, &conn->timer, deadline);
+            continue;
+        }
+        stats_add(STAT_TIMEOUTS + kind, 1);
+        if (kind == TIMEOUT_REQUEST) {
+            handle_request_timeout(conn, loop->config);
+        } else if (kind == TIMEOUT_UPSTREAM) {
+            handle_upstream_timeout(conn, loop->config);
+        } else {
+            conn->state = CONN_CLOSED;
+        }
+        if (conn->state == CONN_CLOSED) {
+            connection_close(loop, conn);
+        } else {
+            conn->last_active_ms = now;
+            connection_schedule(&loop->timers, conn, loop->config);
+        }
+    }
+}
+
+/*
+ * Starts retiring the loop: it stops accepting, leaving the client queue to
+ * the other workers (or its listener's backlog to whoever else holds it),
+ * and from now on closes connections as soon as they sit between requests.
+ */
+static void start_draining(EventLoop *loop) {
+    loop->draining = 1;
+    loop->drain_deadline_ms = monotonic_ms() + loop->config->drain_timeout_ms;
+    int source_fd = loop->listen_fd >= 0 ? loop->listen_fd : client_queue.event_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source_fd, NULL) < 0) {
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+    }
+}
+
+/*
+ * Every response from now on says Connection: close. A connection already
+ * idle is closed once it has stayed idle for DRAIN_IDLE_MS; closing it
+ * sooner would race a client that just got its last keep-alive response
+ * and is sending the next request.
+ */
+static void close_drained_connections(EventLoop *loop) {
+    long long now = monotonic_ms();
+    int expired = now >= loop->drain_deadline_ms;
+    Connection *conn = loop->connections;
+    while (conn != NULL) {
+        Connection *next = conn->next;
+        conn->last_request = 1;
+        if (expired || (conn->state == CONN_READING && conn->in_len == 0 &&
+                        now - conn->last_active_ms >= DRAIN_IDLE_MS)) {
+            connection_close(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// Marks the thread finished so the pool can join it.
+static void *worker_exit(Worker *worker) {
+    __atomic_store_n(&worker->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Pins the calling worker thread to its assigned core, if it has one.
+void worker_pin(const Worker *worker) {
+    if (worker->cpu < 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_setaffinity_np");
+        log_error("Failed to pin worker thread; continuing unpinned");
+    }
+}
+
+// Mark the listener's and the wake eventfd's epoll registrations;
+// connections use their own pointer.
+static char listener_tag;
+static char wake_tag;
+static char closed_tag;     // replaces events of a connection freed earlier in the batch
+
+void *worker_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    EventLoop loop;
+    loop.config = worker->config;
+    loop.connections = NULL;
+    timer_wheel_init(&loop.timers, monotonic_ms());
+    loop.free_connections = NULL;
+    loop.free_count = 0;
+    loop.listen_fd = worker->listen_fd;
+    loop.draining = 0;
+    loop.drain_deadline_ms = 0;
+
+    worker_pin(worker);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1");
+        log_error("Failed to create worker event loop");
+        return worker_exit(worker);
+    }
+    if (loop.config->upstream_count > 0) {
+        proxy_thread_init(loop.epoll_fd);
+    }
+
+    // Either watch our own listener or, with EPOLLEXCLUSIVE so one queued
+    // socket doesn't wake every worker, the shared client queue.
+    struct epoll_event event;
+    if (loop.listen_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &listener_tag;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listen_fd, &event) < 0) {
+            perror("epoll_ctl(listener)");
+            log_error("Failed to watch listener from worker event loop");
+            close(loop.epoll_fd);
+            return worker_exit(worker);
+        }
+    } else {
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_queue.event_fd, &event) < 0) {
+            perror("epoll_ctl(client queue)");
+            log_error("Failed to watch client queue from worker event loop");
+            close(loop.epoll_fd);
+            return worker_exit(worker);
+        }
+    }
+
+    if (worker->wake_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &wake_tag;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) < 0) {
+            perror("epoll_ctl(wake)");
+            log_error("Failed to watch wake eventfd; commands wait for the next sweep");
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long long woke_ns = monotonic_ns();
+    while (1) {
+        unsigned long long busy_ns = (unsigned long long)(monotonic_ns() - woke_ns);
+        stats_add(STAT_BUSY_NS, busy_ns);
+        __atomic_store_n(&worker->busy_ns, worker->busy_ns + busy_ns, __ATOMIC_RELAXED);
+        int queue_fed = loop.listen_fd < 0 && !loop.draining;
+        if (queue_fed) {
+            client_queue_loop_sleeping(&client_queue, 1);
+        }
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, SWEEP_INTERVAL_MS);
+        if (queue_fed) {
+            client_queue_loop_sleeping(&client_queue, 0);
+        }
+        woke_ns = monotonic_ns();
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            log_error("Worker event loop failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_from_queue(&loop);
+            } else if ((void *)conn == &listener_tag) {
+                accept_from_listener(&loop);
+            } else if ((void *)conn == &wake_tag) {
+                uint64_t value;
+                if (read(worker->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    perror("read(eventfd)");
+                }
+            } else if ((void *)conn != &closed_tag && dispatch(&loop, conn)) {
+                // A proxied connection has a second socket that may have
+                // an event further down this batch.
+                for (int j = i + 1; j < n; j++) {
+                    if (events[j].data.ptr == conn) {
+                        events[j].data.ptr = &closed_tag;
+                    }
+                }
+            }
+        }
+
+        expire_timers(&loop);
+
+        int command = __atomic_load_n(&worker->command, __ATOMIC_ACQUIRE);
+        if (command == WORKER_STOP) {
+            break;
+        }
+        if (command == WORKER_RETIRE) {
+            if (!loop.draining) {
+                start_draining(&loop);
+            }
+            close_drained_connections(&loop);
+            if (loop.connections == NULL) {
+                break;
+            }
+        }
+    }
+
+    while (loop.connections != NULL) {
+        connection_close(&loop, loop.connections);
+    }
+    while (loop.free_connections != NULL) {
+        Connection *next = loop.free_connections->next;
+        free(loop.free_connections);
+        loop.free_connections = next;
+    }
+    io_pool_release_thread();
+    bundle_thread_release();
+    if (loop.config->upstream_count > 0) {
+        proxy_thread_shutdown();
+    }
+    close(loop.epoll_fd);
+    return worker_exit(worker);
+}
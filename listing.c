@@ -0,0 +1,222 @@
+// listing.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "server.h"
+
+/*
+ * Directory listings for --autoindex. The page is produced by the
+ * streaming writer while it is sent: one line per entry straight from
+ * readdir(), so a directory of any size costs one chunk buffer and its
+ * length is never known up front. The time spent producing it goes out
+ * as a Server-Timing trailer.
+ */
+
+#define LISTING_LINE_SIZE 4096
+
+typedef enum {
+    LISTING_HEAD,
+    LISTING_ENTRIES,
+    LISTING_DONE                    // closing line formatted
+} ListingPhase;
+
+typedef struct {
+    DIR *dir;
+    ListingPhase phase;
+    char base[BUFFER_SIZE];         // decoded request path, ending in '/'
+    char line[LISTING_LINE_SIZE];   // formatted but not yet in the chunk
+    size_t line_len;
+    size_t line_sent;
+    long long started_ns;
+} Listing;
+
+static const char *listing_headers = "Cache-Control: no-cache\r\n";
+static const char *listing_trailer_headers = "Cache-Control: no-cache\r\nTrailer: Server-Timing\r\n";
+
+// Appends `text` to buf. Returns the new length, or `size` once it no longer fits.
+static size_t append_text(char *buf, size_t len, size_t size, const char *text) {
+    size_t text_len = strlen(text);
+    if (len >= size || text_len >= size - len) {
+        return size;
+    }
+    memcpy(buf + len, text, text_len + 1);
+    return len + text_len;
+}
+
+// Appends `text` with &<>"' escaped.
+static size_t append_html(char *buf, size_t len, size_t size, const char *text) {
+    for (const char *p = text; *p != '\0' && len < size; p++) {
+        const char *entity = NULL;
+        switch (*p) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        case '\'': entity = "&#39;"; break;
+        }
+        if (entity != NULL) {
+            len = append_text(buf, len, size, entity);
+        } else if (len + 1 < size) {
+            buf[len++] = *p;
+            buf[len] = '\0';
+        } else {
+            len = size;
+        }
+    }
+    return len;
+}
+
+// Appends a path percent-encoded for a URL; '/' is kept, as file names cannot contain it.
+static size_t append_url(char *buf, size_t len, size_t size, const char *path) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (const unsigned char *p = (const unsigned char *)path; *p != '\0' && len < size; p++) {
+        int plain = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+                    *p == '-' || *p == '.' || *p == '_' || *p == '~' || *p == '/';
+        if (len + (plain ? 1 : 3) >= size) {
+            len = size;
+        } else if (plain) {
+            buf[len++] = (char)*p;
+        } else {
+            buf[len++] = '%';
+            buf[len++] = hex[*p >> 4];
+            buf[len++] = hex[*p & 0xF];
+        }
+    }
+    if (len < size) {
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+// Formats the next line of the page into listing->line. Returns 0, or -1 if the directory cannot be read.
+static int next_line(Listing *listing) {
+    char *line = listing->line;
+    size_t size = sizeof(listing->line);
+    size_t len = 0;
+    listing->line_len = 0;
+    listing->line_sent = 0;
+
+    if (listing->phase == LISTING_HEAD) {
+        len = append_text(line, len, size, "<html><head><title>Index of ");
+        len = append_html(line, len, size, listing->base);
+        len = append_text(line, len, size, "</title></head><body><h1>Index of ");
+        len = append_html(line, len, size, listing->base);
+        len = append_text(line, len, size, "</h1><ul>\n");
+        if (strcmp(listing->base, "/") != 0) {
+            len = append_text(line, len, size, "<li><a href=\"");
+            len = append_url(line, len, size, listing->base);
+            len = append_text(line, len, size, "../\">../</a></li>\n");
+        }
+        listing->phase = LISTING_ENTRIES;
+        listing->line_len = len < size ? len : 0;
+        return 0;
+    }
+
+    while (listing->phase == LISTING_ENTRIES) {
+        errno = 0;
+        struct dirent *entry = readdir(listing->dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                perror("readdir");
+                return -1;
+            }
+            break;
+        }
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        int is_dir = entry->d_type == DT_DIR;
+        struct stat st;
+        if (entry->d_type == DT_UNKNOWN && fstatat(dirfd(listing->dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            is_dir = S_ISDIR(st.st_mode);
+        }
+
+        len = append_text(line, 0, size, "<li><a href=\"");
+        len = append_url(line, len, size, listing->base);
+        len = append_url(line, len, size, name);
+        len = append_text(line, len, size, is_dir ? "/\">" : "\">");
+        len = append_html(line, len, size, name);
+        len = append_text(line, len, size, is_dir ? "/</a></li>\n" : "</a></li>\n");
+        // A NAME_MAX name always fits; anything else is skipped, not cut.
+        if (len < size) {
+            listing->line_len = len;
+            return 0;
+        }
+    }
+
+    listing->line_len = append_text(line, 0, size, "</ul></body></html>\n");
+    listing->phase = LISTING_DONE;
+    return 0;
+}
+
+// StreamProducer: fills the chunk line by line, carrying a line that did not fit into the next chunk.
+static int produce_listing(Connection *conn, void *ctx) {
+    Listing *listing = ctx;
+    while (1) {
+        listing->line_sent += stream_write(conn, listing->line + listing->line_sent,
+                                           listing->line_len - listing->line_sent);
+        if (listing->line_sent < listing->line_len) {
+            return 0;
+        }
+        if (listing->phase == LISTING_DONE) {
+            char timing[64];
+            snprintf(timing, sizeof(timing), "list;dur=%.3f", (double)(monotonic_ns() - listing->started_ns) / 1e6);
+            stream_trailer(conn, "Server-Timing", timing);
+            return 1;
+        }
+        if (next_line(listing) < 0) {
+            return -1;
+        }
+    }
+}
+
+static void release_listing(void *ctx) {
+    Listing *listing = ctx;
+    closedir(listing->dir);
+    free(listing);
+}
+
+/*
+ * With --autoindex, answers a request for the directory `path` with a
+ * streamed listing. `request_path` is the decoded path of the target. Returns
+ * 1 when a response has been queued and 0 if `path` is not a directory.
+ */
+int serve_listing(Connection *conn, const char *path, const char *request_path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    Listing *listing = malloc(sizeof(Listing));
+    if (listing == NULL) {
+        perror("malloc failed");
+        queue_response(conn, http_500, body_500);
+        return 1;
+    }
+    listing->dir = opendir(path);
+    if (listing->dir == NULL) {
+        free(listing);
+        queue_response(conn, http_403, body_403);
+        return 1;
+    }
+    snprintf(listing->base, sizeof(listing->base), "%s%s", request_path,
+             request_path[strlen(request_path) - 1] == '/' ? "" : "/");
+    listing->phase = LISTING_HEAD;
+    listing->line_len = 0;
+    listing->line_sent = 0;
+    listing->started_ns = monotonic_ns();
+
+    // Trailers need chunked framing; an HTTP/1.0 body ends at the close.
+    const char *headers = conn->request.minor_version >= 1 ? listing_trailer_headers : listing_headers;
+    if (stream_begin(conn, "text/html; charset=utf-8", headers, produce_listing, listing, release_listing) < 0) {
+        queue_response(conn, http_500, body_500);
+    }
+    return 1;
+}
@@ -1,17 +1,83 @@
-// logging.c
-
+// logging.c
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stddef.h>
-
-
-void log_message(const char *filename, const char *message) {
-    FILE *log_file = fopen(filename, "a");
-    if (log_file == NULL) {
-        perror("Failed to open log file");
-        return;
-    }
-
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+ * Logging never touches the disk on the calling thread. Each thread appends
+ * fixed-size records to its own single-producer ring; a background writer
+ * drains every ring, keeps the log files open, formats the timestamp once
+ * per second and writes each batch with writev(). A full ring drops the
+ * record and counts it rather than stalling the caller.
+ *
+ * Before log_init() (and after log_shutdown()) messages are written
+ * synchronously so startup and teardown errors are not lost.
+ */
+
+#define LOG_RING_SIZE 1024             // records per thread, power of two
+#define LOG_RECORD_TEXT 240
+#define LOG_MAX_FILES 16
+#define LOG_FLUSH_INTERVAL_MS 100
+#define LOG_BATCH_RECORDS 256          // 3 iovecs each, under IOV_MAX
+
+typedef struct {
+    time_t timestamp;
+    unsigned char file;
+    unsigned short length;
+    char text[LOG_RECORD_TEXT];
+} LogRecord;
+
+typedef struct LogRing {
+    size_t head __attribute__((aligned(64)));      // written by the owning thread
+    size_t tail __attribute__((aligned(64)));      // written by the writer thread
+    unsigned long dropped;
+    int orphaned;                                  // owning thread has exited
+    struct LogRing *next;
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+typedef struct {
+    char name[64];
+    int fd;
+} LogFile;
+
+static LogFile log_files[LOG_MAX_FILES];
+static unsigned int log_file_count;
+static pthread_mutex_t log_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static LogRing *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread LogRing *thread_ring;
+
+static pthread_t writer;
+static int writer_running;
+static int writer_stopping;
+static unsigned int writer_wakeup;     // futex word
+static int writer_sleeping;
+static unsigned long unregistered_drops;
+
+static void log_message_sync(const char *filename, const char *message) {
+    FILE *log_file = fopen(filename, "a");
+    if (log_file == NULL) {
+        perror("Failed to open log file");
+        return;
+    }
+
     time_t now;
     time(&now);
 
@@ -32,11 +98,339 @@ void log_message(const char *filename, const char *message) {
     fprintf(log_file, "[%s] %s\r\n", time_str, message);
     fclose(log_file);
 }
-
-void log_error(const char *message) {
-    log_message("errors.log", message);
-}
-
-void log_connection(const char *message) {
-    log_message("connect.log", message);
-}
+
+// Returns the index of `filename` in the open-file table, registering it on first use.
+static int log_file_index(const char *filename) {
+    unsigned int count = __atomic_load_n(&log_file_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(log_files[i].name, filename) == 0) {
+            return (int)i;
+        }
+    }
+
+    int index = -1;
+    pthread_mutex_lock(&log_files_mutex);
+    count = log_file_count;
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(log_files[i].name, filename) == 0) {
+            index = (int)i;
+            break;
+        }
+    }
+    if (index < 0 && count < LOG_MAX_FILES && strlen(filename) < sizeof(log_files[0].name)) {
+        strcpy(log_files[count].name, filename);
+        log_files[count].fd = -1;       // opened lazily by the writer
+        __atomic_store_n(&log_file_count, count + 1, __ATOMIC_RELEASE);
+        index = (int)count;
+    }
+    pthread_mutex_unlock(&log_files_mutex);
+    return index;
+}
+
+static void ring_orphan(void *arg) {
+    LogRing *ring = arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static LogRing *get_thread_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    LogRing *ring = aligned_alloc(64, sizeof(LogRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    // The writer frees the ring once the thread is gone and it is drained.
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static void futex_wake(unsigned int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void log_message(const char *filename, const char *message) {
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        log_message_sync(filename, message);
+        return;
+    }
+
+    int file = log_file_index(filename);
+    LogRing *ring = get_thread_ring();
+    if (file < 0 || ring == NULL) {
+        __atomic_add_fetch(&unregistered_drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    size_t length = strlen(message);
+    if (length > LOG_RECORD_TEXT) {
+        length = LOG_RECORD_TEXT;
+    }
+    record->timestamp = time(NULL);
+    record->file = (unsigned char)file;
+    record->length = (unsigned short)length;
+    memcpy(record->text, message, length);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // Only pay for a wakeup when the ring is filling faster than the
+    // writer's periodic flush drains it.
+    if (head - tail >= LOG_RING_SIZE / 4 && __atomic_load_n(&writer_sleeping, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&writer_wakeup, 1, __ATOMIC_RELEASE);
+        futex_wake(&writer_wakeup);
+    }
+}
+
+void log_error(const char *message) {
+    log_message("errors.log", message);
+}
+
+void log_connection(const char *message) {
+    log_message("connect.log", message);
+}
+
+/* ---- writer thread ---- */
+
+typedef struct {
+    struct iovec iov[3 * LOG_BATCH_RECORDS];
+    int iovcnt;
+} LogBatch;
+
+static LogBatch batches[LOG_MAX_FILES];
+static time_t cached_second = (time_t)-1;
+static char cached_prefix[80];
+static size_t cached_prefix_len;
+
+static void format_prefix(time_t second) {
+    struct tm tm_info;
+    char time_str[64];
+    if (localtime_r(&second, &tm_info) == NULL ||
+        strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S %Y", &tm_info) == 0) {
+        strcpy(time_str, "?");
+    }
+    int n = snprintf(cached_prefix, sizeof(cached_prefix), "[%s] ", time_str);
+    cached_prefix_len = n > 0 ? (size_t)n : 0;
+    cached_second = second;
+}
+
+static int open_log_file(LogFile *file) {
+    if (file->fd < 0) {
+        file->fd = open(file->name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (file->fd < 0) {
+            perror("Failed to open log file");
+        }
+    }
+    return file->fd;
+}
+
+static void flush_batches(void) {
+    for (int i = 0; i < LOG_MAX_FILES; i++) {
+        LogBatch *batch = &batches[i];
+        if (batch->iovcnt == 0) {
+            continue;
+        }
+
+        int fd = open_log_file(&log_files[i]);
+        struct iovec *iov = batch->iov;
+        int remaining = batch->iovcnt;
+        while (fd >= 0 && remaining > 0) {
+            ssize_t written = writev(fd, iov, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Failed to write log file");
+                break;
+            }
+            // Skip fully written iovecs and trim a partially written one.
+            while (remaining > 0 && (size_t)written >= iov->iov_len) {
+                written -= (ssize_t)iov->iov_len;
+                iov++;
+                remaining--;
+            }
+            if (remaining > 0) {
+                iov->iov_base = (char *)iov->iov_base + written;
+                iov->iov_len -= (size_t)written;
+            }
+        }
+        batch->iovcnt = 0;
+    }
+}
+
+// Writes out everything currently queued in one ring. Returns records drained.
+static size_t drain_ring(LogRing *ring) {
+    size_t drained = 0;
+    while (1) {
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            break;
+        }
+
+        // The cached prefix is shared by every iovec in the batch, so a batch
+        // ends where the second changes.
+        size_t end = tail;
+        while (end != head && end - tail < LOG_BATCH_RECORDS) {
+            LogRecord *record = &ring->records[end & (LOG_RING_SIZE - 1)];
+            if (record->timestamp != cached_second) {
+                if (end != tail) {
+                    break;
+                }
+                format_prefix(record->timestamp);
+            }
+
+            LogBatch *batch = &batches[record->file];
+            batch->iov[batch->iovcnt].iov_base = cached_prefix;
+            batch->iov[batch->iovcnt].iov_len = cached_prefix_len;
+            batch->iov[batch->iovcnt + 1].iov_base = record->text;
+            batch->iov[batch->iovcnt + 1].iov_len = record->length;
+            batch->iov[batch->iovcnt + 2].iov_base = "\r\n";
+            batch->iov[batch->iovcnt + 2].iov_len = 2;
+            batch->iovcnt += 3;
+            end++;
+        }
+
+        flush_batches();
+        drained += end - tail;
+        __atomic_store_n(&ring->tail, end, __ATOMIC_RELEASE);
+    }
+    return drained;
+}
+
+static void report_drops(void) {
+    unsigned long dropped = __atomic_exchange_n(&unregistered_drops, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&rings_mutex);
+    for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+        dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if (dropped > 0) {
+        char message[96];
+        snprintf(message, sizeof(message), "Log buffers overflowed; %lu messages dropped", dropped);
+        int file = log_file_index("errors.log");
+        if (file >= 0) {
+            format_prefix(time(NULL));
+            LogBatch *batch = &batches[file];
+            batch->iov[0].iov_base = cached_prefix;
+            batch->iov[0].iov_len = cached_prefix_len;
+            batch->iov[1].iov_base = message;
+            batch->iov[1].iov_len = strlen(message);
+            batch->iov[2].iov_base = "\r\n";
+            batch->iov[2].iov_len = 2;
+            batch->iovcnt = 3;
+            flush_batches();
+        }
+    }
+}
+
+// Drains every ring and frees the ones whose threads have exited.
+static void drain_all(void) {
+    pthread_mutex_lock(&rings_mutex);
+    LogRing *ring = rings;
+    pthread_mutex_unlock(&rings_mutex);
+
+    // New rings are only ever pushed at the head, so walking from a
+    // snapshot is safe without holding the lock.
+    LogRing *prev = NULL;
+    while (ring != NULL) {
+        LogRing *next = ring->next;
+        drain_ring(ring);
+
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&rings_mutex);
+            if (prev == NULL && rings != ring) {
+                // Rings were pushed since the snapshot; find our predecessor.
+                prev = rings;
+                while (prev->next != ring) {
+                    prev = prev->next;
+                }
+            }
+            if (prev == NULL) {
+                rings = next;
+            } else {
+                prev->next = next;
+            }
+            pthread_mutex_unlock(&rings_mutex);
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+
+    while (!__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE)) {
+        drain_all();
+        report_drops();
+
+        unsigned int seen = __atomic_load_n(&writer_wakeup, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &writer_wakeup, FUTEX_WAIT_PRIVATE, seen, &interval, NULL, 0);
+        __atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELEASE);
+    }
+
+    drain_all();
+    report_drops();
+    return NULL;
+}
+
+void log_init(void) {
+    if (pthread_key_create(&ring_key, ring_orphan) != 0) {
+        perror("pthread_key_create");
+        return;
+    }
+
+    // Keep the writer out of signal delivery meant for the main thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&writer, NULL, writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_create(log writer)");
+        return;
+    }
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+}
+
+// Flushes everything queued so far and returns to synchronous logging.
+void log_shutdown(void) {
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&writer_stopping, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&writer_wakeup, 1, __ATOMIC_RELEASE);
+    futex_wake(&writer_wakeup);
+    pthread_join(writer, NULL);
+
+    for (unsigned int i = 0; i < log_file_count; i++) {
+        if (log_files[i].fd >= 0) {
+            close(log_files[i].fd);
+            log_files[i].fd = -1;
+        }
+    }
+}
@@ -1,12 +1,16 @@
-// main.c
-
-#include "server.h"
-
-int main(int argc, char *argv[]) {
-    Server config;    
-    parse_arguments(argc, argv, &config);
-
-    start_server(&config);
-
-    return 0;
-}
+// main.c
+
+#include "server.h"
+
+int main(int argc, char *argv[]) {
+    Server config;    
+    parse_arguments(argc, argv, &config);
+
+    if (config.pack_path != NULL) {
+        return bundle_pack(&config) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    start_server(&config);
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+// parser.c
+
+#include <string.h>
+#include <strings.h>
+#include "server.h"
+
+/*
+ * Incremental HTTP/1.x request parser. The parser never copies: method,
+ * target, version and header fields are slices into the caller's receive
+ * buffer, which must stay put until the request has been served. Each call
+ * resumes where the previous one stopped, so bytes that arrive in many
+ * small segments are scanned exactly once.
+ */
+
+void http_request_reset(HttpRequest *req) {
+    req->phase = HTTP_PHASE_REQUEST_LINE;
+    req->status = HTTP_PARSE_INCOMPLETE;
+    req->scanned = 0;
+    req->line_start = 0;
+    req->length = 0;
+    req->method.ptr = NULL;
+    req->method.len = 0;
+    req->target.ptr = NULL;
+    req->target.len = 0;
+    req->version.ptr = NULL;
+    req->version.len = 0;
+    req->minor_version = -1;
+    req->header_count = 0;
+    req->content_length = -1;
+    req->transfer_encoding = 0;
+}
+
+// tchar from RFC 7230 section 3.2.6.
+static int is_token_char(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static int is_token(const char *p, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!is_token_char((unsigned char)p[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// method SP request-target SP HTTP-version
+static HttpParseStatus parse_request_line(HttpRequest *req, const char *line, size_t len) {
+    const char *end = line + len;
+
+    const char *method_end = memchr(line, ' ', len);
+    if (method_end == NULL || !is_token(line, (size_t)(method_end - line))) {
+        return HTTP_PARSE_BAD;
+    }
+
+    const char *target = method_end + 1;
+    const char *target_end = memchr(target, ' ', (size_t)(end - target));
+    if (target_end == NULL || target_end == target) {
+        return HTTP_PARSE_BAD;
+    }
+    for (const char *p = target; p < target_end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c < 0x21 || c == 0x7F) {
+            return HTTP_PARSE_BAD;
+        }
+    }
+
+    const char *version = target_end + 1;
+    size_t version_len = (size_t)(end - version);
+    if (version_len != 8 || memcmp(version, "HTTP/1.", 7) != 0 ||
+        version[7] < '0' || version[7] > '9') {
+        return HTTP_PARSE_BAD;
+    }
+
+    req->method.ptr = line;
+    req->method.len = (size_t)(method_end - line);
+    req->target.ptr = target;
+    req->target.len = (size_t)(target_end - target);
+    req->version.ptr = version;
+    req->version.len = version_len;
+    req->minor_version = version[7] - '0';
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+// field-name ":" OWS field-value OWS
+static HttpParseStatus parse_header_line(HttpRequest *req, const char *line, size_t len) {
+    // Obsolete line folding is rejected rather than unfolded (RFC 7230 3.2.4).
+    if (line[0] == ' ' || line[0] == '\t') {
+        return HTTP_PARSE_BAD;
+    }
+
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || !is_token(line, (size_t)(colon - line))) {
+        return HTTP_PARSE_BAD;
+    }
+    if (req->header_count == HTTP_MAX_HEADERS) {
+        return HTTP_PARSE_HEADERS_TOO_LARGE;
+    }
+
+    const char *value = colon + 1;
+    const char *value_end = line + len;
+    // A bare CR, NUL or other control byte could end the line early for
+    // another hop and smuggle a field past this one (RFC 9110 5.5).
+    for (const char *p = value; p < value_end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c < 0x20 && c != '\t') || c == 0x7F) {
+            return HTTP_PARSE_BAD;
+        }
+    }
+    while (value < value_end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+
+    HttpHeader *header = &req->headers[req->header_count++];
+    header->name.ptr = line;
+    header->name.len = (size_t)(colon - line);
+    header->value.ptr = value;
+    header->value.len = (size_t)(value_end - value);
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+static int header_is(const HttpHeader *header, const char *name) {
+    size_t len = strlen(name);
+    return header->name.len == len && strncasecmp(header->name.ptr, name, len) == 0;
+}
+
+/*
+ * Notes the fields that frame the request body, so no caller can read past
+ * one by accident. Content-Length may repeat or list the same value; values
+ * that differ are rejected (RFC 9112 6.3), as another hop could frame the
+ * body by either of them.
+ */
+static HttpParseStatus parse_body_framing(HttpRequest *req) {
+    for (int i = 0; i < req->header_count; i++) {
+        const HttpHeader *header = &req->headers[i];
+        if (header_is(header, "Transfer-Encoding")) {
+            req->transfer_encoding = 1;
+            continue;
+        }
+        if (!header_is(header, "Content-Length")) {
+            continue;
+        }
+        const char *p = header->value.ptr;
+        const char *end = p + header->value.len;
+        while (1) {
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            long long value = 0;
+            const char *digits = p;
+            while (p < end && *p >= '0' && *p <= '9') {
+                if (value > (LLONG_MAX - 9) / 10) {
+                    return HTTP_PARSE_BAD;
+                }
+                value = value * 10 + (*p++ - '0');
+            }
+            if (p == digits || (req->content_length >= 0 && value != req->content_length)) {
+                return HTTP_PARSE_BAD;
+            }
+            req->content_length = value;
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (p == end) {
+                break;
+            }
+            if (*p++ != ',') {
+                return HTTP_PARSE_BAD;
+            }
+        }
+    }
+    return HTTP_PARSE_DONE;
+}
+
+/*
+ * Feeds the first len bytes of buf to the parser. buf must start with the
+ * same bytes as on the previous call. Returns HTTP_PARSE_INCOMPLETE until
+ * the blank line ending the header block has arrived, then HTTP_PARSE_DONE
+ * with req->length set to the size of the block and the body framing
+ * fields filled in. Errors are sticky.
+ */
+HttpParseStatus http_parse_request(HttpRequest *req, const char *buf, size_t len, size_t max_line_size) {
+    if (req->status != HTTP_PARSE_INCOMPLETE) {
+        return req->status;
+    }
+
+    while (req->scanned < len) {
+        const char *newline = memchr(buf + req->scanned, '\n', len - req->scanned);
+        if (newline == NULL) {
+            req->scanned = len;
+            break;
+        }
+
+        size_t line_end = (size_t)(newline - buf);
+        const char *line = buf + req->line_start;
+        size_t line_len = line_end - req->line_start;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        req->scanned = line_end + 1;
+        req->line_start = line_end + 1;
+
+        HttpParseStatus status;
+        if (req->phase == HTTP_PHASE_REQUEST_LINE) {
+            // Empty lines before a request are ignored (RFC 7230 3.5).
+            if (line_len == 0) {
+                continue;
+            }
+            if (line_len > max_line_size) {
+                status = HTTP_PARSE_LINE_TOO_LONG;
+            } else {
+                status = parse_request_line(req, line, line_len);
+            }
+            req->phase = HTTP_PHASE_HEADERS;
+        } else if (line_len == 0) {
+            req->phase = HTTP_PHASE_DONE;
+            req->length = req->scanned;
+            status = parse_body_framing(req);
+        } else {
+            status = parse_header_line(req, line, line_len);
+        }
+
+        if (status != HTTP_PARSE_INCOMPLETE) {
+            req->status = status;
+            return status;
+        }
+    }
+
+    // Refuse an overlong request line as soon as it is seen, not when it ends.
+    if (req->phase == HTTP_PHASE_REQUEST_LINE && len - req->line_start > max_line_size) {
+        req->status = HTTP_PARSE_LINE_TOO_LONG;
+    }
+    return req->status;
+}
+
+// Returns the first header called name (case-insensitive), or NULL.
+const HttpSlice *http_find_header(const HttpRequest *req, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req->header_count; i++) {
+        const HttpHeader *header = &req->headers[i];
+        if (header->name.len == name_len && strncasecmp(header->name.ptr, name, name_len) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+int http_slice_equals(HttpSlice slice, const char *text) {
+    size_t len = strlen(text);
+    return slice.len == len && memcmp(slice.ptr, text, len) == 0;
+}
@@ -1,117 +1,639 @@
-// parseutf.c
-
-#define _16B ((in[i] << 8) |  in[i + 1])
-#define _16L (in[i] | (in[i + 1] << 8))
-
-#define _32B ((in[i] << 24) | (in[i + 1] << 16) | (in[i + 2] <<  8) |  in[i + 3])
-#define _32L (in[i] | (in[i + 1] <<  8) | (in[i + 2] << 16) | (in[i + 3] << 24))
-
-typedef enum {
-    UTF8_ACCEPT  = 0,
-    UTF8_REJECT  = 1,
-    UTF8_EXPECT1 = 2,
-    UTF8_EXPECT2 = 3,
-    UTF8_EXPECT3 = 4
-} utf8_state;
-
-typedef enum {
-    UTF16_ACCEPT = 0,
-    UTF16_REJECT = 1,
-    UTF16_EXPECT_LOW_SURROGATE = 2
-} utf16_state;
-
-typedef enum {
-    UTF32_ACCEPT = 0,
-    UTF32_REJECT = 1
-} utf32_state;
-
-static const unsigned char utf8_transition[] = {
-    UTF8_ACCEPT, 
-    UTF8_REJECT, 
-    UTF8_REJECT,  
-    UTF8_REJECT,  
-    UTF8_REJECT,
-    UTF8_REJECT, 
-    UTF8_REJECT, 
-    UTF8_EXPECT1, 
-    UTF8_EXPECT2, 
-    UTF8_EXPECT3
-};
-
-static const unsigned char utf16_transition[] = {
-    UTF16_ACCEPT,                // ACCEPT + non-surrogate
-    UTF16_ACCEPT,                // ACCEPT + low surrogate (invalid but recoverable)
-    UTF16_EXPECT_LOW_SURROGATE,  // ACCEPT + high surrogate
-    UTF16_ACCEPT,                // EXPECT_LOW + non-surrogate (error)
-    UTF16_ACCEPT,                // EXPECT_LOW + low surrogate
-    UTF16_EXPECT_LOW_SURROGATE   // EXPECT_LOW + high surrogate (error)
-};
-
-
-int validate_utf8(const void *input, const unsigned maxlen) {    
-    int i = 0;
-    utf8_state state = UTF8_ACCEPT;
-    const unsigned char *in = (const unsigned char *)input;
-
-    for (; i < maxlen && in[i] != '\0'; ++i) {
-        if ((in[i] & 0xC0) != 0x80) {
-            const unsigned curr = (in[i] >> 3) & 0x1F;
-            state = (utf8_state)utf8_transition[
-                (curr == 0x1E) + 
-                (curr == 0x1F) + 
-                (2 * (curr >= 0x1C))
-            ];
-        }
-
-        if (state == UTF8_REJECT)
-            return -i;
-    }
-    
-    return i;
-}
-
-int validate_utf16(const void *input, const unsigned maxlen, const int big_endian) {    
-    int i = 0;
-    utf16_state state = UTF16_ACCEPT;
-    const unsigned char *in = (const unsigned char *)input;
-
-    for (; i < maxlen - 1; i += 2) {
-        unsigned curr = big_endian ? _16B : _16L;
-        if (curr == 0) 
-            break;
-
-        unsigned is_high_surrogate = (curr - 0xD800) < 0x400;
-        unsigned is_low_surrogate = (curr - 0xDC00) < 0x400;        
-        unsigned combined = (state << 4) | (is_high_surrogate << 1) | is_low_surrogate;
-
-        state = (utf16_state)utf16_transition[combined & 0x07];
-        
-        if (state == UTF16_REJECT) 
-            return -i;
-    }
-    
-    return i;
-}
-
-
-int validate_utf32(const void *input, const unsigned maxlen, const int big_endian) {   
-    int i = 0;
-    utf32_state state = UTF32_ACCEPT;    
-    const unsigned char *in = (const unsigned char *)input;
-
-    for (; i < maxlen - 3; i += 4) {
-        unsigned curr = big_endian ? _32B : _32L;
-        if (curr == 0) 
-            break;
-        
-        unsigned is_surrogate_range = (curr - 0xD800) < 0x800;
-        unsigned is_out_of_bounds = curr > 0x10FFFF;
-
-        state = (utf32_state)(state | is_surrogate_range | is_out_of_bounds);
-        
-        if (state == UTF32_REJECT) 
-            return -i;
-    }
-    
-    return i;
-}
+// parseutf.c
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF_X86 1
+#endif
+#include "server.h"
+
+#define _16B ((in[i] << 8) |  in[i + 1])
+#define _16L (in[i] | (in[i + 1] << 8))
+
+#define _32B (((unsigned)in[i] << 24) | (in[i + 1] << 16) | (in[i + 2] <<  8) |  in[i + 3])
+#define _32L (in[i] | (in[i + 1] <<  8) | (in[i + 2] << 16) | ((unsigned)in[i + 3] << 24))
+
+/*
+ * All validators share one definition of validity, the scalar transition
+ * tables below. The SSE2 and AVX2 kernels only skip work: they prove whole
+ * blocks valid, and whenever a block is in doubt they hand it back to the
+ * scalar machine, which reports the exact failing offset. Every kernel
+ * therefore returns bit-identical results.
+ */
+
+typedef enum {
+    UTF8_ACCEPT  = 0,
+    UTF8_REJECT  = 1,
+    UTF8_EXPECT1 = 2,   // one continuation byte left
+    UTF8_EXPECT2 = 3,
+    UTF8_EXPECT3 = 4,
+    UTF8_E0      = 5,   // after E0: next must be A0..BF (no overlongs)
+    UTF8_ED      = 6,   // after ED: next must be 80..9F (no surrogates)
+    UTF8_F0      = 7,   // after F0: next must be 90..BF (no overlongs)
+    UTF8_F4      = 8    // after F4: next must be 80..8F (<= U+10FFFF)
+} utf8_state;
+
+typedef enum {
+    UTF16_ACCEPT = 0,
+    UTF16_REJECT = 1,
+    UTF16_EXPECT_LOW_SURROGATE = 2
+} utf16_state;
+
+typedef enum {
+    UTF32_ACCEPT = 0,
+    UTF32_REJECT = 1
+} utf32_state;
+
+// Byte classes: 0 ASCII, 1 80..8F, 2 90..9F, 3 A0..BF, 4 C2..DF, 5 E0,
+// 6 E1..EC/EE..EF, 7 ED, 8 F0, 9 F1..F3, 10 F4, 11 never valid.
+static const unsigned char utf8_class[256] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+    3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+    11,11,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+    5,6,6,6,6,6,6,6,6,6,6,6,6,7,6,6, 8,9,9,9,10,11,11,11,11,11,11,11,11,11,11,11
+};
+
+#define R UTF8_REJECT
+static const unsigned char utf8_transition[9][12] = {
+    /* ACCEPT  */ {UTF8_ACCEPT, R, R, R, UTF8_EXPECT1, UTF8_E0, UTF8_EXPECT2, UTF8_ED, UTF8_F0, UTF8_EXPECT3, UTF8_F4, R},
+    /* REJECT  */ {R, R, R, R, R, R, R, R, R, R, R, R},
+    /* EXPECT1 */ {R, UTF8_ACCEPT, UTF8_ACCEPT, UTF8_ACCEPT, R, R, R, R, R, R, R, R},
+    /* EXPECT2 */ {R, UTF8_EXPECT1, UTF8_EXPECT1, UTF8_EXPECT1, R, R, R, R, R, R, R, R},
+    /* EXPECT3 */ {R, UTF8_EXPECT2, UTF8_EXPECT2, UTF8_EXPECT2, R, R, R, R, R, R, R, R},
+    /* E0      */ {R, R, R, UTF8_EXPECT1, R, R, R, R, R, R, R, R},
+    /* ED      */ {R, UTF8_EXPECT1, UTF8_EXPECT1, R, R, R, R, R, R, R, R, R},
+    /* F0      */ {R, R, UTF8_EXPECT2, UTF8_EXPECT2, R, R, R, R, R, R, R, R},
+    /* F4      */ {R, UTF8_EXPECT2, R, R, R, R, R, R, R, R, R, R},
+};
+#undef R
+
+static const unsigned char utf16_transition[] = {
+    UTF16_ACCEPT,                // ACCEPT + non-surrogate
+    UTF16_REJECT,                // ACCEPT + low surrogate without a high one
+    UTF16_EXPECT_LOW_SURROGATE,  // ACCEPT + high surrogate
+    UTF16_REJECT,                // unused
+    UTF16_REJECT,                // EXPECT_LOW + non-surrogate
+    UTF16_ACCEPT,                // EXPECT_LOW + low surrogate
+    UTF16_REJECT,                // EXPECT_LOW + high surrogate
+    UTF16_REJECT                 // unused
+};
+
+/*
+ * A kernel validates len bytes starting in *state and returns the offset of
+ * the byte that moved the machine to REJECT, or len. On return *state holds
+ * the machine's state after the last byte examined.
+ */
+typedef size_t (*utf8_kernel)(const unsigned char *in, size_t len, unsigned *state);
+typedef size_t (*utf16_kernel)(const unsigned char *in, size_t len, int big_endian, unsigned *state);
+typedef size_t (*utf32_kernel)(const unsigned char *in, size_t len, int big_endian);
+
+static size_t utf8_scalar(const unsigned char *in, size_t len, unsigned *state) {
+    unsigned s = *state;
+    for (size_t i = 0; i < len; ++i) {
+        s = utf8_transition[s][utf8_class[in[i]]];
+        if (s == UTF8_REJECT) {
+            *state = s;
+            return i;
+        }
+    }
+    *state = s;
+    return len;
+}
+
+// Units are 2 bytes; stops at the first zero unit, reporting it as the end.
+static size_t utf16_scalar(const unsigned char *in, size_t len, int big_endian, unsigned *state) {
+    unsigned s = *state;
+    size_t i = 0;
+    for (; i + 1 < len; i += 2) {
+        unsigned curr = big_endian ? _16B : _16L;
+        if (curr == 0) {
+            break;
+        }
+
+        unsigned is_high_surrogate = (curr - 0xD800) < 0x400;
+        unsigned is_low_surrogate = (curr - 0xDC00) < 0x400;
+        unsigned combined = ((s == UTF16_EXPECT_LOW_SURROGATE) << 2) | (is_high_surrogate << 1) | is_low_surrogate;
+
+        s = utf16_transition[combined];
+        if (s == UTF16_REJECT) {
+            *state = s;
+            return i;
+        }
+    }
+    *state = s;
+    return i;
+}
+
+static size_t utf32_scalar(const unsigned char *in, size_t len, int big_endian) {
+    size_t i = 0;
+    for (; i + 3 < len; i += 4) {
+        unsigned curr = big_endian ? _32B : _32L;
+        if (curr == 0) {
+            break;
+        }
+
+        unsigned is_surrogate_range = (curr - 0xD800) < 0x800;
+        unsigned is_out_of_bounds = curr > 0x10FFFF;
+        if (is_surrogate_range | is_out_of_bounds) {
+            return i | ((size_t)1 << (sizeof(size_t) * 8 - 1));
+        }
+    }
+    return i;
+}
+
+#define UTF32_FAILED(r) ((r) >> (sizeof(size_t) * 8 - 1))
+#define UTF32_OFFSET(r) ((r) & ~((size_t)1 << (sizeof(size_t) * 8 - 1)))
+
+#ifdef UTF_X86
+
+/*
+ * Start of the code point that contains in[pos - 1], looking back at most
+ * three bytes and never before `floor`. Used to hand a block boundary back
+ * to the scalar machine at a character boundary.
+ */
+static size_t sequence_start(const unsigned char *in, size_t pos, size_t floor) {
+    size_t k = pos;
+    int back = 0;
+    while (back < 3 && k > floor && (in[k - 1] & 0xC0) == 0x80) {
+        k--;
+        back++;
+    }
+    if (k > floor && in[k - 1] >= 0xC0) {
+        k--;
+    }
+    return k;
+}
+
+// SSE2: skip 16-byte blocks of pure ASCII, run the scalar machine on the rest.
+__attribute__((target("sse2")))
+static size_t utf8_sse2(const unsigned char *in, size_t len, unsigned *state) {
+    size_t i = 0;
+    while (i + 16 <= len) {
+        if (*state == UTF8_ACCEPT) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+            if (_mm_movemask_epi8(block) == 0) {
+                i += 16;
+                continue;
+            }
+        }
+        size_t stop = utf8_scalar(in + i, 16, state);
+        if (*state == UTF8_REJECT) {
+            return i + stop;
+        }
+        i += 16;
+    }
+    size_t stop = utf8_scalar(in + i, len - i, state);
+    return i + stop;
+}
+
+/*
+ * AVX2: the "lookup" algorithm of Keiser & Lemire (Validating UTF-8 in less
+ * than one instruction per byte, 2021). Three nibble lookups classify every
+ * (byte, previous byte) pair, and a saturating compare checks that 3- and
+ * 4-byte leads are followed by the right number of continuations.
+ */
+
+#define TOO_SHORT   (1 << 0)
+#define TOO_LONG    (1 << 1)
+#define OVERLONG_3  (1 << 2)
+#define TOO_LARGE   (1 << 3)
+#define SURROGATE   (1 << 4)
+#define OVERLONG_2  (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4  (1 << 6)
+#define TWO_CONTS   (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+__attribute__((target("avx2")))
+static inline __m256i prev_bytes(__m256i input, __m256i prev_input, int n) {
+    // Bytes shifted right by n across the 32-byte boundary with prev_input.
+    __m256i straddle = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    switch (n) {
+    case 1: return _mm256_alignr_epi8(input, straddle, 16 - 1);
+    case 2: return _mm256_alignr_epi8(input, straddle, 16 - 2);
+    default: return _mm256_alignr_epi8(input, straddle, 16 - 3);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i check_utf8_bytes(__m256i input, __m256i prev_input) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY, CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY, CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1 = prev_bytes(input, prev_input, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+                                              _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+                                              _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i prev2 = prev_bytes(input, prev_input, 2);
+    __m256i prev3 = prev_bytes(input, prev_input, 3);
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte),
+                                                    _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_be_continuation, special_cases);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i is_incomplete(__m256i input) {
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm256_subs_epu8(input, max_value);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_avx2(const unsigned char *in, size_t len, unsigned *state) {
+    // Finish a sequence carried in from a previous chunk on the scalar path.
+    size_t i = 0;
+    while (i < len && *state != UTF8_ACCEPT) {
+        size_t stop = utf8_scalar(in + i, 1, state);
+        if (*state == UTF8_REJECT) {
+            return i + stop;
+        }
+        i++;
+    }
+    if (*state != UTF8_ACCEPT) {
+        // The chunk ended inside the carried sequence; keep its state for the next one.
+        return i;
+    }
+
+    const size_t start = i;
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    while (i + 32 <= len) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i error;
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = prev_incomplete;
+        } else {
+            error = check_utf8_bytes(input, prev_input);
+            prev_incomplete = is_incomplete(input);
+            prev_input = input;
+        }
+        if (!_mm256_testz_si256(error, error)) {
+            // Rewind to the character this block starts inside and let the
+            // scalar machine find the exact offset.
+            size_t from = sequence_start(in, i, start);
+            *state = UTF8_ACCEPT;
+            return from + utf8_scalar(in + from, len - from, state);
+        }
+        i += 32;
+    }
+
+    // A sequence may straddle the last full block; revalidate it with the tail.
+    size_t from = sequence_start(in, i, start);
+    *state = UTF8_ACCEPT;
+    return from + utf8_scalar(in + from, len - from, state);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i swap16_sse2(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i swap32_sse2(__m128i v) {
+    v = swap16_sse2(v);
+    return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+
+// UTF-16: skip blocks of 8 units containing no surrogate and no terminator.
+__attribute__((target("sse2")))
+static size_t utf16_sse2(const unsigned char *in, size_t len, int big_endian, unsigned *state) {
+    const __m128i surrogate_mask = _mm_set1_epi16((short)0xF800);
+    const __m128i surrogate = _mm_set1_epi16((short)0xD800);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (i + 16 <= len) {
+        if (*state == UTF16_ACCEPT) {
+            __m128i units = _mm_loadu_si128((const __m128i *)(in + i));
+            if (big_endian) {
+                units = swap16_sse2(units);
+            }
+            __m128i special = _mm_or_si128(_mm_cmpeq_epi16(_mm_and_si128(units, surrogate_mask), surrogate),
+                                           _mm_cmpeq_epi16(units, zero));
+            if (_mm_movemask_epi8(special) == 0) {
+                i += 16;
+                continue;
+            }
+        }
+        size_t stop = utf16_scalar(in + i, 16, big_endian, state);
+        if (stop < 16) {
+            return i + stop;
+        }
+        i += 16;
+    }
+    return i + utf16_scalar(in + i, len - i, big_endian, state);
+}
+
+__attribute__((target("avx2")))
+static size_t utf16_avx2(const unsigned char *in, size_t len, int big_endian, unsigned *state) {
+    const __m256i surrogate_mask = _mm256_set1_epi16((short)0xF800);
+    const __m256i surrogate = _mm256_set1_epi16((short)0xD800);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= len) {
+        if (*state == UTF16_ACCEPT) {
+            __m256i units = _mm256_loadu_si256((const __m256i *)(in + i));
+            if (big_endian) {
+                units = _mm256_or_si256(_mm256_slli_epi16(units, 8), _mm256_srli_epi16(units, 8));
+            }
+            __m256i special = _mm256_or_si256(
+                _mm256_cmpeq_epi16(_mm256_and_si256(units, surrogate_mask), surrogate),
+                _mm256_cmpeq_epi16(units, zero));
+            if (_mm256_testz_si256(special, special)) {
+                i += 32;
+                continue;
+            }
+        }
+        size_t stop = utf16_scalar(in + i, 32, big_endian, state);
+        if (stop < 32) {
+            return i + stop;
+        }
+        i += 32;
+    }
+    return i + utf16_scalar(in + i, len - i, big_endian, state);
+}
+
+// UTF-32: four code points per block, range checks done as signed compares
+// after flipping the sign bit.
+__attribute__((target("sse2")))
+static size_t utf32_sse2(const unsigned char *in, size_t len, int big_endian) {
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m128i max_code_point = _mm_set1_epi32((int)(0x10FFFF ^ 0x80000000));
+    const __m128i surrogate_base = _mm_set1_epi32(0xD800);
+    const __m128i surrogate_span = _mm_set1_epi32((int)(0x7FF ^ 0x80000000));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i units = _mm_loadu_si128((const __m128i *)(in + i));
+        if (big_endian) {
+            units = swap32_sse2(units);
+        }
+        __m128i too_large = _mm_cmpgt_epi32(_mm_xor_si128(units, sign), max_code_point);
+        __m128i outside_surrogates = _mm_cmpgt_epi32(
+            _mm_xor_si128(_mm_sub_epi32(units, surrogate_base), sign), surrogate_span);
+        __m128i special = _mm_or_si128(_mm_or_si128(too_large, _mm_cmpeq_epi32(units, zero)),
+                                       _mm_andnot_si128(outside_surrogates, _mm_set1_epi32(-1)));
+        if (_mm_movemask_epi8(special) != 0) {
+            break;
+        }
+        i += 16;
+    }
+    size_t result = utf32_scalar(in + i, len - i, big_endian);
+    return result + i;
+}
+
+__attribute__((target("avx2")))
+static size_t utf32_avx2(const unsigned char *in, size_t len, int big_endian) {
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i max_code_point = _mm256_set1_epi32(0x10FFFF);
+    const __m256i surrogate_base = _mm256_set1_epi32(0xD800);
+    const __m256i surrogate_span = _mm256_set1_epi32(0x7FF);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i units = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (big_endian) {
+            units = _mm256_shuffle_epi8(units, swap);
+        }
+        // Unsigned x > limit  <=>  max(x, limit) != limit
+        __m256i too_large = _mm256_xor_si256(
+            _mm256_cmpeq_epi32(_mm256_max_epu32(units, max_code_point), max_code_point),
+            _mm256_set1_epi32(-1));
+        __m256i offset = _mm256_sub_epi32(units, surrogate_base);
+        __m256i in_surrogates = _mm256_cmpeq_epi32(_mm256_max_epu32(offset, surrogate_span), surrogate_span);
+        __m256i special = _mm256_or_si256(_mm256_or_si256(too_large, in_surrogates),
+                                          _mm256_cmpeq_epi32(units, zero));
+        if (!_mm256_testz_si256(special, special)) {
+            break;
+        }
+        i += 32;
+    }
+    size_t result = utf32_scalar(in + i, len - i, big_endian);
+    return result + i;
+}
+
+#endif  // UTF_X86
+
+typedef struct {
+    const char *name;
+    utf8_kernel utf8;
+    utf16_kernel utf16;
+    utf32_kernel utf32;
+} UtfKernels;
+
+static const UtfKernels scalar_kernels = {"scalar", utf8_scalar, utf16_scalar, utf32_scalar};
+#ifdef UTF_X86
+static const UtfKernels sse2_kernels = {"sse2", utf8_sse2, utf16_sse2, utf32_sse2};
+static const UtfKernels avx2_kernels = {"avx2", utf8_avx2, utf16_avx2, utf32_avx2};
+#endif
+
+static const UtfKernels *kernels = &scalar_kernels;
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+static void select_best_kernels(void) {
+#ifdef UTF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = &sse2_kernels;
+    }
+#endif
+}
+
+static const UtfKernels *active_kernels(void) {
+    pthread_once(&dispatch_once, select_best_kernels);
+    return kernels;
+}
+
+/*
+ * Forces a kernel by name ("scalar", "sse2", "avx2"), mainly for
+ * benchmarking. Returns -1 if this CPU cannot run it.
+ */
+int utf_select_kernel(const char *name) {
+    pthread_once(&dispatch_once, select_best_kernels);
+    if (strcmp(name, "scalar") == 0) {
+        kernels = &scalar_kernels;
+        return 0;
+    }
+#ifdef UTF_X86
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        kernels = &sse2_kernels;
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *utf_kernel_name(void) {
+    return active_kernels()->name;
+}
+
+/*
+ * Validates a NUL-terminated (or maxlen-bounded) UTF-8 string. Returns the
+ * number of bytes validated, or minus the offset of the offending byte. A
+ * sequence cut short by the terminator is reported at its lead byte.
+ */
+int validate_utf8(const void *input, const unsigned maxlen) {
+    const unsigned char *in = (const unsigned char *)input;
+    const unsigned char *nul = memchr(in, '\0', maxlen);
+    size_t len = nul ? (size_t)(nul - in) : maxlen;
+
+    unsigned state = UTF8_ACCEPT;
+    size_t stop = active_kernels()->utf8(in, len, &state);
+    if (state == UTF8_REJECT) {
+        return -(int)stop;
+    }
+    if (state != UTF8_ACCEPT) {
+        size_t lead = len;
+        while (lead > 0 && (in[lead - 1] & 0xC0) == 0x80) {
+            lead--;
+        }
+        return -(int)(lead > 0 ? lead - 1 : 0);
+    }
+    return (int)len;
+}
+
+int validate_utf16(const void *input, const unsigned maxlen, const int big_endian) {
+    unsigned state = UTF16_ACCEPT;
+    size_t stop = active_kernels()->utf16((const unsigned char *)input, maxlen, big_endian, &state);
+    if (state == UTF16_REJECT) {
+        return -(int)stop;
+    }
+    if (state == UTF16_EXPECT_LOW_SURROGATE) {
+        // High surrogate with nothing after it.
+        return -(int)(stop - 2);
+    }
+    return (int)stop;
+}
+
+int validate_utf32(const void *input, const unsigned maxlen, const int big_endian) {
+    size_t result = active_kernels()->utf32((const unsigned char *)input, maxlen, big_endian);
+    if (UTF32_FAILED(result)) {
+        return -(int)UTF32_OFFSET(result);
+    }
+    return (int)result;
+}
+
+/*
+ * Streaming UTF-8 validation for data that arrives in pieces, such as a
+ * request body. NUL is an ordinary character here. The machine state is
+ * carried between calls, so a code point split across chunks is handled
+ * exactly as if the chunks were contiguous.
+ */
+void utf8_stream_init(Utf8Stream *stream) {
+    stream->state = UTF8_ACCEPT;
+    stream->offset = 0;
+    stream->sequence_start = 0;
+    stream->error_offset = 0;
+}
+
+// Returns 0 while the stream is valid so far, -1 once it is not (error_offset says where).
+int utf8_stream_feed(Utf8Stream *stream, const void *data, size_t len) {
+    if (stream->state == UTF8_REJECT) {
+        return -1;
+    }
+
+    const unsigned char *in = (const unsigned char *)data;
+    size_t stop = active_kernels()->utf8(in, len, &stream->state);
+    if (stream->state == UTF8_REJECT) {
+        stream->error_offset = stream->offset + stop;
+        stream->offset += stop;
+        return -1;
+    }
+
+    if (stream->state != UTF8_ACCEPT) {
+        // Remember where the unfinished code point began for finish().
+        size_t lead = len;
+        while (lead > 0 && (in[lead - 1] & 0xC0) == 0x80) {
+            lead--;
+        }
+        if (lead > 0) {
+            stream->sequence_start = stream->offset + lead - 1;
+        }
+    }
+    stream->offset += len;
+    return 0;
+}
+
+// Ends the stream; a code point left unfinished is an error at its lead byte.
+int utf8_stream_finish(Utf8Stream *stream) {
+    if (stream->state == UTF8_REJECT) {
+        return -1;
+    }
+    if (stream->state != UTF8_ACCEPT) {
+        stream->state = UTF8_REJECT;
+        stream->error_offset = stream->sequence_start;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+// pool.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "server.h"
+
+/*
+ * Per-thread pool of page-aligned I/O buffers. One buffer is one page and
+ * holds a connection's in[] and out[]. Pages come from mmap()ed slabs of
+ * IO_SLAB_BUFFERS and are recycled LIFO, so a connection that needs a
+ * buffer gets the one most recently released on its thread, which is
+ * likely still in cache. Only the owning thread touches its pool, so get
+ * and put are a pointer swap. The slabs are unmapped when the thread's
+ * event loop exits, by which time every connection has returned its page.
+ */
+
+typedef struct FreeBuffer {
+    struct FreeBuffer *next;
+} FreeBuffer;
+
+static __thread FreeBuffer *free_buffers;
+static __thread void **slabs;
+static __thread int slab_count;
+static __thread int slab_capacity;
+
+static int map_slab(void) {
+    if (slab_count == slab_capacity) {
+        int capacity = slab_capacity ? slab_capacity * 2 : 8;
+        void **grown = realloc(slabs, sizeof(void *) * (size_t)capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        slabs = grown;
+        slab_capacity = capacity;
+    }
+
+    char *slab = mmap(NULL, (size_t)IO_BUFFER_SIZE * IO_SLAB_BUFFERS, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    slabs[slab_count++] = slab;
+    for (int i = IO_SLAB_BUFFERS - 1; i >= 0; i--) {
+        FreeBuffer *buffer = (FreeBuffer *)(slab + (size_t)i * IO_BUFFER_SIZE);
+        buffer->next = free_buffers;
+        free_buffers = buffer;
+    }
+    stats_add(STAT_IO_BUFFERS_MAPPED, IO_SLAB_BUFFERS);
+    return 0;
+}
+
+// Returns an IO_BUFFER_SIZE page from this thread's pool, or NULL.
+void *io_buffer_get(void) {
+    if (free_buffers == NULL && map_slab() < 0) {
+        log_error("Failed to map I/O buffers");
+        return NULL;
+    }
+    FreeBuffer *buffer = free_buffers;
+    free_buffers = buffer->next;
+    return buffer;
+}
+
+// Hands a page back to the pool of the thread that got it.
+void io_buffer_put(void *page) {
+    FreeBuffer *buffer = page;
+    buffer->next = free_buffers;
+    free_buffers = buffer;
+}
+
+void io_pool_release_thread(void) {
+    for (int i = 0; i < slab_count; i++) {
+        munmap(slabs[i], (size_t)IO_BUFFER_SIZE * IO_SLAB_BUFFERS);
+    }
+    stats_add(STAT_IO_BUFFERS_UNMAPPED, (unsigned long long)slab_count * IO_SLAB_BUFFERS);
+    free(slabs);
+    slabs = NULL;
+    slab_count = 0;
+    slab_capacity = 0;
+    free_buffers = NULL;
+}
+
+// Gives `conn` its in[] and out[] for the next request. Returns -1 if no page could be had.
+int connection_attach_buffers(Connection *conn) {
+    char *page = io_buffer_get();
+    if (page == NULL) {
+        return -1;
+    }
+    conn->in = page;
+    conn->out = page + BUFFER_SIZE;
+    return 0;
+}
+
+void connection_release_buffers(Connection *conn) {
+    if (conn->in != NULL) {
+        io_buffer_put(conn->in);
+        conn->in = NULL;
+        conn->out = NULL;
+    }
+}
@@ -0,0 +1,1063 @@
+// proxy.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "server.h"
+
+/*
+ * Reverse-proxy mode. With --upstream every request other than the stats
+ * path is forwarded to one of the configured backends.
+ *
+ * Picking: power of two choices. Two upstreams are drawn at random and the
+ * one with the lower (in-flight + 1) * latency EWMA wins, so a backend that
+ * slows down or piles up requests loses traffic within a few exchanges,
+ * without a scan over every upstream. One that refused a connection is
+ * passed over for UPSTREAM_RETRY_MS.
+ *
+ * Connections: each worker keeps its own stack of idle keep-alive
+ * connections per upstream, so reuse takes no lock. Idle sockets are not
+ * watched; one the backend has closed is noticed by a MSG_PEEK when it is
+ * taken. A request that fails on a reused socket before any response byte
+ * arrives is sent again on another connection.
+ *
+ * Bodies: request and response bodies move socket -> pipe -> socket with
+ * splice() through the connection's pipe. Only headers and chunk size
+ * lines pass through user space.
+ */
+
+typedef enum {
+    STEP_BLOCKED,
+    STEP_DONE,
+    STEP_UPSTREAM_FAILED,
+    STEP_CLIENT_GONE
+} ProxyStep;
+
+enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE
+};
+
+static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+static const Server *proxy_config;
+
+static __thread int proxy_epoll_fd = -1;
+static __thread int *idle_fds;          // UPSTREAM_IDLE_MAX slots per upstream
+static __thread int *idle_counts;
+static __thread unsigned int pick_seed;
+
+/*
+ * Resolves upstream->name, "HOST:PORT" or "[IPV6]:PORT", into its socket
+ * address. Returns -1 if the name is malformed or does not resolve.
+ */
+int upstream_resolve(Upstream *upstream) {
+    char host[sizeof(upstream->name)];
+    const char *port;
+    const char *name = upstream->name;
+
+    if (name[0] == '[') {
+        const char *close = strchr(name, ']');
+        if (close == NULL || close[1] != ':') {
+            return -1;
+        }
+        memcpy(host, name + 1, (size_t)(close - name - 1));
+        host[close - name - 1] = '\0';
+        port = close + 2;
+    } else {
+        const char *colon = strrchr(name, ':');
+        if (colon == NULL) {
+            return -1;
+        }
+        memcpy(host, name, (size_t)(colon - name));
+        host[colon - name] = '\0';
+        port = colon + 1;
+    }
+    if (host[0] == '\0' || port[0] == '\0') {
+        return -1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+    upstream->address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+// Lower is better; an upstream before its first response counts as instant.
+static unsigned long long upstream_cost(Upstream *upstream, long long now_ms) {
+    if (__atomic_load_n(&upstream->down_until_ms, __ATOMIC_RELAXED) > now_ms) {
+        return ~0ULL;
+    }
+    unsigned long long latency = (unsigned long long)__atomic_load_n(&upstream->latency_ewma_ns, __ATOMIC_RELAXED);
+    unsigned long long in_flight = (unsigned long long)__atomic_load_n(&upstream->in_flight, __ATOMIC_RELAXED);
+    return (latency + 1) * (in_flight + 1);
+}
+
+// Power of two choices over the live in-flight counts and latency EWMAs.
+Upstream *select_upstream(Upstream *upstreams, int count) {
+    int first = rand_r(&pick_seed) % count;
+    if (count == 1) {
+        return &upstreams[first];
+    }
+    int second = rand_r(&pick_seed) % (count - 1);
+    if (second >= first) {
+        second++;
+    }
+    long long now = monotonic_ms();
+    return upstream_cost(&upstreams[second], now) < upstream_cost(&upstreams[first], now)
+               ? &upstreams[second] : &upstreams[first];
+}
+
+// Plain stores: a racing update only loses one sample.
+static void record_latency(Upstream *upstream, long long sample_ns) {
+    long long ewma = __atomic_load_n(&upstream->latency_ewma_ns, __ATOMIC_RELAXED);
+    ewma = ewma == 0 ? sample_ns : ewma + (sample_ns - ewma) / 8;
+    __atomic_store_n(&upstream->latency_ewma_ns, ewma > 0 ? ewma : 1, __ATOMIC_RELAXED);
+}
+
+static void upstream_refused(Upstream *upstream) {
+    long long now = monotonic_ms();
+    if (__atomic_exchange_n(&upstream->down_until_ms, now + UPSTREAM_RETRY_MS, __ATOMIC_RELAXED) <= now) {
+        char message[192];
+        snprintf(message, sizeof(message), "Upstream %s refused a connection; avoiding it for %dms",
+                 upstream->name, UPSTREAM_RETRY_MS);
+        log_error(message);
+    }
+}
+
+void proxy_init(const Server *config) {
+    proxy_config = config;
+}
+
+// Called by each epoll worker before it handles a proxied request.
+void proxy_thread_init(int epoll_fd) {
+    proxy_epoll_fd = epoll_fd;
+    pick_seed = (unsigned int)monotonic_ns() ^ (unsigned int)(uintptr_t)&pick_seed;
+    idle_fds = malloc(sizeof(int) * (size_t)proxy_config->upstream_count * UPSTREAM_IDLE_MAX);
+    idle_counts = calloc((size_t)proxy_config->upstream_count, sizeof(int));
+    if (idle_fds == NULL || idle_counts == NULL) {
+        log_error("Failed to allocate the upstream connection pool; connections will not be reused");
+        free(idle_fds);
+        free(idle_counts);
+        idle_fds = NULL;
+        idle_counts = NULL;
+    }
+}
+
+void proxy_thread_shutdown(void) {
+    for (int i = 0; idle_fds != NULL && i < proxy_config->upstream_count; i++) {
+        for (int j = 0; j < idle_counts[i]; j++) {
+            close(idle_fds[i * UPSTREAM_IDLE_MAX + j]);
+        }
+    }
+    free(idle_fds);
+    free(idle_counts);
+    idle_fds = NULL;
+    idle_counts = NULL;
+}
+
+// Pops the most recently used idle connection that is still open, or -1.
+static int idle_take(Upstream *upstream) {
+    if (idle_fds == NULL) {
+        return -1;
+    }
+    int index = (int)(upstream - proxy_config->upstreams);
+    int *stack = idle_fds + index * UPSTREAM_IDLE_MAX;
+    while (idle_counts[index] > 0) {
+        int fd = stack[--idle_counts[index]];
+        char byte;
+        ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        // Closed by the upstream, or bytes nobody asked for.
+        close(fd);
+    }
+    return -1;
+}
+
+static void idle_put(Upstream *upstream, int fd) {
+    int index = (int)(upstream - proxy_config->upstreams);
+    if (idle_fds == NULL || idle_counts[index] == UPSTREAM_IDLE_MAX) {
+        close(fd);
+        return;
+    }
+    idle_fds[index * UPSTREAM_IDLE_MAX + idle_counts[index]++] = fd;
+}
+
+// Starts a non-blocking connect; errors surface on the first send().
+static int upstream_open(Upstream *upstream) {
+    int fd = socket(upstream->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        perror("setsockopt(TCP_NODELAY)");
+    }
+    if (connect(fd, (struct sockaddr *)&upstream->address, upstream->address_len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Ends the current exchange: the upstream socket leaves the event loop and
+ * goes back to the idle pool if `reusable`, otherwise it is closed.
+ */
+static void exchange_end(Connection *conn, int reusable) {
+    ProxyExchange *exchange = conn->proxy;
+    if (exchange->fd < 0) {
+        return;
+    }
+    if (epoll_ctl(proxy_epoll_fd, EPOLL_CTL_DEL, exchange->fd, NULL) < 0) {
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+        reusable = 0;
+    }
+    if (reusable) {
+        idle_put(exchange->upstream, exchange->fd);
+    } else {
+        close(exchange->fd);
+    }
+    exchange->fd = -1;
+    __atomic_sub_fetch(&exchange->upstream->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Picks an upstream and attaches a connection to it, pooled or new, to the
+ * client's event loop entry. Returns -1 once UPSTREAM_ATTEMPTS are used up.
+ */
+static int exchange_connect(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (exchange->attempts < UPSTREAM_ATTEMPTS) {
+        exchange->attempts++;
+        Upstream *upstream = select_upstream(proxy_config->upstreams, proxy_config->upstream_count);
+        int reused = 1;
+        int fd = idle_take(upstream);
+        if (fd < 0) {
+            reused = 0;
+            fd = upstream_open(upstream);
+        }
+        if (fd < 0) {
+            __atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED);
+            upstream_refused(upstream);
+            continue;
+        }
+
+        // Both sockets wake the same connection; proxy_exchange() tries
+        // whichever side can move.
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(proxy_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+            log_error("Failed to register upstream socket with event loop");
+            close(fd);
+            return -1;
+        }
+
+        exchange->upstream = upstream;
+        exchange->fd = fd;
+        exchange->reused = reused;
+        exchange->phase = PROXY_SENDING;
+        exchange->out_sent = 0;
+        exchange->in_len = 0;
+        __atomic_add_fetch(&upstream->in_flight, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&upstream->requests, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return -1;
+}
+
+static int slice_is(HttpSlice slice, const char *name) {
+    size_t len = strlen(name);
+    return slice.len == len && strncasecmp(slice.ptr, name, len) == 0;
+}
+
+// Whether a Connection header of the request lists `name` as an option.
+static int named_by_connection(const HttpRequest *request, HttpSlice name) {
+    for (int i = 0; i < request->header_count; i++) {
+        const HttpHeader *header = &request->headers[i];
+        if (!slice_is(header->name, "Connection")) {
+            continue;
+        }
+        const char *p = header->value.ptr;
+        const char *end = p + header->value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+                p++;
+            }
+            const char *token = p;
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+                p++;
+            }
+            if ((size_t)(p - token) == name.len && name.len > 0 && strncasecmp(token, name.ptr, name.len) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Request headers that describe the client's connection, not the request,
+ * and those the client's Connection header names. Content-Length and
+ * Transfer-Encoding are dropped too: the proxy writes the framing itself.
+ */
+static int hop_by_hop(const HttpRequest *request, HttpSlice name) {
+    return slice_is(name, "Connection") || slice_is(name, "Keep-Alive") || slice_is(name, "Proxy-Connection") ||
+           slice_is(name, "TE") || slice_is(name, "Upgrade") || slice_is(name, "Expect") ||
+           slice_is(name, "X-Forwarded-For") || slice_is(name, "Content-Length") ||
+           slice_is(name, "Transfer-Encoding") || named_by_connection(request, name);
+}
+
+static int append(ProxyExchange *exchange, const char *data, size_t len) {
+    if (len > sizeof(exchange->out) - exchange->out_len) {
+        return -1;
+    }
+    memcpy(exchange->out + exchange->out_len, data, len);
+    exchange->out_len += len;
+    return 0;
+}
+
+static int append_slice(ProxyExchange *exchange, HttpSlice slice) {
+    return append(exchange, slice.ptr, slice.len);
+}
+
+static int append_text(ProxyExchange *exchange, const char *text) {
+    return append(exchange, text, strlen(text));
+}
+
+// Parses a Content-Length value from an upstream; -1 if it is not a plain decimal number.
+static long long parse_content_length(const char *p, size_t len) {
+    long long value = 0;
+    if (len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9' || value > (LLONG_MAX - 9) / 10) {
+            return -1;
+        }
+        value = value * 10 + (p[i] - '0');
+    }
+    return value;
+}
+
+/*
+ * Builds the request the upstream gets: the client's request line and
+ * headers without hop-by-hop fields, X-Forwarded-For, a single
+ * Content-Length for the body as the parser framed it, a keep-alive
+ * Connection header and whatever part of the body is already buffered.
+ */
+static int build_upstream_request(Connection *conn) {
+    const HttpRequest *request = &conn->request;
+    ProxyExchange *exchange = conn->proxy;
+    const HttpSlice *forwarded = http_find_header(request, "X-Forwarded-For");
+    char version[16];
+    snprintf(version, sizeof(version), " HTTP/1.%d\r\n", request->minor_version);
+
+    exchange->out_len = 0;
+    int failed = append_slice(exchange, request->method) || append_text(exchange, " ") ||
+                 append_slice(exchange, request->target) || append_text(exchange, version);
+    for (int i = 0; i < request->header_count && !failed; i++) {
+        const HttpHeader *header = &request->headers[i];
+        if (!hop_by_hop(request, header->name)) {
+            failed = append_slice(exchange, header->name) || append_text(exchange, ": ") ||
+                     append_slice(exchange, header->value) || append_text(exchange, "\r\n");
+        }
+    }
+    if (!failed && (forwarded != NULL || conn->client_ip[0] != '\0')) {
+        failed = append_text(exchange, "X-Forwarded-For: ");
+        if (!failed && forwarded != NULL) {
+            failed = append_slice(exchange, *forwarded) ||
+                     (conn->client_ip[0] != '\0' && append_text(exchange, ", "));
+        }
+        failed = failed || append_text(exchange, conn->client_ip) || append_text(exchange, "\r\n");
+    }
+    long long content_length = request->content_length > 0 ? request->content_length : 0;
+    if (!failed && request->content_length >= 0) {
+        char length[48];
+        snprintf(length, sizeof(length), "Content-Length: %lld\r\n", content_length);
+        failed = append_text(exchange, length);
+    }
+    failed = failed || append_text(exchange, "Connection: keep-alive\r\n\r\n");
+
+    size_t buffered = conn->in_len - request->length;
+    if ((long long)buffered > content_length) {
+        buffered = (size_t)content_length;
+    }
+    failed = failed || append(exchange, conn->in + request->length, buffered);
+    if (failed) {
+        return -1;
+    }
+    conn->request_len = request->length + buffered;
+    exchange->body_left = content_length - (long long)buffered;
+    return 0;
+}
+
+/*
+ * Starts forwarding the request parsed in conn->in. Returns 0 once an
+ * upstream connection is attached and the exchange can run, or the status
+ * (411, 500 or 502) to answer the client with instead.
+ */
+int proxy_request(Connection *conn) {
+    const HttpRequest *request = &conn->request;
+
+    // Chunked uploads would need decoding to know where they end. The
+    // parser has already refused Content-Length fields that disagree.
+    if (request->transfer_encoding) {
+        return 411;
+    }
+
+    if (conn->proxy == NULL) {
+        conn->proxy = malloc(sizeof(ProxyExchange));
+        if (conn->proxy == NULL) {
+            log_error("Failed to allocate proxy state");
+            return 500;
+        }
+        conn->proxy->fd = -1;
+    }
+    ProxyExchange *exchange = conn->proxy;
+    if (build_upstream_request(conn) < 0) {
+        return 500;
+    }
+
+    const HttpSlice *expect = http_find_header(request, "Expect");
+    exchange->expect_continue = expect != NULL && slice_is(*expect, "100-continue") && exchange->body_left > 0;
+    exchange->continue_sent = 0;
+    exchange->body_spliced = 0;
+    exchange->head_request = http_slice_equals(request->method, "HEAD");
+    exchange->idempotent = exchange->head_request || http_slice_equals(request->method, "GET") ||
+                           http_slice_equals(request->method, "OPTIONS") ||
+                           http_slice_equals(request->method, "PUT") || http_slice_equals(request->method, "DELETE");
+    exchange->framing = BODY_NONE;
+    exchange->remaining = 0;
+    exchange->chunk_state = CHUNK_SIZE;
+    exchange->chunk_digits = 0;
+    exchange->upstream_keep_alive = 0;
+    exchange->in_ready = 0;
+    exchange->in_sent = 0;
+    exchange->attempts = 0;
+    if (exchange_connect(conn) < 0) {
+        return 502;
+    }
+
+    conn->state = CONN_WRITING;
+    conn->status = 0;
+    conn->response_bytes = 0;
+    return 0;
+}
+
+static ProxyStep send_request_head(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (exchange->out_sent < exchange->out_len) {
+        // Stamped before the call: the upstream may answer before it returns.
+        exchange->sent_ns = monotonic_ns();
+        ssize_t n = send(exchange->fd, exchange->out + exchange->out_sent, exchange->out_len - exchange->out_sent,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            exchange->out_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        return STEP_UPSTREAM_FAILED;
+    }
+    exchange->phase = exchange->body_left > 0 ? PROXY_SENDING_BODY : PROXY_READING_HEAD;
+    return STEP_DONE;
+}
+
+static int ensure_pipe(Connection *conn) {
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Moves the rest of the request body client -> pipe -> upstream.
+static ProxyStep send_request_body(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (exchange->expect_continue && exchange->continue_sent < sizeof(continue_line) - 1) {
+        ssize_t n = send(conn->fd, continue_line + exchange->continue_sent,
+                         sizeof(continue_line) - 1 - exchange->continue_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            exchange->continue_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        return STEP_CLIENT_GONE;
+    }
+
+    while (1) {
+        if (conn->pipe_pending > 0) {
+            exchange->sent_ns = monotonic_ns();
+            ssize_t sent = splice(conn->pipe_fds[0], NULL, exchange->fd, NULL, conn->pipe_pending,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent > 0) {
+                conn->pipe_pending -= (size_t)sent;
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return STEP_BLOCKED;
+            }
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        if (exchange->body_left == 0) {
+            exchange->phase = PROXY_READING_HEAD;
+            return STEP_DONE;
+        }
+        if (ensure_pipe(conn) < 0) {
+            return STEP_CLIENT_GONE;
+        }
+        size_t count = exchange->body_left > SPLICE_CHUNK ? SPLICE_CHUNK : (size_t)exchange->body_left;
+        ssize_t n = splice(conn->fd, NULL, conn->pipe_fds[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            conn->pipe_pending = (size_t)n;
+            exchange->body_left -= n;
+            exchange->body_spliced += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        return STEP_CLIENT_GONE;
+    }
+}
+
+// Sets *keep_alive from the close / keep-alive tokens of a Connection value.
+static void connection_tokens(const char *p, const char *end, int *keep_alive) {
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t len = (size_t)(p - token);
+        if (len == 5 && strncasecmp(token, "close", 5) == 0) {
+            *keep_alive = 0;
+        } else if (len == 10 && strncasecmp(token, "keep-alive", 10) == 0) {
+            *keep_alive = 1;
+        }
+    }
+}
+
+/*
+ * Parses the upstream's response header, the first head_len bytes of in[],
+ * and writes the header the client gets into out[]: every field except the
+ * hop-by-hop ones, then this connection's own Connection header. Returns
+ * the status code, or -1 for a header the client cannot be given.
+ */
+static int rewrite_response_head(Connection *conn, size_t head_len) {
+    ProxyExchange *exchange = conn->proxy;
+    const char *p = exchange->in;
+    const char *end = exchange->in + head_len;
+
+    const char *line_end = memchr(p, '\n', (size_t)(end - p));
+    if (line_end - p < 12 || strncmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1') || p[8] != ' ' ||
+        p[9] < '1' || p[9] > '5' || p[10] < '0' || p[10] > '9' || p[11] < '0' || p[11] > '9') {
+        return -1;
+    }
+    int status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    int keep_alive = p[7] == '1';
+    int chunked = 0;
+    long long content_length = -1;
+
+    exchange->out_len = 0;
+    exchange->out_sent = 0;
+    int failed = append(exchange, p, (size_t)(line_end + 1 - p));
+    for (p = line_end + 1; p < end && !failed; p = line_end + 1) {
+        line_end = memchr(p, '\n', (size_t)(end - p));
+        const char *value_end = line_end > p && line_end[-1] == '\r' ? line_end - 1 : line_end;
+        if (value_end == p) {
+            break;
+        }
+        const char *colon = memchr(p, ':', (size_t)(value_end - p));
+        if (colon == NULL || colon == p || *p == ' ' || *p == '\t') {
+            return -1;
+        }
+        HttpSlice name = {p, (size_t)(colon - p)};
+        const char *value = colon + 1;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        const char *trimmed = value_end;
+        while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) {
+            trimmed--;
+        }
+
+        if (slice_is(name, "Connection")) {
+            connection_tokens(value, trimmed, &keep_alive);
+            continue;
+        }
+        if (slice_is(name, "Keep-Alive") || slice_is(name, "Proxy-Connection")) {
+            continue;
+        }
+        if (slice_is(name, "Content-Length")) {
+            long long parsed = parse_content_length(value, (size_t)(trimmed - value));
+            if (parsed < 0 || (content_length >= 0 && parsed != content_length)) {
+                return -1;
+            }
+            content_length = parsed;
+            continue;       // written below, once Transfer-Encoding is known
+        } else if (slice_is(name, "Transfer-Encoding")) {
+            // Only a final "chunked" frames the body; anything else runs to close.
+            chunked = trimmed - value >= 7 && strncasecmp(trimmed - 7, "chunked", 7) == 0 ? 1 : -1;
+        }
+        failed = append(exchange, p, (size_t)(line_end + 1 - p));
+    }
+
+    // Transfer-Encoding overrides Content-Length, which must not reach the
+    // client beside it (RFC 9112 6.3). Such a response may have been framed
+    // differently by the upstream, so its connection is not reused either.
+    if (chunked == 0 && content_length >= 0) {
+        char length[48];
+        snprintf(length, sizeof(length), "Content-Length: %lld\r\n", content_length);
+        failed = failed || append_text(exchange, length);
+    } else if (chunked != 0 && content_length >= 0) {
+        keep_alive = 0;
+    }
+
+    exchange->remaining = 0;
+    if (exchange->head_request || status < 200 || status == 204 || status == 304) {
+        exchange->framing = BODY_NONE;
+    } else if (chunked > 0) {
+        exchange->framing = BODY_CHUNKED;
+    } else if (chunked == 0 && content_length >= 0) {
+        exchange->framing = content_length > 0 ? BODY_LENGTH : BODY_NONE;
+        exchange->remaining = content_length;
+    } else {
+        exchange->framing = BODY_UNTIL_CLOSE;
+        keep_alive = 0;
+        conn->keep_alive = 0;
+    }
+    exchange->upstream_keep_alive = keep_alive;
+    exchange->chunk_state = CHUNK_SIZE;
+    exchange->chunk_digits = 0;
+
+    failed = failed || append_text(exchange, conn->keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                                                : "Connection: close\r\n\r\n");
+    return failed ? -1 : status;
+}
+
+// Reads until the response header is complete and turns it into out[].
+static ProxyStep read_response_head(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (1) {
+        const char *end = memmem(exchange->in, exchange->in_len, "\r\n\r\n", 4);
+        if (end != NULL) {
+            size_t head_len = (size_t)(end - exchange->in) + 4;
+            int status = rewrite_response_head(conn, head_len);
+            if (status < 0 || status == 101) {
+                log_error("Unusable response header from upstream");
+                return STEP_UPSTREAM_FAILED;
+            }
+            if (status < 200) {
+                // Interim responses are not relayed; the final one follows.
+                exchange->in_len -= head_len;
+                memmove(exchange->in, exchange->in + head_len, exchange->in_len);
+                continue;
+            }
+            long long latency = monotonic_ns() - exchange->sent_ns;
+            stats_record(STAGE_UPSTREAM, latency);
+            record_latency(exchange->upstream, latency);
+            conn->status = status;
+            exchange->in_ready = head_len;
+            exchange->in_sent = head_len;
+            exchange->phase = PROXY_RELAYING;
+            return STEP_DONE;
+        }
+        if (exchange->in_len == sizeof(exchange->in)) {
+            log_error("Upstream response header too large");
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        ssize_t n = recv(exchange->fd, exchange->in + exchange->in_len, sizeof(exchange->in) - exchange->in_len, 0);
+        if (n > 0) {
+            exchange->in_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        return STEP_UPSTREAM_FAILED;
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+// Walks chunked framing; returns how many bytes belong to the body, or -1.
+static long frame_chunks(ProxyExchange *exchange, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && exchange->chunk_state != CHUNK_DONE) {
+        char c = data[i];
+        switch (exchange->chunk_state) {
+        case CHUNK_SIZE: {
+            int digit = hex_value(c);
+            if (digit < 0) {
+                if (exchange->chunk_digits == 0) {
+                    return -1;
+                }
+                exchange->chunk_state = CHUNK_EXTENSION;
+                break;
+            }
+            if (exchange->remaining > (LLONG_MAX >> 4)) {
+                return -1;
+            }
+            exchange->remaining = exchange->remaining * 16 + digit;
+            exchange->chunk_digits++;
+            i++;
+            break;
+        }
+        case CHUNK_EXTENSION:
+            i++;
+            if (c == '\n') {
+                exchange->chunk_state = exchange->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_DATA: {
+            size_t take = (long long)(len - i) < exchange->remaining ? len - i : (size_t)exchange->remaining;
+            i += take;
+            exchange->remaining -= (long long)take;
+            if (exchange->remaining == 0) {
+                exchange->chunk_state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (c == '\n') {
+                exchange->chunk_state = CHUNK_SIZE;
+                exchange->chunk_digits = 0;
+            } else if (c != '\r') {
+                return -1;
+            }
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (c == '\n') {
+                exchange->chunk_state = CHUNK_DONE;
+            } else if (c != '\r') {
+                exchange->chunk_state = CHUNK_TRAILER_LINE;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (c == '\n') {
+                exchange->chunk_state = CHUNK_TRAILER;
+            }
+            break;
+        }
+    }
+    return (long)i;
+}
+
+// How many of `len` buffered bytes belong to the response body, or -1.
+static long frame_body(ProxyExchange *exchange, const char *data, size_t len) {
+    switch (exchange->framing) {
+    case BODY_LENGTH: {
+        size_t take = (long long)len < exchange->remaining ? len : (size_t)exchange->remaining;
+        exchange->remaining -= (long long)take;
+        return (long)take;
+    }
+    case BODY_CHUNKED:
+        return frame_chunks(exchange, data, len);
+    case BODY_UNTIL_CLOSE:
+        return (long)len;
+    default:
+        return 0;
+    }
+}
+
+static int body_complete(const ProxyExchange *exchange) {
+    switch (exchange->framing) {
+    case BODY_LENGTH:
+        return exchange->remaining == 0;
+    case BODY_CHUNKED:
+        return exchange->chunk_state == CHUNK_DONE;
+    case BODY_UNTIL_CLOSE:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// Sends data[*sent, len) to the client; 1 when done, 0 on EAGAIN, -1 on error.
+static int send_to_client(Connection *conn, const char *data, size_t *sent, size_t len) {
+    while (*sent < len) {
+        ssize_t n = send(conn->fd, data + *sent, len - *sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            *sent += (size_t)n;
+            conn->response_bytes += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+    return 1;
+}
+
+// The upstream broke off a response the client has already started to receive.
+static int relay_failed(Connection *conn, const char *message) {
+    log_error(message);
+    __atomic_add_fetch(&conn->proxy->upstream->failures, 1, __ATOMIC_RELAXED);
+    exchange_end(conn, 0);
+    errno = EPIPE;
+    return -1;
+}
+
+/*
+ * Sends the rewritten header, then the body: bytes that arrived with the
+ * header are framed and sent from in[], the rest is spliced through the
+ * pipe. Chunk size lines are read into in[] so the end of the body is seen.
+ */
+static int relay_response(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (1) {
+        int status = send_to_client(conn, exchange->out, &exchange->out_sent, exchange->out_len);
+        if (status == 1) {
+            status = send_to_client(conn, exchange->in, &exchange->in_sent, exchange->in_ready);
+        }
+        if (status <= 0) {
+            return status;
+        }
+
+        if (conn->pipe_pending > 0) {
+            ssize_t sent = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_pending,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent > 0) {
+                conn->pipe_pending -= (size_t)sent;
+                conn->response_bytes += sent;
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return -1;
+        }
+
+        if (exchange->in_ready < exchange->in_len) {
+            long framed = frame_body(exchange, exchange->in + exchange->in_ready, exchange->in_len - exchange->in_ready);
+            if (framed < 0) {
+                return relay_failed(conn, "Malformed chunked body from upstream");
+            }
+            exchange->in_ready += (size_t)framed;
+            if (body_complete(exchange) && exchange->in_ready < exchange->in_len) {
+                // Bytes past the end of the response: the stream is out of step.
+                exchange->upstream_keep_alive = 0;
+                exchange->in_len = exchange->in_ready;
+            }
+            continue;
+        }
+        exchange->in_len = exchange->in_ready = exchange->in_sent = 0;
+
+        if (body_complete(exchange)) {
+            exchange_end(conn, exchange->upstream_keep_alive);
+            return 1;
+        }
+
+        if (exchange->framing == BODY_CHUNKED && exchange->chunk_state != CHUNK_DATA) {
+            ssize_t n = recv(exchange->fd, exchange->in, sizeof(exchange->in), 0);
+            if (n > 0) {
+                exchange->in_len = (size_t)n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return relay_failed(conn, "Upstream closed mid-response");
+        }
+
+        if (ensure_pipe(conn) < 0) {
+            return relay_failed(conn, "Failed to create splice pipe for upstream body");
+        }
+        size_t count = SPLICE_CHUNK;
+        if (exchange->framing != BODY_UNTIL_CLOSE && exchange->remaining < SPLICE_CHUNK) {
+            count = (size_t)exchange->remaining;
+        }
+        ssize_t n = splice(exchange->fd, NULL, conn->pipe_fds[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            conn->pipe_pending = (size_t)n;
+            if (exchange->framing != BODY_UNTIL_CLOSE) {
+                exchange->remaining -= n;
+                if (exchange->framing == BODY_CHUNKED && exchange->remaining == 0) {
+                    exchange->chunk_state = CHUNK_DATA_END;
+                }
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == 0 && exchange->framing == BODY_UNTIL_CLOSE) {
+            exchange->framing = BODY_NONE;
+            exchange->upstream_keep_alive = 0;
+            continue;
+        }
+        return relay_failed(conn, "Upstream closed mid-response");
+    }
+}
+
+/*
+ * Gives up on the current upstream connection before the client has seen
+ * anything. Returns 1 if the request went out again on another one. That
+ * is done when nothing was sent at all, or when the failed connection was
+ * reused, since the upstream may have closed it just as the request
+ * arrived. But a reused connection may also have died after the upstream
+ * acted on the request, so only an idempotent method or a request whose
+ * head never went out in full is replayed; a POST gets a 502 instead.
+ */
+static int upstream_failed(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    Upstream *upstream = exchange->upstream;
+    int refused = !exchange->reused && exchange->phase == PROXY_SENDING && exchange->out_sent == 0;
+    int unsent = exchange->out_sent < exchange->out_len && exchange->body_spliced == 0;
+    int replayable = refused || (exchange->reused && (exchange->idempotent || unsent));
+    int retry = replayable && exchange->in_len == 0 && exchange->body_spliced == 0;
+
+    exchange_end(conn, 0);
+    __atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED);
+    if (refused) {
+        upstream_refused(upstream);
+    }
+    return retry && exchange_connect(conn) == 0;
+}
+
+// Answers the client locally, e.g. with a 502 when no upstream responded.
+static int answer_locally(Connection *conn, const char *header_format, const char *body) {
+    conn->keep_alive = 0;
+    queue_response(conn, header_format, body);
+    return send_file(conn);
+}
+
+/*
+ * Proxy counterpart of send_file(): runs the exchange as far as both
+ * sockets allow. Returns 1 when the response has been relayed in full, 0
+ * when a socket would block and -1 when the client connection should close.
+ */
+int proxy_exchange(Connection *conn) {
+    ProxyExchange *exchange = conn->proxy;
+    while (1) {
+        ProxyStep step;
+        switch (exchange->phase) {
+        case PROXY_SENDING:
+            step = send_request_head(conn);
+            break;
+        case PROXY_SENDING_BODY:
+            step = send_request_body(conn);
+            break;
+        case PROXY_READING_HEAD:
+            step = read_response_head(conn);
+            break;
+        default:
+            return relay_response(conn);
+        }
+
+        if (step == STEP_BLOCKED) {
+            return 0;
+        }
+        if (step == STEP_CLIENT_GONE) {
+            return -1;
+        }
+        if (step == STEP_UPSTREAM_FAILED && !upstream_failed(conn)) {
+            return answer_locally(conn, http_502, body_502);
+        }
+    }
+}
+
+// Called when neither socket has moved for upstream_timeout_ms.
+void handle_upstream_timeout(Connection *conn, const Server *config) {
+    ProxyExchange *exchange = conn->proxy;
+    char message[192];
+    snprintf(message, sizeof(message), "Upstream %s timed out", exchange->upstream->name);
+    log_error(message);
+    __atomic_add_fetch(&exchange->upstream->failures, 1, __ATOMIC_RELAXED);
+
+    int answered = exchange->phase == PROXY_RELAYING;
+    exchange_end(conn, 0);
+    if (answered) {
+        conn->state = CONN_CLOSED;
+        return;
+    }
+    conn->keep_alive = 0;
+    queue_response(conn, http_504, body_504);
+    handle_connection(conn, config);
+}
+
+void proxy_close(Connection *conn) {
+    exchange_end(conn, 0);
+    free(conn->proxy);
+    conn->proxy = NULL;
+}
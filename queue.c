@@ -1,48 +1,257 @@
-// queue.c
-
-#include <stddef.h>
-
-#include "server.h"
-
-
-
-void client_queue_init(ClientQueue *q) {
-    q->front = 0;
-    q->rear = 0;
-    sem_init(&q->filled, 0, 0);
-    sem_init(&q->empty, 0, MAX_QUEUE_SIZE);
-    pthread_mutex_init(&q->mutex, NULL);
-}
-
-void client_queue_push(ClientQueue *q, int client_fd) {
-    sem_wait(&q->empty);
-    pthread_mutex_lock(&q->mutex);
-
-    q->sockets[q->rear] = client_fd;
-    q->rear = (q->rear + 1) % MAX_QUEUE_SIZE;
-
-    pthread_mutex_unlock(&q->mutex);
-    sem_post(&q->filled);
-}
-
-int client_queue_pop(ClientQueue *q) {
-    sem_wait(&q->filled);
-    pthread_mutex_lock(&q->mutex);
-
-    int client_fd = q->sockets[q->front];
-    q->front = (q->front + 1) % MAX_QUEUE_SIZE;
-
-    pthread_mutex_unlock(&q->mutex);
-    sem_post(&q->empty);
-
-    return client_fd;
-}
-
-void *worker_thread(void *arg) {
-    Server *config = (Server *)arg;
-    while (1) {
-        int client_fd = client_queue_pop(&client_queue);
-        handle_connection(client_fd, config);
-    }
-    return NULL;
-}
+// queue.c
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+
+#define QUEUE_MASK (MAX_QUEUE_SIZE - 1)
+#define QUEUE_SPIN_LIMIT 128
+
+_Static_assert((MAX_QUEUE_SIZE & QUEUE_MASK) == 0, "MAX_QUEUE_SIZE must be a power of two");
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Same clock as monotonic_ns(); kept local so the queue links on its own.
+static long long queue_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void futex_wait(unsigned int *word, unsigned int expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void client_queue_init(ClientQueue *q) {
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    q->not_empty = 0;
+    q->not_full = 0;
+    q->pop_waiters = 0;
+    q->push_waiters = 0;
+    q->loop_waiters = 0;
+    q->signaled = 0;
+    for (size_t i = 0; i < MAX_QUEUE_SIZE; i++) {
+        q->slots[i].sequence = i;
+        q->slots[i].client_fd = -1;
+    }
+
+    // Readable while the ring holds sockets; see client_queue_pop_woken().
+    q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->event_fd < 0) {
+        perror("eventfd");
+        log_error("Failed to create client queue eventfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Decrements *count unless it is zero; returns whether it did.
+static int take_one(unsigned int *count) {
+    unsigned int n = __atomic_load_n(count, __ATOMIC_SEQ_CST);
+    while (n > 0 && !__atomic_compare_exchange_n(count, &n, n - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    }
+    return n > 0;
+}
+
+/*
+ * Makes event_fd readable when the ring turns non-empty, and wakes one
+ * more loop while any sleep on it, like futex_wake() for pop_waiters.
+ * Each write claims the sleeper it wakes, so a burst wakes every idle
+ * loop once; a push into a signalled ring with every loop busy or already
+ * woken costs no system call, as the loops find the socket when they poll.
+ */
+static void client_queue_signal(ClientQueue *q) {
+    if (q->event_fd < 0) {
+        return;
+    }
+    int raised = __atomic_exchange_n(&q->signaled, 1, __ATOMIC_SEQ_CST) == 0;
+    if (take_one(&q->loop_waiters) || raised) {
+        uint64_t one = 1;
+        if (write(q->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write(eventfd)");
+        }
+    }
+}
+
+// Returns 0 on success, -1 when the ring is full.
+int client_queue_try_push(ClientQueue *q, int client_fd) {
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    ClientQueueSlot *slot;
+    while (1) {
+        slot = &q->slots[pos & QUEUE_MASK];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->client_fd = client_fd;
+    slot->enqueued_ns = queue_now_ns();
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&q->not_empty, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->pop_waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&q->not_empty);
+    }
+
+    client_queue_signal(q);
+    return 0;
+}
+
+/*
+ * Non-blocking pop used by the event loops; returns -1 when empty. When
+ * `enqueued_ns` is not NULL it receives the monotonic time of the push.
+ */
+int client_queue_try_pop_timed(ClientQueue *q, long long *enqueued_ns) {
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    ClientQueueSlot *slot;
+    while (1) {
+        slot = &q->slots[pos & QUEUE_MASK];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    int client_fd = slot->client_fd;
+    if (enqueued_ns != NULL) {
+        *enqueued_ns = slot->enqueued_ns;
+    }
+    __atomic_store_n(&slot->sequence, pos + QUEUE_MASK + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&q->not_full, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->push_waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&q->not_full);
+    }
+    return client_fd;
+}
+
+int client_queue_try_pop(ClientQueue *q) {
+    return client_queue_try_pop_timed(q, NULL);
+}
+
+/*
+ * Pop for an event loop that saw event_fd readable; returns -1 if the ring
+ * was empty. event_fd stays readable while sockets remain, so each loop
+ * that polls takes one and the backlog is still spread across loops. The
+ * loop that empties the ring drains event_fd and clears `signaled`, then
+ * looks again: a push that saw the old signal did not write.
+ */
+int client_queue_pop_woken(ClientQueue *q, long long *enqueued_ns) {
+    int client_fd = client_queue_try_pop_timed(q, enqueued_ns);
+    if (client_queue_depth(q) == 0) {
+        uint64_t count;
+        if (read(q->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read(eventfd)");
+        }
+        __atomic_store_n(&q->signaled, 0, __ATOMIC_SEQ_CST);
+        if (client_queue_depth(q) > 0) {
+            client_queue_signal(q);
+        }
+    }
+    return client_fd;
+}
+
+/*
+ * Brackets an event loop's epoll_wait() so pushes know a loop may need
+ * waking. The count is a hint: a loop whose slot a push already claimed
+ * leaves it alone, and a miscount only wakes a loop more or less, never
+ * strands a socket, since event_fd stays readable while the ring is not empty.
+ */
+void client_queue_loop_sleeping(ClientQueue *q, int sleeping) {
+    if (sleeping) {
+        __atomic_add_fetch(&q->loop_waiters, 1, __ATOMIC_SEQ_CST);
+    } else {
+        take_one(&q->loop_waiters);
+    }
+}
+
+// Sockets pushed but not yet popped; a snapshot that may lag concurrent callers.
+size_t client_queue_depth(const ClientQueue *q) {
+    size_t dequeued = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    size_t enqueued = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/*
+ * Blocks while the ring is full: spin first, since a consumer usually frees
+ * a slot within a few hundred cycles, then park on the not_full futex. The
+ * word is sampled before the final attempt, so a pop that lands in between
+ * changes it and the futex_wait() returns immediately.
+ */
+void client_queue_push(ClientQueue *q, int client_fd) {
+    for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+        if (client_queue_try_push(q, client_fd) == 0) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    while (1) {
+        unsigned int seen = __atomic_load_n(&q->not_full, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+        int pushed = client_queue_try_push(q, client_fd) == 0;
+        if (!pushed) {
+            futex_wait(&q->not_full, seen);
+        }
+        __atomic_sub_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+        if (pushed) {
+            return;
+        }
+    }
+}
+
+// Blocking counterpart of client_queue_try_pop(), with the same spin-then-park policy.
+int client_queue_pop(ClientQueue *q) {
+    for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+        int client_fd = client_queue_try_pop(q);
+        if (client_fd >= 0) {
+            return client_fd;
+        }
+        cpu_relax();
+    }
+
+    while (1) {
+        unsigned int seen = __atomic_load_n(&q->not_empty, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+        int client_fd = client_queue_try_pop(q);
+        if (client_fd < 0) {
+            futex_wait(&q->not_empty, seen);
+        }
+        __atomic_sub_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+        if (client_fd >= 0) {
+            return client_fd;
+        }
+    }
+}
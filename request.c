@@ -1,41 +1,404 @@
-// request.c
-
+// request.c
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/random.h>
 #include "server.h"
-
-int is_valid_request(const char *request) {
-    const char *ptr;
-    char version[16];
-
-    if (strncmp(request, "GET ", 4) != 0) {
-        return 0;
-    }
-
-    ptr = strchr(request + 4, ' ');
-    if (!ptr) {
-        return 0;
-    }
-
-    if (sscanf(ptr + 1, "%15s", version) != 1) {
-        return 0;
-    }
-
-    if (strcmp(version, "HTTP/1.1") != 0 && strcmp(version, "HTTP/1.0") != 0) {
-        return 0;
-    }
-
-    return 1;
-}
-
-
-static int send_all(int sockfd, const char *buf, size_t len) {
+
+// Sidecar codings in order of preference.
+const ContentCoding content_codings[] = {
+    {ENCODING_BR, "br", ".br", "Content-Encoding: br\r\nVary: Accept-Encoding\r\n"},
+    {ENCODING_GZIP, "gzip", ".gz", "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"},
+    {0, NULL, NULL, NULL}
+};
+
+// Sent with the uncompressed bytes of a file that also has sidecars.
+const char *vary_header = "Vary: Accept-Encoding\r\n";
+
+/*
+ * Decides whether the connection may stay open after this request.
+ * HTTP/1.1 persists unless the client sends "Connection: close"; HTTP/1.0
+ * only persists when it asks for "Connection: keep-alive".
+ */
+int wants_keep_alive(const HttpRequest *request) {
+    int keep_alive = (request->minor_version == 1);
+
+    for (int i = 0; i < request->header_count; i++) {
+        const HttpHeader *header = &request->headers[i];
+        if (header->name.len != 10 || strncasecmp(header->name.ptr, "Connection", 10) != 0) {
+            continue;
+        }
+
+        const char *p = header->value.ptr;
+        const char *end = p + header->value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+                p++;
+            }
+            const char *token = p;
+            while (p < end && *p != ',') {
+                p++;
+            }
+            const char *token_end = p;
+            while (token_end > token && (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+                token_end--;
+            }
+            size_t token_len = (size_t)(token_end - token);
+            if (token_len == 5 && strncasecmp(token, "close", 5) == 0) {
+                keep_alive = 0;
+            } else if (token_len == 10 && strncasecmp(token, "keep-alive", 10) == 0) {
+                keep_alive = 1;
+            }
+        }
+    }
+
+    return keep_alive;
+}
+
+// True for a qvalue of zero ("0", "0.", "0.000"), which means "not acceptable".
+static int qvalue_is_zero(const char *p, const char *end) {
+    if (p == end || *p != '0') {
+        return 0;
+    }
+    p++;
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p == '0') {
+            p++;
+        }
+    }
+    return p == end;
+}
+
+/*
+ * Returns the ENCODING_* flags the client will accept, from every
+ * Accept-Encoding header. Codings with q=0 are refused; "*" stands for any
+ * coding not listed explicitly.
+ */
+int accepted_encodings(const HttpRequest *request) {
+    int accepted = 0;
+    int listed = 0;
+    int wildcard = 0;
+
+    for (int i = 0; i < request->header_count; i++) {
+        const HttpHeader *header = &request->headers[i];
+        if (header->name.len != 15 || strncasecmp(header->name.ptr, "Accept-Encoding", 15) != 0) {
+            continue;
+        }
+
+        const char *p = header->value.ptr;
+        const char *end = p + header->value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+                p++;
+            }
+            const char *element = p;
+            while (p < end && *p != ',') {
+                p++;
+            }
+            const char *element_end = p;
+
+            const char *token_end = memchr(element, ';', (size_t)(element_end - element));
+            const char *params = token_end ? token_end + 1 : element_end;
+            if (token_end == NULL) {
+                token_end = element_end;
+            }
+            while (token_end > element && (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+                token_end--;
+            }
+
+            int refused = 0;
+            while (params < element_end) {
+                while (params < element_end && (*params == ' ' || *params == '\t' || *params == ';')) {
+                    params++;
+                }
+                if (params == element_end) {
+                    break;
+                }
+                const char *param_end = memchr(params, ';', (size_t)(element_end - params));
+                if (param_end == NULL) {
+                    param_end = element_end;
+                }
+                const char *value_end = param_end;
+                while (value_end > params && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                    value_end--;
+                }
+                if (value_end - params >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+                    refused = qvalue_is_zero(params + 2, value_end);
+                }
+                params = param_end;
+            }
+
+            size_t token_len = (size_t)(token_end - element);
+            int flag = 0;
+            if (token_len == 1 && *element == '*') {
+                wildcard = refused ? -1 : 1;
+                continue;
+            }
+            for (const ContentCoding *coding = content_codings; coding->flag != 0; coding++) {
+                if (token_len == strlen(coding->token) && strncasecmp(element, coding->token, token_len) == 0) {
+                    flag = coding->flag;
+                }
+            }
+            if (token_len == 6 && strncasecmp(element, "x-gzip", 6) == 0) {
+                flag = ENCODING_GZIP;
+            }
+            if (flag != 0) {
+                listed |= flag;
+                accepted = refused ? (accepted & ~flag) : (accepted | flag);
+            }
+        }
+    }
+
+    if (wildcard > 0) {
+        accepted |= (ENCODING_GZIP | ENCODING_BR) & ~listed;
+    }
+    return accepted;
+}
+
+// Weak comparison of an If-None-Match list against our (strong) ETag.
+static int etag_list_matches(const HttpSlice *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list->ptr;
+    const char *end = p + list->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        const char *tag = p;
+        if (p < end && *p == '"') {
+            const char *close = memchr(p + 1, '"', (size_t)(end - p - 1));
+            p = close ? close + 1 : end;
+        } else {
+            while (p < end && *p != ',') {
+                p++;
+            }
+        }
+        if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+// Accepts the three HTTP-date forms of RFC 7231 section 7.1.1.1.
+static int parse_http_date(const HttpSlice *value, time_t *out) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %e %H:%M:%S %Y"          // asctime()
+    };
+    char text[64];
+    if (value->len >= sizeof(text)) {
+        return 0;
+    }
+    memcpy(text, value->ptr, value->len);
+    text[value->len] = '\0';
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(text, formats[i], &tm);
+        if (rest != NULL && *rest == '\0') {
+            *out = timegm(&tm);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Evaluates the conditional headers of a GET (RFC 7232 section 6): if
+ * If-None-Match is present it alone decides, otherwise a valid
+ * If-Modified-Since no later than now is compared with the mtime.
+ * Returns 1 when the client's copy is current and a 304 should be sent.
+ */
+int request_not_modified(const HttpRequest *request, const char *etag, time_t mtime) {
+    const HttpSlice *if_none_match = http_find_header(request, "If-None-Match");
+    if (if_none_match != NULL) {
+        return etag_list_matches(if_none_match, etag);
+    }
+
+    const HttpSlice *if_modified_since = http_find_header(request, "If-Modified-Since");
+    time_t since;
+    if (if_modified_since != NULL && parse_http_date(if_modified_since, &since) && since <= time(NULL)) {
+        return mtime <= since;
+    }
+    return 0;
+}
+
+/*
+ * If-Range (RFC 7233 section 3.2): the Range header only counts when the
+ * validator still names the current version, which for an entity-tag means
+ * a strong match and for a date an exact match with Last-Modified.
+ */
+int range_applies(const HttpRequest *request, const char *etag, time_t mtime) {
+    const HttpSlice *if_range = http_find_header(request, "If-Range");
+    if (if_range == NULL) {
+        return 1;
+    }
+    if (if_range->len > 0 && (if_range->ptr[0] == '"' || if_range->ptr[0] == 'W')) {
+        return http_slice_equals(*if_range, etag);
+    }
+    time_t date;
+    return parse_http_date(if_range, &date) && date == mtime;
+}
+
+// Reads a run of digits into *out; 0 if there are none or the value overflows.
+static int parse_range_number(const char **p, const char *end, off_t *out) {
+    const char *start = *p;
+    long long value = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (value > (LLONG_MAX - (**p - '0')) / 10) {
+            return 0;
+        }
+        value = value * 10 + (**p - '0');
+        (*p)++;
+    }
+    *out = (off_t)value;
+    return *p > start;
+}
+
+/*
+ * Parses a "bytes=" Range value against a file of `size` bytes into at most
+ * `max` ranges, clamped to the file. Returns the number of satisfiable
+ * ranges, -1 if none is satisfiable (416), or 0 when the header must be
+ * ignored and the whole file sent: a syntax error, another unit, or more
+ * ranges than `max`.
+ */
+int parse_byte_ranges(const HttpSlice *value, off_t size, HttpRange *ranges, int max) {
+    const char *p = value->ptr;
+    const char *end = p + value->len;
+    if (value->len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    p += 6;
+
+    int count = 0;
+    int specs = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        if (++specs > max) {
+            return 0;
+        }
+
+        off_t first = 0;
+        off_t last = size - 1;
+        if (*p == '-') {
+            // Suffix range: the final `n` bytes.
+            off_t suffix;
+            p++;
+            if (!parse_range_number(&p, end, &suffix)) {
+                return 0;
+            }
+            if (suffix == 0) {
+                first = size;
+            } else if (suffix < size) {
+                first = size - suffix;
+            }
+        } else {
+            if (!parse_range_number(&p, end, &first) || p == end || *p != '-') {
+                return 0;
+            }
+            p++;
+            if (p < end && *p >= '0' && *p <= '9') {
+                // An overflowing last-pos is a syntax error like any other: ignore the header.
+                off_t requested_last;
+                if (!parse_range_number(&p, end, &requested_last) || requested_last < first) {
+                    return 0;
+                }
+                if (requested_last < last) {
+                    last = requested_last;
+                }
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p != ',') {
+            return 0;
+        }
+
+        if (first < size) {
+            ranges[count].start = first;
+            ranges[count].length = last - first + 1;
+            count++;
+        }
+    }
+
+    if (specs == 0) {
+        return 0;
+    }
+    return count > 0 ? count : -1;
+}
+
+static char boundary[24];
+static pthread_once_t boundary_once = PTHREAD_ONCE_INIT;
+
+static void init_boundary(void) {
+    unsigned long long bits;
+    if (getrandom(&bits, sizeof(bits), GRND_NONBLOCK) != (ssize_t)sizeof(bits)) {
+        bits = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid();
+    }
+    snprintf(boundary, sizeof(boundary), "%016llx", bits);
+}
+
+// The separator between multipart/byteranges parts, chosen once per process.
+const char *range_boundary(void) {
+    pthread_once(&boundary_once, init_boundary);
+    return boundary;
+}
+
+/*
+ * Formats the delimiter and part header that precede conn->ranges[index],
+ * or the closing delimiter when index == range_count. With a NULL buf it
+ * just measures, which is how the Content-Length is worked out up front.
+ */
+int format_range_part(char *buf, size_t size, const Connection *conn, int index) {
+    if (index == conn->range_count) {
+        return snprintf(buf, size, "\r\n--%s--\r\n", range_boundary());
+    }
+    const HttpRange *range = &conn->ranges[index];
+    return snprintf(buf, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    range_boundary(), conn->range_mime, (long long)range->start,
+                    (long long)(range->start + range->length - 1), (long long)conn->range_total);
+}
+
+/*
+ * Sends as much of the connection's pending output buffer as the socket
+ * accepts. `more` hints that body data follows so the kernel can coalesce
+ * the two. Returns 1 once the buffer is drained, 0 if the socket would
+ * block and -1 on error with errno preserved.
+ */
+static int send_pending(Connection *conn, int more) {
 #if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
     int set = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) < 0) {
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) < 0) {
         if (errno != EINVAL && errno != ENOPROTOOPT
 #ifdef ENOTSUP
             && errno != ENOTSUP
@@ -46,124 +409,247 @@ static int send_all(int sockfd, const char *buf, size_t len) {
     }
 #endif
 
-    size_t total = 0;
-    while (total < len) {
+    while (conn->out_sent < conn->out_len) {
         int flags = 0;
 #ifdef MSG_NOSIGNAL
         flags = MSG_NOSIGNAL;
 #endif
-        ssize_t sent = send(sockfd, buf + total, len - total, flags);
+        if (more) {
+            flags |= MSG_MORE;
+        }
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, flags);
         if (sent < 0) {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (errno == EINTR) {
                 continue;
             }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
             return -1;
-        }
-        total += (size_t)sent;
-    }
-
-    return 0;
-}
-
-int send_file(FILE *fp, int sockfd, const char *header) {
-    char data[BUFFER_SIZE];
-    int n;
-
-    if (send_all(sockfd, header, strlen(header)) == -1) {
-        int send_errno = errno;
-        if (send_errno == EPIPE) {
-            log_error("Client disconnected while sending HTTP header");
-        } else {
-            perror("Failed to send HTTP header");
-            log_error("Failed to send HTTP header");
         }
-        errno = send_errno;
-        return -1;
+        conn->out_sent += (size_t)sent;
     }
 
-    while ((n = fread(data, sizeof(char), BUFFER_SIZE, fp)) > 0) {
-        if (send_all(sockfd, data, n) == -1) {
-            int send_errno = errno;
-            if (send_errno == EPIPE) {
-                log_error("Client disconnected while sending file data");
-            } else {
-                perror("Failed to send file");
-                log_error("Failed to send file");
-            }
-            errno = send_errno;
-            return -1;
-        }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
+
+static void log_send_failure(const char *disconnect_message, const char *failure_message) {
+    int send_errno = errno;
+    if (send_errno == EPIPE || send_errno == ECONNRESET) {
+        log_error(disconnect_message);
+    } else {
+        perror(failure_message);
+        log_error(failure_message);
     }
-    return 0;
+    errno = send_errno;
 }
 
-int send_chunked_file(FILE *fp, int sockfd, const char *header) {
-    char data[BUFFER_SIZE];
-    int n;
-
-    if (send_all(sockfd, header, strlen(header)) == -1) {
-        int send_errno = errno;
-        if (send_errno == EPIPE) {
-            log_error("Client disconnected while sending chunked header");
-        } else {
-            perror("Failed to send HTTP header");
-            log_error("Failed to send HTTP header");
-        }
-        errno = send_errno;
+// The kernel refuses zero-copy for this file or socket; use read + send.
+int zero_copy_refused(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+// Copies the next piece of the file into out[] at `offset` for the fallback path.
+static ssize_t read_file_chunk(Connection *conn, size_t offset, size_t room) {
+    size_t want = room;
+    if ((off_t)want > conn->file_remaining) {
+        want = (size_t)conn->file_remaining;
+    }
+    ssize_t n;
+    do {
+        n = pread(conn->file_fd, conn->out + offset, want, conn->file_offset);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        // File shrank underneath us; the promised length can't be met.
+        errno = EIO;
         return -1;
     }
+    if (n > 0) {
+        conn->file_offset += n;
+        conn->file_remaining -= n;
+    }
+    return n;
+}
+
+void close_file(Connection *conn) {
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    conn->file_remaining = 0;
+}
 
-    while ((n = fread(data, sizeof(char), BUFFER_SIZE, fp)) > 0) {
-        char chunk_size[10];
-        snprintf(chunk_size, sizeof(chunk_size), "%x\r\n", n);
-        if (send_all(sockfd, chunk_size, strlen(chunk_size)) == -1) {
-            int send_errno = errno;
-            if (send_errno == EPIPE) {
-                log_error("Client disconnected while sending chunk size");
-            } else {
-                perror("Failed to send chunk size");
-                log_error("Failed to send chunk size");
-            }
-            errno = send_errno;
+/*
+ * Streams the queued output followed by file_remaining bytes of
+ * conn->file_fd from file_offset with sendfile(), dropping to a pread() +
+ * send() copy only if the kernel refuses. Resumable: returns 1 once the
+ * segment is out, 0 when the socket would block and -1 on error.
+ */
+static int send_segment(Connection *conn, int more) {
+    while (1) {
+        int status = send_pending(conn, more || conn->file_remaining > 0);
+        if (status < 0) {
+            log_send_failure("Client disconnected while sending file data", "Failed to send file");
             return -1;
         }
+        if (status == 0) {
+            return 0;
+        }
 
-        if (send_all(sockfd, data, n) == -1) {
-            int send_errno = errno;
-            if (send_errno == EPIPE) {
-                log_error("Client disconnected while sending chunk data");
-            } else {
-                perror("Failed to send chunk data");
-                log_error("Failed to send chunk data");
-            }
-            errno = send_errno;
-            return -1;
+        if (conn->file_remaining == 0) {
+            return 1;
         }
 
-        if (send_all(sockfd, "\r\n", 2) == -1) {
-            int send_errno = errno;
-            if (send_errno == EPIPE) {
-                log_error("Client disconnected before CRLF could be sent");
-            } else {
-                perror("Failed to send CRLF after chunk");
-                log_error("Failed to send CRLF after chunk");
+        if (!conn->copy_fallback) {
+            size_t count = conn->file_remaining > SENDFILE_MAX ? SENDFILE_MAX : (size_t)conn->file_remaining;
+            ssize_t sent = sendfile(conn->fd, conn->file_fd, &conn->file_offset, count);
+            if (sent > 0) {
+                conn->file_remaining -= sent;
+                continue;
+            }
+            if (sent == 0) {
+                log_error("File shrank while being sent");
+                errno = EIO;
+                return -1;
+            }
+            if (errno == EINTR) {
+                continue;
             }
-            errno = send_errno;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (!zero_copy_refused(errno)) {
+                log_send_failure("Client disconnected while sending file data", "Failed to send file");
+                return -1;
+            }
+            conn->copy_fallback = 1;
+        }
+
+        ssize_t n = read_file_chunk(conn, 0, BUFFER_SIZE);
+        if (n < 0) {
+            perror("Failed to read file");
+            log_error("Failed to read file");
             return -1;
         }
+        conn->out_len = (size_t)n;
     }
+}
 
-    if (send_all(sockfd, "0\r\n\r\n", 5) == -1) {
-        int send_errno = errno;
-        if (send_errno == EPIPE) {
-            log_error("Client disconnected before end of chunked data");
-        } else {
-            perror("Failed to send end of chunked data");
-            log_error("Failed to send end of chunked data");
+// Sends a header followed by the file (or the single range of it) queued by
+// the caller, then closes the file.
+int send_file(Connection *conn) {
+    int status = send_segment(conn, 0);
+    if (status == 1) {
+        close_file(conn);
+    }
+    return status;
+}
+
+/*
+ * Sends a multipart/byteranges body: each range goes out with sendfile()
+ * from its own offset, with the next part header queued in out[] between
+ * them. The first part header was queued along with the response header.
+ */
+int send_ranges(Connection *conn) {
+    while (1) {
+        int status = send_segment(conn, conn->range_next <= conn->range_count);
+        if (status != 1) {
+            return status;
+        }
+        if (!queue_next_range_part(conn)) {
+            close_file(conn);
+            conn->range_count = 0;
+            return 1;
         }
-        errno = send_errno;
-        return -1;
     }
+}
 
-    return 0;
+/*
+ * Once a multipart/byteranges part has been sent, queues the next part
+ * header and selects its range, or queues the closing delimiter. Returns 0
+ * when nothing is left, including for responses that are not multipart.
+ */
+int queue_next_range_part(Connection *conn) {
+    if (conn->range_count <= 1 || conn->range_next > conn->range_count) {
+        return 0;
+    }
+    int len = format_range_part(conn->out, BUFFER_SIZE, conn, conn->range_next);
+    conn->out_len = (size_t)len;
+    conn->out_sent = 0;
+    if (conn->range_next < conn->range_count) {
+        conn->file_offset = conn->ranges[conn->range_next].start;
+        conn->file_remaining = conn->ranges[conn->range_next].length;
+    }
+    conn->range_next++;
+    return 1;
+}
+
+/*
+ * Fills `iov` with the unsent rest of a cache hit: the stored header, the
+ * Date line captured when the response was queued, then the body. Returns
+ * the number of entries used (at most three, none once everything is sent).
+ */
+int cached_response_iov(const Connection *conn, struct iovec *iov) {
+    const FileCacheEntry *entry = conn->cached;
+    struct iovec segments[3] = {
+        {(void *)entry->header[conn->keep_alive], entry->header_len[conn->keep_alive]},
+        {(void *)conn->date_line, DATE_LINE_LEN},
+        {entry->body, entry->body_len},
+    };
+    size_t skip = conn->cached_sent;
+    int iovcnt = 0;
+    for (int i = 0; i < 3; i++) {
+        if (skip >= segments[i].iov_len) {
+            skip -= segments[i].iov_len;
+            continue;
+        }
+        iov[iovcnt].iov_base = (char *)segments[i].iov_base + skip;
+        iov[iovcnt].iov_len = segments[i].iov_len - skip;
+        iovcnt++;
+        skip = 0;
+    }
+    return iovcnt;
+}
+
+/*
+ * Sends a file cache hit: header, Date line and body leave together through
+ * one sendmsg() scatter list, resuming from cached_sent after a short write.
+ */
+int send_cached(Connection *conn) {
+    FileCacheEntry *entry = conn->cached;
+    size_t total = entry->header_len[conn->keep_alive] + DATE_LINE_LEN + entry->body_len;
+
+    while (conn->cached_sent < total) {
+        struct iovec iov[3];
+        int iovcnt = cached_response_iov(conn, iov);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        int flags = 0;
+#ifdef MSG_NOSIGNAL
+        flags = MSG_NOSIGNAL;
+#endif
+        ssize_t sent = sendmsg(conn->fd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            log_send_failure("Client disconnected while sending cached file", "Failed to send cached file");
+            return -1;
+        }
+        conn->cached_sent += (size_t)sent;
+    }
+
+    file_cache_release(entry);
+    conn->cached = NULL;
+    conn->cached_sent = 0;
+    return 1;
 }
@@ -0,0 +1,47 @@
+// response.c
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "server.h"
+
+/*
+ * Response header assembly. The http_* formats stop after their last field
+ * line; the header is closed by the Date line and the blank line from
+ * http_date_line(). Formatting a date costs a gmtime_r() and strftime(),
+ * so each thread keeps the line for the current second and reuses it.
+ * Cached files keep their header without a date, and send_cached() puts
+ * the line between header and body in the same sendmsg().
+ */
+
+static __thread time_t date_second = -1;
+static __thread char date_line[DATE_LINE_SIZE];
+
+// "Date: <IMF-fixdate>\r\n\r\n", exactly DATE_LINE_LEN bytes, for the current second.
+const char *http_date_line(void) {
+    time_t now = time(NULL);
+    if (now != date_second) {
+        char date[32];
+        format_http_date(date, sizeof(date), now);
+        snprintf(date_line, sizeof(date_line), "Date: %.29s\r\n\r\n", date);
+        date_second = now;
+    }
+    return date_line;
+}
+
+/*
+ * Fills in one of the http_* header formats and closes it with the Date
+ * line. Returns the header length, or -1 if it does not fit in `size`.
+ */
+int format_response_header(char *buf, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, size, format, args);
+    va_end(args);
+    if (len < 0 || (size_t)len + DATE_LINE_LEN >= size) {
+        return -1;
+    }
+    memcpy(buf + len, http_date_line(), DATE_LINE_LEN + 1);
+    return len + DATE_LINE_LEN;
+}
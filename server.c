@@ -1,334 +1,1414 @@
-// server.c
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <signal.h>
-#include <errno.h>
-#include <sys/time.h>
-#include "server.h"
-
-const char *http_200 = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n\r\n";
-const char *http_400 = "HTTP/1.1 400 BAD REQUEST\r\nContent-Type: text/html\r\n\r\n";
-const char *http_404 = "HTTP/1.1 404 NOT FOUND\r\nContent-Type: text/html\r\n\r\n";
-const char *http_500 = "HTTP/1.1 500 INTERNAL SERVER ERROR\r\nContent-Type: text/html\r\n\r\n";
-const char *http_408 = "HTTP/1.1 408 REQUEST TIMEOUT\r\nContent-Type: text/html\r\n\r\n";
-
-const char *body_400 = "<html><body><h1>400 Bad Request</h1></body></html>";
-const char *body_403 = "<html><body><h1>403 Forbidden</h1></body></html>";
-const char *body_404 = "<html><body><h1>404 Not Found</h1></body></html>";
-const char *body_500 = "<html><body><h1>500 Internal Server Error</h1></body></html>";
-const char *body_408 = "<html><body><h1>408 Request Timeout</h1></body></html>";
-
-ClientQueue client_queue;
-
-static pthread_t *thread_handles = NULL;
-static volatile sig_atomic_t running = 1;
-static int server_fd_global = -1;
-
-static void handle_sigint(int sig) {
-    (void)sig;
-    running = 0;
-    if (server_fd_global != -1) {
-        close(server_fd_global);
-    }
-}
-
-
-int create_server(int port) {
-    int server_fd;
-    struct sockaddr_in address;
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        // socket returns -1 on failure
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    int reuse = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt");
-        log_error("setsockopt(SO_REUSEADDR) failed");
-    }
-
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-
-    return server_fd;
-}
-
-void start_server(Server* config) {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = handle_sigint;
-    sigaction(SIGINT, &sa, NULL);
-
-    struct sigaction sa_pipe;
-    memset(&sa_pipe, 0, sizeof(sa_pipe));
-    sa_pipe.sa_handler = SIG_IGN;
-    if (sigaction(SIGPIPE, &sa_pipe, NULL) != 0) {
-        perror("sigaction(SIGPIPE)");
-        log_error("Failed to ignore SIGPIPE; continuing without SIGPIPE handling");
-    }
-
-    int server_fd = create_server(config->port);
-    server_fd_global = server_fd;
-
-    thread_handles = malloc(sizeof(pthread_t) * config->num_threads);
-    if (thread_handles == NULL) {
-        perror("malloc failed");
-        log_error("Failed to allocate thread handles");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
-
-    client_queue_init(&client_queue);
-
-    for (int i = 0; i < config->num_threads; i++) {
-        int rc = pthread_create(&thread_handles[i], NULL, worker_thread, config);
-        if (rc != 0) {
-            perror("pthread_create");
-            log_error("pthread_create failed");
-            for (int j = 0; j < i; j++) {
-                pthread_cancel(thread_handles[j]);
-                pthread_join(thread_handles[j], NULL);
-            }
-            free(thread_handles);
-            close(server_fd);
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-
-    if (listen(server_fd, 3) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
-
-    // If port was dynamically assigned (e.g., 0), query the bound port
-    socklen_t len = sizeof(address);
-    if (getsockname(server_fd, (struct sockaddr *)&address, &len) == 0) {
-        config->port = ntohs(address.sin_port);
-    }
-    printf("Server listening on port %d\r\n", config->port);
-
-    while (running) {
-        int client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (client_fd < 0) {
-            if (errno == EINTR && !running) {
-                break;
-            }
-            perror("accept");
-            continue;
-        }
-
-        client_queue_push(&client_queue, client_fd);
-    }
-
-    for (int i = 0; i < config->num_threads; i++) {
-        pthread_cancel(thread_handles[i]);
-        pthread_join(thread_handles[i], NULL);
-    }
-    free(thread_handles);
-    close(server_fd);
-}
-
-void handle_connection(int client_fd, const Server *config) {
-    char buffer[BUFFER_SIZE] = {0};
-
-    int bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
-    if (bytes_read < 0) {
-        perror("read");
-        close(client_fd);
-        return;
-    }
-
-    buffer[bytes_read] = '\0';
-
-    if (!is_valid_request(buffer)) {
-        write(client_fd, http_400, strlen(http_400));
-        write(client_fd, body_400, strlen(body_400));
-        close(client_fd);
-        return;
-    }
-
-    char requested_path[BUFFER_SIZE] = {0};
-    if (sscanf(buffer, "GET %2047s", requested_path) != 1) {
-        write(client_fd, http_400, strlen(http_400));
-        write(client_fd, body_400, strlen(body_400));
-        close(client_fd);
-        return;
-    }
-
-    char *query = strchr(requested_path, '?');
-    if (query) {
-        *query = '\0';
-    }
-
-    char *path = requested_path;
-    if (path[0] == '/') {
-        path++;
-    }
-
-    const char *relative_path = (*path == '\0') ? config->file : path;
-    while (*relative_path == '/') {
-        relative_path++;
-    }
-    if (*relative_path == '\0') {
-        relative_path = config->file;
-    }
-
-    size_t docroot_len = strlen(config->docroot);
-    int docroot_has_trailing_slash = docroot_len > 0 && config->docroot[docroot_len - 1] == '/';
-
-    char candidate_path[PATH_MAX];
-    int required_length;
-    if (docroot_has_trailing_slash) {
-        required_length = snprintf(candidate_path, sizeof(candidate_path), "%s%s", config->docroot, relative_path);
-    } else {
-        required_length = snprintf(candidate_path, sizeof(candidate_path), "%s/%s", config->docroot, relative_path);
-    }
-
-    if (required_length < 0 || (size_t)required_length >= sizeof(candidate_path)) {
-        write(client_fd, http_404, strlen(http_404));
-        write(client_fd, body_404, strlen(body_404));
-        close(client_fd);
-        return;
-    }
-
-    char resolved_path[PATH_MAX];
-    if (realpath(candidate_path, resolved_path) == NULL) {
-        int saved_errno = errno;
-        if (saved_errno == ENOENT || saved_errno == ENOTDIR) {
-            write(client_fd, http_404, strlen(http_404));
-            write(client_fd, body_404, strlen(body_404));
-        } else {
-            write(client_fd, http_403, strlen(http_403));
-            write(client_fd, body_403, strlen(body_403));
-        }
-        close(client_fd);
-        return;
-    }
-
-    int docroot_is_root = (docroot_len == 1 && config->docroot[0] == '/');
-    if (strncmp(resolved_path, config->docroot, docroot_len) != 0 ||
-        (!docroot_is_root && resolved_path[docroot_len] != '\0' && resolved_path[docroot_len] != '/')) {
-        write(client_fd, http_403, strlen(http_403));
-        write(client_fd, body_403, strlen(body_403));
-        close(client_fd);
-        return;
-    }
-
-    FILE *fp = fopen(resolved_path, "rb");
-    if (fp == NULL) {
-        if (errno == EACCES) {
-            write(client_fd, http_403, strlen(http_403));
-            write(client_fd, body_403, strlen(body_403));
-        } else {
-            write(client_fd, http_404, strlen(http_404));
-            write(client_fd, body_404, strlen(body_404));
-        }
-        close(client_fd);
-        return;
-    }
-
-    char response_header[512];
-    const char *mime_type = get_mime_type(resolved_path);
-    snprintf(response_header, sizeof(response_header), http_200, mime_type);
-
-    int send_status = send_file(fp, client_fd, response_header);
-    fclose(fp);
-
-        if (send_status < 0) {
-            if (errno == EPIPE) {
-                log_error("Client disconnected before response was fully sent");
-            } else {
-                write(client_fd, http_500, strlen(http_500));
-                write(client_fd, body_500, strlen(body_500));
-                log_error("Failed to send response; sent HTTP 500 to client");
-            }
-        }
-    }
-    close(client_fd);
-}
-
-double get_one_minute_load() {
-    double load[1];
-    if (getloadavg(load, 1) == -1) {
-        perror("Failed to get load average");
-        return -1.0;
-    }
-    return load[0];
-}
-
-double get_one_minute_load_from_server(Server server) {
-    double load = get_one_minute_load();
-    if (load < 0) {
-        return -1.0;
-    }
-    // Normalize load based on server core count
-    return load / server.core_count;
-}
-
-
-ServerPriority determine_priority(double one_min_load, int core_count) {
-    if (one_min_load < 0.5 * core_count) {
-        return HIGH_PRIORITY;
-    } else if (one_min_load < core_count) {
-        return MEDIUM_PRIORITY;
-    } else {
-        return LOW_PRIORITY;
-    }
-}
-
-Server select_server(Server servers[], int num_servers) {
-    Server *high_priority_servers = malloc(sizeof(Server) * num_servers);
-    Server *medium_priority_servers = malloc(sizeof(Server) * num_servers);
-    if (high_priority_servers == NULL || medium_priority_servers == NULL) {
-        log_error("Failed to allocate memory for server selection");
-        free(high_priority_servers);
-        free(medium_priority_servers);
-        return servers[rand() % num_servers];
-    }
-    int high_count = 0;
-    int medium_count = 0;
-
-    for (int i = 0; i < num_servers; i++) {
-        double load = get_one_minute_load_from_server(servers[i]);
-        ServerPriority priority = determine_priority(load, servers[i].core_count);
-        if (priority == HIGH_PRIORITY) {
-            high_priority_servers[high_count++] = servers[i];
-        } else if (priority == MEDIUM_PRIORITY) {
-            medium_priority_servers[medium_count++] = servers[i];
-        }
-    }
-
-    /*
-     * Select a server based on priority and copy it to a local variable
-     * before freeing the priority arrays. This avoids returning a pointer
-     * to freed memory.
-     */
-    Server selected_server;
-    if (high_count > 0) {
-        selected_server = high_priority_servers[rand() % high_count];
-    } else if (medium_count > 0) {
-        selected_server = medium_priority_servers[rand() % medium_count];
-    } else {
-        selected_server = servers[rand() % num_servers];
-    }
-    free(medium_priority_servers);
-    free(high_priority_servers);
-
-    return selected_server;
-}
+// server.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "server.h"
+
+// Header formats end after their last field line; format_response_header()
+// closes them with the Date line. The %s before Connection takes optional
+// extra header lines, each ending in CRLF.
+const char *http_200 = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%sConnection: %s\r\n";
+const char *http_200_streamed = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s%sConnection: %s\r\n";
+const char *http_206 = "HTTP/1.1 206 PARTIAL CONTENT\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n%sConnection: %s\r\n";
+const char *http_206_multipart = "HTTP/1.1 206 PARTIAL CONTENT\r\nContent-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %lld\r\n%sConnection: %s\r\n";
+const char *http_304 = "HTTP/1.1 304 NOT MODIFIED\r\n%s%sConnection: %s\r\n";
+const char *http_400 = "HTTP/1.1 400 BAD REQUEST\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_404 = "HTTP/1.1 404 NOT FOUND\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_500 = "HTTP/1.1 500 INTERNAL SERVER ERROR\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_408 = "HTTP/1.1 408 REQUEST TIMEOUT\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_403 = "HTTP/1.1 403 FORBIDDEN\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_414 = "HTTP/1.1 414 URI TOO LONG\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_429 = "HTTP/1.1 429 TOO MANY REQUESTS\r\nRetry-After: 1\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_503 = "HTTP/1.1 503 SERVICE UNAVAILABLE\r\nRetry-After: 1\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_411 = "HTTP/1.1 411 LENGTH REQUIRED\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_502 = "HTTP/1.1 502 BAD GATEWAY\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_504 = "HTTP/1.1 504 GATEWAY TIMEOUT\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+const char *http_431 = "HTTP/1.1 431 REQUEST HEADER FIELDS TOO LARGE\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: %s\r\n";
+// Filled in with the file size first, leaving a format for queue_response().
+const char *http_416 = "HTTP/1.1 416 RANGE NOT SATISFIABLE\r\nContent-Range: bytes */%lld\r\nContent-Type: text/html\r\nContent-Length: %%zu\r\nConnection: %%s\r\n";
+
+static const char *stats_content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+const char *body_400 = "<html><body><h1>400 Bad Request</h1></body></html>";
+const char *body_403 = "<html><body><h1>403 Forbidden</h1></body></html>";
+const char *body_404 = "<html><body><h1>404 Not Found</h1></body></html>";
+const char *body_500 = "<html><body><h1>500 Internal Server Error</h1></body></html>";
+const char *body_408 = "<html><body><h1>408 Request Timeout</h1></body></html>";
+const char *body_414 = "<html><body><h1>414 URI Too Long</h1></body></html>";
+const char *body_431 = "<html><body><h1>431 Request Header Fields Too Large</h1></body></html>";
+const char *body_416 = "<html><body><h1>416 Range Not Satisfiable</h1></body></html>";
+const char *body_429 = "<html><body><h1>429 Too Many Requests</h1></body></html>";
+const char *body_503 = "<html><body><h1>503 Service Unavailable</h1></body></html>";
+const char *body_411 = "<html><body><h1>411 Length Required</h1></body></html>";
+const char *body_502 = "<html><body><h1>502 Bad Gateway</h1></body></html>";
+const char *body_504 = "<html><body><h1>504 Gateway Timeout</h1></body></html>";
+
+ClientQueue client_queue;
+
+WorkerPool worker_pool;
+
+static Worker *workers = NULL;      // config->max_threads slots
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t stop_now = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+// SIGINT and SIGTERM: the first drains, a second closes everything at once.
+static void handle_sigint(int sig) {
+    (void)sig;
+    if (!running) {
+        stop_now = 1;
+    }
+    running = 0;
+}
+
+static void handle_sigusr2(int sig) {
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+static void handle_sighup(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+
+int create_server(int port, int reuseport) {
+    int server_fd;
+    struct sockaddr_in address;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        // socket returns -1 on failure
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    int reuse = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt");
+        log_error("setsockopt(SO_REUSEADDR) failed");
+    }
+
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (set_nonblocking(server_fd) < 0) {
+        perror("fcntl(O_NONBLOCK)");
+        exit(EXIT_FAILURE);
+    }
+
+    return server_fd;
+}
+
+/*
+ * Takes over a listening socket, either freshly bound or inherited from
+ * the process being upgraded, and makes its port config->port.
+ */
+static int adopt_listener(Server *config, int server_fd) {
+    // If port was dynamically assigned (e.g., 0), query the bound port
+    struct sockaddr_in address;
+    socklen_t len = sizeof(address);
+    if (getsockname(server_fd, (struct sockaddr *)&address, &len) == 0) {
+        config->port = ntohs(address.sin_port);
+    }
+    if (set_nonblocking(server_fd) < 0) {
+        perror("fcntl(O_NONBLOCK)");
+        exit(EXIT_FAILURE);
+    }
+    return server_fd;
+}
+
+/*
+ * Creates, binds and starts a listener on config->port. The first listener
+ * created for port 0 records the kernel's choice so that SO_REUSEPORT
+ * siblings join the same port.
+ */
+static int open_listener(Server *config, int reuseport) {
+    int server_fd = create_server(config->port, reuseport);
+
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return adopt_listener(config, server_fd);
+}
+
+// Maps worker `index` onto the CPUs this process may run on, using at most core_count of them.
+static int pick_cpu(int index, int core_count) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    int available = CPU_COUNT(&allowed);
+    if (available == 0) {
+        return -1;
+    }
+    int spread = core_count < available ? core_count : available;
+    int target = index % spread;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Answers a client admission control turned away with a 503 and closes it,
+ * without ever blocking or registering the socket anywhere. Whatever part of
+ * the request has already arrived is discarded so the close does not turn
+ * into a reset that eats the response.
+ */
+void reject_overloaded(int client_fd) {
+    char buf[BUFFER_SIZE];
+    while (read(client_fd, buf, sizeof(buf)) > 0) {
+        // drain
+    }
+    size_t body_len = strlen(body_503);
+    int len = format_response_header(buf, sizeof(buf), http_503, body_len, "close");
+    if (len > 0 && (size_t)len + body_len <= sizeof(buf)) {
+        memcpy(buf + len, body_503, body_len);
+        if (send(client_fd, buf, (size_t)len + body_len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+            errno != EAGAIN && errno != EPIPE && errno != ECONNRESET) {
+            perror("send(503)");
+        }
+    }
+    shutdown(client_fd, SHUT_WR);
+    close(client_fd);
+}
+
+/*
+ * Hands this process's listeners to a fresh copy of the binary (upgrade.c).
+ * If the new process comes up, this one stops accepting and drains.
+ */
+static void hot_upgrade(Server *config, int server_fd) {
+    upgrade_requested = 0;
+    int fds[UPGRADE_MAX_LISTENERS];
+    int count = 0;
+    if (server_fd >= 0) {
+        fds[count++] = server_fd;
+    }
+    for (int i = 0; config->reuseport && i < config->max_threads && count < UPGRADE_MAX_LISTENERS; i++) {
+        fds[count++] = workers[i].listen_fd;
+    }
+
+    pid_t pid = upgrade_spawn(config->argv, fds, count);
+    if (pid > 0) {
+        printf("Listeners handed to process %d; draining\r\n", (int)pid);
+        fflush(stdout);
+        running = 0;
+    }
+}
+
+// SIGHUP: swap in the bundle file as it is now, e.g. after a fresh --pack.
+static void reload_bundle(const Server *config) {
+    reload_requested = 0;
+    if (config->bundle_path != NULL && bundle_load(config) < 0) {
+        log_error("Failed to reload bundle; still serving the previous one");
+    }
+}
+
+// Accepts on the shared listener and hands each client to the workers.
+static void run_acceptor(Server *config, int server_fd) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = server_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+        perror("epoll_ctl(listener)");
+        exit(EXIT_FAILURE);
+    }
+
+    while (running) {
+        if (upgrade_requested) {
+            hot_upgrade(config, server_fd);
+            continue;
+        }
+        if (reload_requested) {
+            reload_bundle(config);
+            continue;
+        }
+        int n = epoll_wait(epoll_fd, &event, 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        // Drain the backlog; the listener is non-blocking so this stops at EAGAIN.
+        while (running) {
+            int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("accept");
+                }
+                break;
+            }
+
+            // A full queue means workers are far behind; refuse rather
+            // than stall accepting.
+            if (client_queue_try_push(&client_queue, client_fd) < 0) {
+                reject_overloaded(client_fd);
+                stats_add(STAT_SHED_QUEUE_FULL, 1);
+            }
+        }
+    }
+
+    close(epoll_fd);
+}
+
+// Starts the worker in `worker`'s slot; returns 0 or the pthread_create() error.
+static int worker_start(Worker *worker) {
+    worker->command = WORKER_RUN;
+    worker->exited = 0;
+    worker->busy_ns = 0;
+    worker->busy_seen = 0;
+    int rc = pthread_create(&worker->thread, NULL,
+                            worker->config->io_uring ? uring_worker_thread : worker_thread, worker);
+    worker->started = rc == 0;
+    return rc;
+}
+
+// Hands a worker a WorkerCommand and wakes its loop to act on it.
+static void worker_command(Worker *worker, WorkerCommand command) {
+    __atomic_store_n(&worker->command, command, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (worker->wake_fd >= 0 && write(worker->wake_fd, &one, sizeof(one)) < 0) {
+        perror("write(eventfd)");
+    }
+}
+
+static void stop_workers(int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i].started) {
+            worker_command(&workers[i], WORKER_STOP);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].started = 0;
+        }
+    }
+}
+
+/*
+ * Graceful shutdown. Sockets already accepted into client_queue are still
+ * served; then every worker stops accepting, finishes its in-flight
+ * responses and closes keep-alive connections as they go idle. Workers
+ * close whatever is left after drain_timeout_ms, and a second SIGINT or
+ * SIGTERM stops them at once.
+ */
+static void drain_workers(const Server *config) {
+    struct timespec pause = {0, 10 * 1000000L};
+    long long deadline = monotonic_ms() + config->drain_timeout_ms;
+    while (client_queue_depth(&client_queue) > 0 && !stop_now && monotonic_ms() < deadline) {
+        nanosleep(&pause, NULL);
+    }
+
+    for (int i = 0; i < config->max_threads; i++) {
+        if (workers[i].started && workers[i].command == WORKER_RUN) {
+            worker_command(&workers[i], WORKER_RETIRE);
+        }
+    }
+    while (!stop_now) {
+        int draining = 0;
+        for (int i = 0; i < config->max_threads; i++) {
+            draining += workers[i].started && !__atomic_load_n(&workers[i].exited, __ATOMIC_ACQUIRE);
+        }
+        if (draining == 0) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    stop_workers(config->max_threads);
+}
+
+static int worker_active(const Worker *worker) {
+    return worker->started && worker->command == WORKER_RUN &&
+           !__atomic_load_n(&worker->exited, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Resizes the pool between min_threads and max_threads. Every
+ * POOL_INTERVAL_MS it samples the client queue and the busy time of the
+ * active workers. A backlog or high utilisation for POOL_GROW_TICKS samples
+ * in a row adds a worker unless determine_priority() says the machine is
+ * already saturated; low utilisation with an empty queue for
+ * POOL_SHRINK_TICKS samples retires one. Each change restarts both streaks,
+ * which is the hysteresis that keeps the pool from flapping.
+ */
+static void *pool_thread(void *arg) {
+    const Server *config = arg;
+    int grow_streak = 0;
+    int shrink_streak = 0;
+    long long sampled_ns = monotonic_ns();
+    struct timespec interval = {POOL_INTERVAL_MS / 1000, (POOL_INTERVAL_MS % 1000) * 1000000L};
+
+    while (running) {
+        nanosleep(&interval, NULL);
+
+        // Join retired workers so their slots can be reused.
+        for (int i = 0; i < config->max_threads; i++) {
+            if (workers[i].started && __atomic_load_n(&workers[i].exited, __ATOMIC_ACQUIRE)) {
+                pthread_join(workers[i].thread, NULL);
+                workers[i].started = 0;
+            }
+        }
+
+        long long now_ns = monotonic_ns();
+        long long elapsed_ns = now_ns - sampled_ns;
+        sampled_ns = now_ns;
+        int active = 0;
+        int newest = -1;
+        int free_slot = -1;
+        unsigned long long busy_ns = 0;
+        for (int i = 0; i < config->max_threads; i++) {
+            Worker *worker = &workers[i];
+            if (!worker->started) {
+                if (free_slot < 0) {
+                    free_slot = i;
+                }
+                continue;
+            }
+            unsigned long long busy = __atomic_load_n(&worker->busy_ns, __ATOMIC_RELAXED);
+            if (worker_active(worker)) {
+                active++;
+                newest = i;
+                busy_ns += busy - worker->busy_seen;
+            }
+            worker->busy_seen = busy;
+        }
+
+        int utilisation = (active > 0 && elapsed_ns > 0)
+                              ? (int)(busy_ns * 100 / ((unsigned long long)elapsed_ns * (unsigned long long)active))
+                              : 100;
+        size_t depth = client_queue_depth(&client_queue);
+        grow_streak = (depth > 0 || utilisation >= POOL_BUSY_HIGH_PCT) ? grow_streak + 1 : 0;
+        shrink_streak = (depth == 0 && utilisation < POOL_BUSY_LOW_PCT) ? shrink_streak + 1 : 0;
+
+        if (grow_streak >= POOL_GROW_TICKS && active < config->max_threads && free_slot >= 0 &&
+            determine_priority(get_one_minute_load(), config->core_count) != LOW_PRIORITY) {
+            int rc = worker_start(&workers[free_slot]);
+            if (rc == 0) {
+                active++;
+                __atomic_add_fetch(&worker_pool.grown, 1, __ATOMIC_RELAXED);
+            } else {
+                errno = rc;
+                perror("pthread_create");
+                log_error("Failed to add a worker to the pool");
+            }
+            grow_streak = shrink_streak = 0;
+        } else if (shrink_streak >= POOL_SHRINK_TICKS && active > config->min_threads && newest >= 0) {
+            worker_command(&workers[newest], WORKER_RETIRE);
+            active--;
+            __atomic_add_fetch(&worker_pool.shrunk, 1, __ATOMIC_RELAXED);
+            grow_streak = shrink_streak = 0;
+        }
+
+        __atomic_store_n(&worker_pool.size, active, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker_pool.utilisation_pct, utilisation, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void start_server(Server* config) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_handler = handle_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+
+    struct sigaction sa_pipe;
+    memset(&sa_pipe, 0, sizeof(sa_pipe));
+    sa_pipe.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa_pipe, NULL) != 0) {
+        perror("sigaction(SIGPIPE)");
+        log_error("Failed to ignore SIGPIPE; continuing without SIGPIPE handling");
+    }
+
+    log_init();
+    if (config->mime_types != NULL && load_mime_types(config->mime_types) < 0) {
+        perror(config->mime_types);
+        log_error("Failed to load MIME types");
+        exit(EXIT_FAILURE);
+    }
+    if (config->bundle_path != NULL) {
+        if (bundle_load(config) < 0) {
+            log_error("Failed to load bundle");
+            exit(EXIT_FAILURE);
+        }
+        // Nothing is read from the docroot, so there is nothing to cache or watch.
+        config->cache_size = 0;
+    }
+    client_queue_init(&client_queue);
+    file_cache_init(config);
+    admission_init(config);
+    proxy_init(config);
+
+    if (config->io_uring && !uring_available()) {
+        log_error("io_uring is not available on this kernel; using epoll workers");
+        config->io_uring = 0;
+    }
+    if (config->io_uring && config->upstream_count > 0) {
+        log_error("Proxy mode runs on epoll workers; ignoring --io-uring");
+        config->io_uring = 0;
+    }
+
+    // Only queue-fed workers can be added and retired: a sharded listener
+    // would drop its backlog when closed, and io_uring workers each own a
+    // multishot accept on the shared one.
+    if ((config->reuseport || config->io_uring) && config->min_threads != config->max_threads) {
+        log_error("Worker pool is fixed at num_threads with --reuseport or --io-uring");
+        config->min_threads = config->max_threads = config->num_threads;
+    }
+    worker_pool.min_threads = config->min_threads;
+    worker_pool.max_threads = config->max_threads;
+    worker_pool.size = config->num_threads;
+
+    workers = calloc((size_t)config->max_threads, sizeof(Worker));
+    if (workers == NULL) {
+        perror("malloc failed");
+        log_error("Failed to allocate thread handles");
+        exit(EXIT_FAILURE);
+    }
+
+    // Sharded mode: one SO_REUSEPORT listener per worker, so the kernel
+    // spreads connections across workers and nothing crosses threads.
+    // Otherwise a single listener feeds every worker through client_queue,
+    // or with io_uring every worker accepts from it directly.
+    // After a hot upgrade the listeners come from the old process instead.
+    int inherited[UPGRADE_MAX_LISTENERS];
+    int inherited_count = upgrade_inherit(inherited, UPGRADE_MAX_LISTENERS);
+    if (inherited_count < 0) {
+        log_error("Failed to take over listeners from the upgraded process");
+        exit(EXIT_FAILURE);
+    }
+    int adopted = 0;
+
+    int server_fd = -1;
+    for (int i = 0; i < config->max_threads; i++) {
+        workers[i].config = config;
+        workers[i].listen_fd = -1;
+        workers[i].cpu = -1;
+        workers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers[i].wake_fd < 0) {
+            perror("eventfd");
+            log_error("Failed to create worker wake eventfd");
+            exit(EXIT_FAILURE);
+        }
+        if (config->reuseport) {
+            workers[i].listen_fd = adopted < inherited_count ? adopt_listener(config, inherited[adopted++])
+                                                             : open_listener(config, 1);
+            workers[i].cpu = pick_cpu(i, config->core_count);
+        }
+    }
+    if (!config->reuseport) {
+        server_fd = adopted < inherited_count ? adopt_listener(config, inherited[adopted++])
+                                              : open_listener(config, 0);
+        for (int i = 0; config->io_uring && i < config->max_threads; i++) {
+            workers[i].listen_fd = server_fd;
+        }
+    }
+    if (adopted < inherited_count) {
+        // The old process ran with more listeners than this configuration
+        // uses; their backlogs are lost.
+        log_error("Closing listeners left over from the upgraded process");
+        while (adopted < inherited_count) {
+            close(inherited[adopted++]);
+        }
+    }
+    printf("Server listening on port %d\r\n", config->port);
+    fflush(stdout);
+
+    // Workers and the pool thread inherit this mask, so SIGINT always
+    // interrupts the main thread's wait below rather than landing in an
+    // event loop.
+    sigset_t block_set, old_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGUSR2);
+    sigaddset(&block_set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
+    for (int i = 0; i < config->num_threads; i++) {
+        int rc = worker_start(&workers[i]);
+        if (rc != 0) {
+            errno = rc;
+            perror("pthread_create");
+            log_error("pthread_create failed");
+            stop_workers(i);
+            free(workers);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_t pool;
+    int pool_running = 0;
+    if (config->min_threads < config->max_threads) {
+        int rc = pthread_create(&pool, NULL, pool_thread, config);
+        if (rc != 0) {
+            errno = rc;
+            perror("pthread_create");
+            log_error("Failed to start the pool thread; keeping num_threads workers");
+        }
+        pool_running = rc == 0;
+    }
+
+    upgrade_ready();
+
+    if (config->reuseport || config->io_uring) {
+        // Nothing left to do here but wait for signals.
+        while (running) {
+            sigsuspend(&old_set);
+            if (upgrade_requested) {
+                hot_upgrade(config, server_fd);
+            }
+            if (reload_requested) {
+                reload_bundle(config);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    } else {
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+        run_acceptor(config, server_fd);
+    }
+
+    if (pool_running) {
+        pthread_join(pool, NULL);
+    }
+    drain_workers(config);
+    for (int i = 0; i < config->max_threads; i++) {
+        if (config->reuseport) {
+            close(workers[i].listen_fd);
+        }
+        close(workers[i].wake_fd);
+    }
+    if (server_fd >= 0) {
+        close(server_fd);
+    }
+    free(workers);
+    log_shutdown();
+}
+
+static const char *connection_token(const Connection *conn) {
+    return conn->keep_alive ? "keep-alive" : "close";
+}
+
+// Queues one of the http_4xx/5xx header formats together with its body.
+void queue_response(Connection *conn, const char *header_format, const char *body) {
+    size_t body_len = strlen(body);
+    int header_len = format_response_header(conn->out, BUFFER_SIZE, header_format, body_len,
+                                            connection_token(conn));
+    if (header_len < 0 || (size_t)header_len + body_len > BUFFER_SIZE) {
+        conn->keep_alive = 0;
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        conn->state = CONN_WRITING;
+        return;
+    }
+    memcpy(conn->out + header_len, body, body_len);
+    conn->out_len = (size_t)header_len + body_len;
+    conn->out_sent = 0;
+    conn->state = CONN_WRITING;
+    conn->status = atoi(header_format + 9);
+    conn->response_bytes = (long long)conn->out_len;
+}
+
+// Queues a finished exchange for connect.log; the line is written by the log thread.
+static void log_access(const Connection *conn) {
+    size_t scan = conn->request_len ? conn->request_len : conn->in_len;
+    const char *line_end = memchr(conn->in, '\r', scan);
+    int line_len = line_end ? (int)(line_end - conn->in) : (int)scan;
+    if (line_len > 160) {
+        line_len = 160;
+    }
+
+    char message[256];
+    snprintf(message, sizeof(message), "%s \"%.*s\" %d %lld",
+             conn->client_ip[0] ? conn->client_ip : "-", line_len, conn->in,
+             conn->status, conn->response_bytes);
+    log_connection(message);
+}
+
+// Runs the parser over whatever has arrived; 1 once it has a verdict.
+static int parse_buffered(Connection *conn, const Server *config) {
+    if (conn->in_len == 0) {
+        return 0;
+    }
+    HttpParseStatus status = http_parse_request(&conn->request, conn->in, conn->in_len,
+                                                config->max_request_line_size);
+    if (status == HTTP_PARSE_DONE) {
+        conn->request_len = conn->request.length;
+    }
+    return status != HTTP_PARSE_INCOMPLETE;
+}
+
+/*
+ * Checks whether conn->in holds a complete header block or enough to reject
+ * it. Returns 1 when prepare_response() can run and 0 when more bytes are
+ * needed; a full buffer without a blank line is a 414 or 431.
+ */
+int request_buffered(Connection *conn, const Server *config) {
+    if (parse_buffered(conn, config)) {
+        return 1;
+    }
+    if (conn->in_len < BUFFER_SIZE - 1) {
+        return 0;
+    }
+    conn->request.status = (conn->request.phase == HTTP_PHASE_REQUEST_LINE)
+                               ? HTTP_PARSE_LINE_TOO_LONG
+                               : HTTP_PARSE_HEADERS_TOO_LARGE;
+    return 1;
+}
+
+/*
+ * Reads into the connection buffer until the parser has a complete header
+ * block or an error. Pipelined requests left over from the previous response
+ * are parsed before touching the socket. Returns 1 when a request is ready,
+ * 0 when the socket would block and -1 when the connection should be dropped.
+ */
+static int read_request(Connection *conn, const Server *config) {
+    if (request_buffered(conn, config)) {
+        return 1;
+    }
+
+    while (conn->in_len < BUFFER_SIZE - 1) {
+        ssize_t bytes_read = read(conn->fd, conn->in + conn->in_len, BUFFER_SIZE - 1 - conn->in_len);
+        if (bytes_read > 0) {
+            if (conn->in_len == 0) {
+                conn->request_started_ms = conn->last_active_ms;
+                conn->request_started_ns = monotonic_ns();
+            }
+            conn->in_len += (size_t)bytes_read;
+            conn->in[conn->in_len] = '\0';
+            if (parse_buffered(conn, config)) {
+                return 1;
+            }
+            continue;
+        }
+        if (bytes_read == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != ECONNRESET) {
+            perror("read");
+        }
+        return -1;
+    }
+
+    return request_buffered(conn, config);
+}
+
+// Hands a cache entry (and the caller's reference to it) to the connection.
+static void serve_cached(Connection *conn, FileCacheEntry *entry) {
+    conn->cached = entry;
+    conn->cached_sent = 0;
+    memcpy(conn->date_line, http_date_line(), DATE_LINE_SIZE);
+    conn->state = CONN_WRITING;
+    conn->status = 200;
+    conn->response_bytes = (long long)(entry->header_len[conn->keep_alive] + DATE_LINE_LEN + entry->body_len);
+}
+
+// ETag, Last-Modified and Cache-Control lines describing one file version.
+static int format_validators(char *buf, size_t size, const char *etag, time_t mtime, const Server *config) {
+    char date[40];
+    format_http_date(date, sizeof(date), mtime);
+    return snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: %s\r\n",
+                    etag, date, config->cache_control);
+}
+
+// Queues a header-only 304 for a representation the client already holds.
+static void queue_not_modified(Connection *conn, const char *etag, time_t mtime, int vary, const Server *config) {
+    char validators[256];
+    format_validators(validators, sizeof(validators), etag, mtime, config);
+    int header_len = format_response_header(conn->out, BUFFER_SIZE, http_304, validators,
+                                            vary ? vary_header : "", connection_token(conn));
+    conn->out_len = header_len > 0 ? (size_t)header_len : 0;
+    conn->out_sent = 0;
+    conn->state = CONN_WRITING;
+    conn->status = 304;
+    conn->response_bytes = (long long)conn->out_len;
+}
+
+/*
+ * Moves a file body that fits behind the header in out[] into the buffer,
+ * so small responses leave in a single send(). Larger bodies keep streaming
+ * from the file with MSG_MORE on the header.
+ */
+static void inline_small_body(Connection *conn) {
+    size_t room = BUFFER_SIZE - conn->out_len;
+    if (conn->file_remaining <= 0 || (size_t)conn->file_remaining > room) {
+        return;
+    }
+    size_t want = (size_t)conn->file_remaining;
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(conn->file_fd, conn->out + conn->out_len + got, want - got,
+                          conn->file_offset + (off_t)got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;     // leave it to send_file(), which reports the error
+        }
+        got += (size_t)n;
+    }
+    conn->out_len += want;
+    conn->file_offset += (off_t)want;
+    conn->file_remaining = 0;
+    close_file(conn);
+}
+
+// Queues a 200 header and streams the body from an open file, which the
+// connection now owns.
+static void serve_fd(Connection *conn, int file_fd, const struct stat *st,
+                     const char *mime_type, const char *extra_headers) {
+    int header_len = format_response_header(conn->out, BUFFER_SIZE, http_200, mime_type,
+                                            (long long)st->st_size, extra_headers, connection_token(conn));
+    if (header_len < 0) {
+        close(file_fd);
+        queue_response(conn, http_500, body_500);
+        return;
+    }
+    conn->out_len = (size_t)header_len;
+    conn->out_sent = 0;
+    conn->file_fd = file_fd;
+    conn->file_offset = 0;
+    conn->file_remaining = st->st_size;
+    conn->state = CONN_WRITING;
+    conn->status = 200;
+    conn->response_bytes = (long long)header_len + (long long)st->st_size;
+    inline_small_body(conn);
+}
+
+// Queues a 416 for a Range none of whose ranges overlap the file.
+static void queue_range_not_satisfiable(Connection *conn, off_t size) {
+    char header_format[256];
+    snprintf(header_format, sizeof(header_format), http_416, (long long)size);
+    queue_response(conn, header_format, body_416);
+}
+
+/*
+ * Queues a 206 for the `count` ranges parsed into conn->ranges and takes
+ * ownership of the open file. One range is a plain body sent from its
+ * offset; several become a multipart/byteranges body whose length is
+ * measured up front so the connection can stay open.
+ */
+static void serve_ranges(Connection *conn, int file_fd, const struct stat *st, const char *mime_type,
+                         const char *extra_headers, int count) {
+    int header_len;
+    long long body_len;
+    if (count == 1) {
+        const HttpRange *range = &conn->ranges[0];
+        body_len = (long long)range->length;
+        header_len = format_response_header(conn->out, BUFFER_SIZE, http_206, mime_type,
+                                            (long long)range->start, (long long)(range->start + range->length - 1),
+                                            (long long)st->st_size, body_len, extra_headers, connection_token(conn));
+    } else {
+        conn->range_count = count;
+        conn->range_mime = mime_type;
+        conn->range_total = st->st_size;
+        body_len = 0;
+        for (int i = 0; i <= count; i++) {
+            body_len += format_range_part(NULL, 0, conn, i);
+            if (i < count) {
+                body_len += (long long)conn->ranges[i].length;
+            }
+        }
+        header_len = format_response_header(conn->out, BUFFER_SIZE, http_206_multipart, range_boundary(),
+                                            body_len, extra_headers, connection_token(conn));
+        conn->range_next = 1;
+    }
+    // The first part header rides in out[] behind the response header.
+    int part_len = 0;
+    if (header_len > 0 && (size_t)header_len < BUFFER_SIZE && count > 1) {
+        part_len = format_range_part(conn->out + header_len, BUFFER_SIZE - (size_t)header_len, conn, 0);
+    }
+    if (header_len < 0 || (size_t)(header_len + part_len) >= BUFFER_SIZE) {
+        close(file_fd);
+        conn->range_count = 0;
+        queue_response(conn, http_500, body_500);
+        return;
+    }
+
+    conn->out_len = (size_t)(header_len + part_len);
+    conn->out_sent = 0;
+    conn->file_fd = file_fd;
+    conn->file_offset = conn->ranges[0].start;
+    conn->file_remaining = conn->ranges[0].length;
+    conn->state = CONN_WRITING;
+    conn->status = 206;
+    conn->response_bytes = (long long)header_len + body_len;
+    if (count == 1) {
+        inline_small_body(conn);
+    }
+}
+
+/*
+ * Returns the ENCODING_* flags of the precompressed siblings of `path`
+ * (foo.js.gz, foo.js.br, ...). A sidecar older than the file it was made
+ * from is ignored so an edited asset is never shadowed by a stale copy.
+ */
+static int sidecar_encodings(const char *path, const struct stat *source) {
+    int encodings = 0;
+    for (const ContentCoding *coding = content_codings; coding->flag != 0; coding++) {
+        char sidecar[PATH_MAX];
+        struct stat st;
+        if (snprintf(sidecar, sizeof(sidecar), "%s%s", path, coding->suffix) < (int)sizeof(sidecar) &&
+            lstat(sidecar, &st) == 0 && S_ISREG(st.st_mode) &&
+            (st.st_mtim.tv_sec > source->st_mtim.tv_sec ||
+             (st.st_mtim.tv_sec == source->st_mtim.tv_sec && st.st_mtim.tv_nsec >= source->st_mtim.tv_nsec))) {
+            encodings |= coding->flag;
+        }
+    }
+    return encodings;
+}
+
+/*
+ * Maps a docroot-joined request path to a file inside the docroot, through
+ * the path cache or, on a miss, realpath() and the containment check. For
+ * compressible types the sidecar probe is done here too, so a hit costs no
+ * file syscalls at all. Returns target->error: 0, ENOENT or EACCES.
+ */
+static int resolve_target(const Server *config, const char *candidate_path, ResolvedPath *target) {
+    if (path_cache_lookup(candidate_path, target)) {
+        return target->error;
+    }
+
+    unsigned long generation = file_cache_generation();
+    target->error = 0;
+    target->encodings = 0;
+    if (realpath(candidate_path, target->resolved) == NULL) {
+        target->error = (errno == ENOENT || errno == ENOTDIR) ? ENOENT : EACCES;
+        target->resolved[0] = '\0';
+    } else {
+        size_t docroot_len = strlen(config->docroot);
+        int docroot_is_root = (docroot_len == 1 && config->docroot[0] == '/');
+        struct stat st;
+        if (strncmp(target->resolved, config->docroot, docroot_len) != 0 ||
+            (!docroot_is_root && target->resolved[docroot_len] != '\0' && target->resolved[docroot_len] != '/')) {
+            target->error = EACCES;
+        } else if (is_compressible_type(get_mime_type(target->resolved)) && stat(target->resolved, &st) == 0) {
+            target->encodings = sidecar_encodings(target->resolved, &st);
+        }
+    }
+
+    path_cache_store(candidate_path, target, generation);
+    return target->error;
+}
+
+/*
+ * Serves the file at `path`, either a resource or one of its sidecars.
+ * `entry` is a cache reference the caller already holds for path, or NULL;
+ * it is consumed. A matching conditional request is answered with a 304
+ * built from the cache entry or from lstat() alone, so the file is never
+ * opened; a Range request bypasses the cache and gets a 206 or 416.
+ * Returns 0 with nothing queued (and errno set) if the file cannot
+ * be served.
+ */
+static int serve_path(Connection *conn, const Server *config, const char *path, FileCacheEntry *entry,
+                      const char *mime_type, const char *coding_headers, int vary, int encodings) {
+    const HttpSlice *range = http_find_header(&conn->request, "Range");
+    if (entry == NULL) {
+        entry = file_cache_lookup(path);
+    }
+    if (entry != NULL) {
+        if (request_not_modified(&conn->request, entry->etag, entry->mtime)) {
+            queue_not_modified(conn, entry->etag, entry->mtime, vary, config);
+            file_cache_release(entry);
+            return 1;
+        }
+        if (range == NULL) {
+            serve_cached(conn, entry);
+            return 1;
+        }
+        // Ranges are sent from the file itself, at their own offsets.
+        file_cache_release(entry);
+    }
+
+    // Taken before the file is opened, so a rename over it from here on
+    // keeps what this request reads out of the cache.
+    unsigned long generation = file_cache_generation();
+
+    // Paths reaching here are realpath() results or sidecars next to one;
+    // sidecar symlinks were never checked against the docroot, so refuse them.
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENOENT;
+        return 0;
+    }
+    char etag[ETAG_SIZE];
+    format_etag(etag, sizeof(etag), &st);
+    // Empty-looking files are checked once opened, when it is known whether
+    // they are empty.
+    if (st.st_size > 0 && request_not_modified(&conn->request, etag, st.st_mtime)) {
+        queue_not_modified(conn, etag, st.st_mtime, vary, config);
+        return 1;
+    }
+
+    int file_fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (file_fd < 0) {
+        return 0;
+    }
+    if (fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(file_fd);
+        errno = ENOENT;
+        return 0;
+    }
+    format_etag(etag, sizeof(etag), &st);
+
+    // A file that reports no size may still have content: procfs, sysfs and
+    // some FUSE files leave st_size at 0. One byte read tells the two apart.
+    // Contents whose length is known only once read go out chunked, without
+    // the validators and ranges they cannot honour; a file that really is
+    // empty is served like any other.
+    if (st.st_size == 0) {
+        char probe;
+        ssize_t got = pread(file_fd, &probe, 1, 0);
+        if (got < 0) {
+            int saved = errno;
+            close(file_fd);
+            errno = saved;
+            return 0;
+        }
+        if (got > 0) {
+            if (stream_file(conn, file_fd, mime_type, coding_headers) < 0) {
+                queue_response(conn, http_500, body_500);
+            }
+            return 1;
+        }
+        if (request_not_modified(&conn->request, etag, st.st_mtime)) {
+            close(file_fd);
+            queue_not_modified(conn, etag, st.st_mtime, vary, config);
+            return 1;
+        }
+    }
+
+    char extra_headers[512];
+    int n = format_validators(extra_headers, sizeof(extra_headers), etag, st.st_mtime, config);
+    snprintf(extra_headers + n, sizeof(extra_headers) - (size_t)n, "Accept-Ranges: bytes\r\n%s", coding_headers);
+
+    if (range != NULL && range_applies(&conn->request, etag, st.st_mtime)) {
+        int count = parse_byte_ranges(range, st.st_size, conn->ranges, MAX_RANGES);
+        if (count < 0) {
+            close(file_fd);
+            queue_range_not_satisfiable(conn, st.st_size);
+            return 1;
+        }
+        if (count > 0) {
+            serve_ranges(conn, file_fd, &st, mime_type, extra_headers, count);
+            return 1;
+        }
+    }
+
+    entry = file_cache_insert(path, file_fd, &st, mime_type, extra_headers, encodings, generation);
+    if (entry != NULL) {
+        close(file_fd);
+        serve_cached(conn, entry);
+        return 1;
+    }
+    serve_fd(conn, file_fd, &st, mime_type, extra_headers);
+    return 1;
+}
+
+// Answers the stats path with the merged counters, sent like a cache hit.
+static void serve_stats(Connection *conn, const Server *config) {
+    size_t body_len;
+    char *body = stats_render(config, &body_len);
+    FileCacheEntry *entry = body ? file_cache_detached(body, body_len, stats_content_type, "Cache-Control: no-store\r\n")
+                                 : NULL;
+    if (entry == NULL) {
+        log_error("Failed to render stats");
+        queue_response(conn, http_500, body_500);
+        return;
+    }
+    serve_cached(conn, entry);
+}
+
+/*
+ * Answers from the bundle: a 304 or the packed response, sent like a cache
+ * hit. Ranges are not served from bundles; a Range request gets the whole
+ * file, which RFC 9110 allows.
+ */
+static void serve_bundle(Connection *conn, const Server *config, const char *relative_path) {
+    FileCacheEntry *entry = bundle_lookup(relative_path, &conn->request);
+    if (entry == NULL) {
+        queue_response(conn, http_404, body_404);
+        return;
+    }
+    if (request_not_modified(&conn->request, entry->etag, entry->mtime)) {
+        queue_not_modified(conn, entry->etag, entry->mtime, entry->encodings != 0, config);
+        file_cache_release(entry);
+        return;
+    }
+    serve_cached(conn, entry);
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+// Decodes the %XX escapes of a request path in place; -1 for a malformed escape or an encoded NUL.
+static int percent_decode(char *path) {
+    char *out = path;
+    for (const char *p = path; *p != '\0'; p++) {
+        if (*p != '%') {
+            *out++ = *p;
+            continue;
+        }
+        int high = hex_digit(p[1]);
+        int low = high < 0 ? -1 : hex_digit(p[2]);
+        if (low < 0 || (high == 0 && low == 0)) {
+            return -1;
+        }
+        *out++ = (char)(high << 4 | low);
+        p += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
+// Turns the buffered request into a queued response and an open file.
+static void route_request(Connection *conn, const Server *config) {
+    const HttpRequest *request = &conn->request;
+
+    // A rejected request leaves the stream position unknown, so errors close.
+    conn->requests_served++;
+    conn->keep_alive = 0;
+    switch (request->status) {
+    case HTTP_PARSE_DONE:
+        break;
+    case HTTP_PARSE_LINE_TOO_LONG:
+        queue_response(conn, http_414, body_414);
+        return;
+    case HTTP_PARSE_HEADERS_TOO_LARGE:
+        queue_response(conn, http_431, body_431);
+        return;
+    default:
+        queue_response(conn, http_400, body_400);
+        return;
+    }
+
+    // Proxy mode forwards any method; files are only served to GET.
+    int proxied = config->upstream_count > 0;
+    if ((!proxied && !http_slice_equals(request->method, "GET")) || request->minor_version > 1) {
+        queue_response(conn, http_400, body_400);
+        return;
+    }
+
+    // Targets name files on disk; refuse byte strings that are not UTF-8.
+    HttpSlice target = request->target;
+    if (validate_utf8(target.ptr, (unsigned)target.len) != (int)target.len) {
+        queue_response(conn, http_400, body_400);
+        return;
+    }
+
+    const char *query = memchr(target.ptr, '?', target.len);
+    if (query) {
+        target.len = (size_t)(query - target.ptr);
+    }
+
+    // Only the proxy reads request bodies. Any other request with one is
+    // refused and the connection closed, or the body would be parsed as
+    // the next request.
+    int has_body = request->transfer_encoding || request->content_length > 0;
+    int stats = config->stats_path != NULL && http_slice_equals(target, config->stats_path);
+    if (has_body && (stats || !proxied)) {
+        queue_response(conn, http_400, body_400);
+        return;
+    }
+
+    conn->keep_alive = wants_keep_alive(request) && !conn->last_request &&
+                       conn->requests_served < config->keepalive_max_requests;
+
+    if (!client_rate_allows(conn->client_key)) {
+        stats_add(STAT_RATE_LIMITED, 1);
+        conn->keep_alive = conn->keep_alive && !has_body;
+        queue_response(conn, http_429, body_429);
+        return;
+    }
+
+    if (stats) {
+        serve_stats(conn, config);
+        return;
+    }
+
+    if (proxied) {
+        int status = proxy_request(conn);
+        if (status != 0) {
+            conn->keep_alive = 0;
+        }
+        if (status == 400) {
+            queue_response(conn, http_400, body_400);
+        } else if (status == 411) {
+            queue_response(conn, http_411, body_411);
+        } else if (status == 500) {
+            queue_response(conn, http_500, body_500);
+        } else if (status != 0) {
+            queue_response(conn, http_502, body_502);
+        }
+        return;
+    }
+
+    // The receive buffer bounds the target, so it always fits.
+    char requested_path[BUFFER_SIZE];
+    memcpy(requested_path, target.ptr, target.len);
+    requested_path[target.len] = '\0';
+    if (percent_decode(requested_path) < 0 ||
+        validate_utf8(requested_path, (unsigned)strlen(requested_path)) != (int)strlen(requested_path)) {
+        queue_response(conn, http_400, body_400);
+        return;
+    }
+
+    char *path = requested_path;
+    if (path[0] == '/') {
+        path++;
+    }
+
+    const char *relative_path = (*path == '\0') ? config->file : path;
+    while (*relative_path == '/') {
+        relative_path++;
+    }
+    if (*relative_path == '\0') {
+        relative_path = config->file;
+    }
+
+    if (config->bundle_path != NULL) {
+        serve_bundle(conn, config, relative_path);
+        return;
+    }
+
+    size_t docroot_len = strlen(config->docroot);
+    int docroot_has_trailing_slash = docroot_len > 0 && config->docroot[docroot_len - 1] == '/';
+
+    char candidate_path[PATH_MAX];
+    int required_length;
+    if (docroot_has_trailing_slash) {
+        required_length = snprintf(candidate_path, sizeof(candidate_path), "%s%s", config->docroot, relative_path);
+    } else {
+        required_length = snprintf(candidate_path, sizeof(candidate_path), "%s/%s", config->docroot, relative_path);
+    }
+
+    if (required_length < 0 || (size_t)required_length >= sizeof(candidate_path)) {
+        queue_response(conn, http_404, body_404);
+        return;
+    }
+
+    ResolvedPath file;
+    if (resolve_target(config, candidate_path, &file) != 0) {
+        if (file.error == ENOENT) {
+            queue_response(conn, http_404, body_404);
+        } else {
+            queue_response(conn, http_403, body_403);
+        }
+        return;
+    }
+    const char *resolved_path = file.resolved;
+
+    FileCacheEntry *entry = file_cache_lookup(resolved_path);
+    if (entry == NULL && config->autoindex && serve_listing(conn, resolved_path, requested_path)) {
+        return;
+    }
+    const char *mime_type = get_mime_type(resolved_path);
+    int encodings = file.encodings;
+
+    // Prefer a precompressed sidecar the client accepts; fall back to the
+    // original bytes if it has vanished since it was probed.
+    int accepted = encodings ? accepted_encodings(request) : 0;
+    for (const ContentCoding *coding = content_codings; coding->flag != 0; coding++) {
+        char sidecar[PATH_MAX];
+        if ((accepted & encodings & coding->flag) &&
+            snprintf(sidecar, sizeof(sidecar), "%s%s", resolved_path, coding->suffix) < (int)sizeof(sidecar) &&
+            serve_path(conn, config, sidecar, NULL, mime_type, coding->headers, 1, 0)) {
+            if (entry != NULL) {
+                file_cache_release(entry);
+            }
+            return;
+        }
+    }
+
+    if (!serve_path(conn, config, resolved_path, entry, mime_type,
+                    encodings ? vary_header : "", encodings != 0, encodings)) {
+        if (errno == EACCES) {
+            queue_response(conn, http_403, body_403);
+        } else {
+            queue_response(conn, http_404, body_404);
+        }
+    }
+}
+
+// Routes the request and times its parse and resolve stages for the stats.
+void prepare_response(Connection *conn, const Server *config) {
+    long long parsed_ns = monotonic_ns();
+    if (conn->request_started_ns > 0) {
+        stats_record(STAGE_PARSE, parsed_ns - conn->request_started_ns);
+    }
+    route_request(conn, config);
+    conn->response_started_ns = monotonic_ns();
+    stats_record(STAGE_RESOLVE, conn->response_started_ns - parsed_ns);
+}
+
+/*
+ * Advances the connection's state machine as far as its non-blocking socket
+ * allows. Called by the owning event loop on every readiness notification;
+ * leaves conn->state at CONN_CLOSED once the caller should release it.
+ */
+void handle_connection(Connection *conn, const Server *config) {
+    while (conn->state != CONN_CLOSED) {
+        if (conn->state == CONN_READING) {
+            int status = read_request(conn, config);
+            if (status == 0) {
+                return;
+            }
+            if (status < 0) {
+                conn->state = CONN_CLOSED;
+                return;
+            }
+            prepare_response(conn, config);
+        }
+
+        int send_status;
+        if (conn->cached != NULL) {
+            send_status = send_cached(conn);
+        } else if (conn->proxy != NULL && conn->proxy->fd >= 0) {
+            send_status = proxy_exchange(conn);
+        } else if (conn->range_count > 1) {
+            send_status = send_ranges(conn);
+        } else if (conn->stream != NULL) {
+            send_status = send_stream(conn);
+        } else {
+            send_status = send_file(conn);
+        }
+        if (send_status == 0) {
+            return;
+        }
+        if (send_status < 0) {
+            if (errno != EPIPE && errno != ECONNRESET) {
+                log_error("Failed to send response");
+            }
+            conn->state = CONN_CLOSED;
+            return;
+        }
+        if (!finish_response(conn, config)) {
+            conn->state = CONN_CLOSED;
+            return;
+        }
+    }
+}
+
+/*
+ * Wraps up a response that has been sent in full: logs it and, when the
+ * connection persists, shifts any pipelined bytes to the front for the next
+ * request. Returns 0 if the connection should be closed instead.
+ */
+int finish_response(Connection *conn, const Server *config) {
+    long long now_ns = monotonic_ns();
+    stats_record(STAGE_SEND, now_ns - conn->response_started_ns);
+    stats_count_response(conn->status);
+    stats_add(STAT_BYTES_SENT, (unsigned long long)conn->response_bytes);
+    if (config->access_log) {
+        log_access(conn);
+    }
+    if (!conn->keep_alive) {
+        return 0;
+    }
+
+    conn->in_len -= conn->request_len;
+    memmove(conn->in, conn->in + conn->request_len, conn->in_len);
+    conn->in[conn->in_len] = '\0';
+    conn->request_len = 0;
+    http_request_reset(&conn->request);
+    conn->request_started_ms = conn->last_active_ms;
+    conn->request_started_ns = now_ns;
+    conn->state = CONN_READING;
+    return 1;
+}
+
+// Queues the 408 for a request that has not fully arrived within request_timeout_ms.
+void prepare_timeout_response(Connection *conn) {
+    conn->keep_alive = 0;
+    conn->request_len = 0;
+    queue_response(conn, http_408, body_408);
+    conn->response_started_ns = monotonic_ns();
+}
+
+void handle_request_timeout(Connection *conn, const Server *config) {
+    prepare_timeout_response(conn);
+    handle_connection(conn, config);
+}
+
+double get_one_minute_load() {
+    double load[1];
+    if (getloadavg(load, 1) == -1) {
+        perror("Failed to get load average");
+        return -1.0;
+    }
+    return load[0];
+}
+
+ServerPriority determine_priority(double one_min_load, int core_count) {
+    if (one_min_load < 0.5 * core_count) {
+        return HIGH_PRIORITY;
+    } else if (one_min_load < core_count) {
+        return MEDIUM_PRIORITY;
+    } else {
+        return LOW_PRIORITY;
+    }
+}
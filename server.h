@@ -1,90 +1,660 @@
-// server.h
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-#include <semaphore.h>
-#include <time.h> 
-
-#ifndef SWE_SERVER_H
-#define SWE_SERVER_H
-
-#define DEFAULT_PORT 8080
-#define BUFFER_SIZE 2048
-#define MAX_QUEUE_SIZE 1024
-#define NUM_THREADS 8
-#define DEFAULT_REQUEST_TIMEOUT_MS 5000
-#define DEFAULT_MAX_REQUEST_LINE_SIZE 4096
-
-
-typedef struct {
-    char *file;
-    int port;
-    int core_count;
-    int num_threads;
-    int request_timeout_ms;
-    size_t max_request_line_size;
-} Server;
-
-typedef enum {
-    HIGH_PRIORITY,
-    MEDIUM_PRIORITY,
-    LOW_PRIORITY
-} ServerPriority;
-
-typedef struct {
-    int sockets[MAX_QUEUE_SIZE];
-    int front;
-    int rear;
-    sem_t filled;
-    sem_t empty;
-    pthread_mutex_t mutex;
-} ClientQueue;
-
-extern const char *http_200;
-
-extern const char *http_400;
-extern const char *http_404;
-extern const char *http_500;
-extern const char *http_408;
-
-extern const char *body_400;
-extern const char *body_404;
-extern const char *body_500;
-extern const char *body_408;
-
-extern ClientQueue client_queue;
-
-// server
-int create_server(int port);
-void start_server(Server* config);
-void handle_connection(int client_fd, const Server *config);
-double get_one_minute_load();
-ServerPriority determine_priority(double one_min_load, int core_count);
-Server select_server(Server servers[], int num_servers);
-
-// request
-int is_valid_request(const char *request);
-int send_file(FILE *fp, int sockfd, const char *header);
-int send_chunked_file(FILE *fp, int sockfd, const char *header);
-
-// logging
-void log_message(const char *filename, const char *message);
-void log_error(const char *message);
-void log_connection(const char *message);
-
-// queue
-void client_queue_init(ClientQueue *q);
-void client_queue_push(ClientQueue *q, int client_fd);
-int client_queue_pop(ClientQueue *q);
-void *worker_thread(void *arg);
-
-// utils
-void parse_arguments(int argc, char *argv[], Server *config);
-const char* get_mime_type(const char *filename);
-
-
-#endif  // SWE_SERVER_H
+// server.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h> 
+
+#ifndef SWE_SERVER_H
+#define SWE_SERVER_H
+
+#define DEFAULT_PORT 8080
+#define BUFFER_SIZE 2048
+#define IO_BUFFER_SIZE (2 * BUFFER_SIZE)  // one pooled page: a connection's in[] and out[]
+#define IO_SLAB_BUFFERS 64           // pages mapped at once when a thread's pool runs dry
+#define CONNECTION_FREE_MAX 256      // Connection structs an event loop keeps for reuse
+#define MAX_QUEUE_SIZE 1024
+#define NUM_THREADS 8
+#define DEFAULT_REQUEST_TIMEOUT_MS 5000
+// Longest request line conn->in can hold with its CRLF, the blank line and a NUL.
+#define MAX_REQUEST_LINE_LIMIT (BUFFER_SIZE - 5)
+#define DEFAULT_MAX_REQUEST_LINE_SIZE MAX_REQUEST_LINE_LIMIT
+#define DEFAULT_DOCROOT "."
+#define MAX_EVENTS 64
+#define DEFAULT_KEEPALIVE_MAX_REQUESTS 100
+#define DEFAULT_KEEPALIVE_TIMEOUT_MS 5000
+#define SWEEP_INTERVAL_MS 1000      // longest wait in an idle loop, so timers fire at most this late
+#define TIMER_TICK_MS 100            // timer wheel resolution
+#define TIMER_WHEEL_SLOTS 1024       // ticks in one turn of the wheel
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_FILE (1024 * 1024)
+#define SENDFILE_MAX 0x7ffff000
+#define HTTP_MAX_HEADERS 32
+#define ETAG_SIZE 64
+#define DEFAULT_MAX_AGE 0
+#define ENCODING_GZIP 0x1
+#define ENCODING_BR 0x2
+#define SPLICE_CHUNK 65536
+#define STREAM_CHUNK_MIN 4096        // smallest chunk of a streamed response
+#define STREAM_CHUNK_MAX 65536       // largest, also capped at half the socket send buffer
+#define STREAM_TRAILER_SIZE 512
+#define STREAM_IOV_MAX 4             // header, size line, data, CRLF + last chunk + trailers
+#define MAX_RANGES 16
+#define PATH_CACHE_ENTRIES 4096
+#define PATH_CACHE_TTL_MS 1000
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_MAX_CONNECTIONS 1024
+#define DATE_LINE_LEN 39             // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n"
+#define DATE_LINE_SIZE (DATE_LINE_LEN + 1)
+#define DEFAULT_STATS_PATH "/__stats"
+#define POOL_INTERVAL_MS 250         // how often the pool samples its workers
+#define POOL_GROW_TICKS 2            // consecutive busy samples before adding a worker
+#define POOL_SHRINK_TICKS 40         // consecutive idle samples before retiring one
+#define POOL_BUSY_HIGH_PCT 80
+#define POOL_BUSY_LOW_PCT 25
+#define DEFAULT_DRAIN_TIMEOUT_MS 30000  // a retiring worker closes what is left after this
+#define DRAIN_IDLE_MS 250            // a retiring worker closes keep-alive connections idle this long
+#define UPGRADE_MAX_LISTENERS 128    // listening sockets handed to an upgraded process
+#define UPGRADE_READY_MS 10000       // how long the old process waits for the new one to start
+#define DEFAULT_CODEL_TARGET_MS 5
+#define PROXY_BUFFER_SIZE 8192       // largest upstream response header relayed
+#define UPSTREAM_IDLE_MAX 32         // pooled idle connections per upstream per worker
+#define UPSTREAM_ATTEMPTS 2          // connections tried for one request
+#define UPSTREAM_RETRY_MS 1000       // an upstream that refused a connection is avoided this long
+#define DEFAULT_UPSTREAM_TIMEOUT_MS 30000
+
+
+// A backend of proxy mode. The counters are shared by every worker.
+typedef struct {
+    char name[128];                 // HOST:PORT as given on the command line
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    int in_flight;                  // exchanges assigned to it right now
+    long long latency_ewma_ns;      // request sent to response header, smoothed
+    long long down_until_ms;        // refused a connection; avoided until then
+    unsigned long long requests;
+    unsigned long long failures;
+} Upstream;
+
+typedef struct {
+    char *file;
+    char *docroot;
+    int port;
+    int core_count;
+    int num_threads;
+    int min_threads;            // elastic pool bounds; equal to num_threads for a fixed pool
+    int max_threads;
+    int codel_target_ms;        // queue delay that counts as overload, 0 disables shedding
+    int rate_limit;             // requests per second per client address, 0 disables
+    int rate_burst;             // token bucket size for rate_limit
+    int request_timeout_ms;
+    size_t max_request_line_size;
+    int keepalive_max_requests;
+    int keepalive_timeout_ms;
+    size_t cache_size;          // total bytes of file data cached, 0 disables
+    size_t cache_max_file;      // larger files are always streamed from disk
+    int reuseport;              // per-worker SO_REUSEPORT listeners pinned to cores
+    int access_log;             // one connect.log line per response
+    char cache_control[48];     // Cache-Control value sent with files
+    int io_uring;               // io_uring workers instead of epoll loops
+    char *mime_types;           // mime.types file overriding the built-in table
+    const char *stats_path;     // request target answered with metrics, NULL disables
+    Upstream *upstreams;        // proxy mode when upstream_count > 0
+    int upstream_count;
+    int upstream_timeout_ms;    // upstream silence before a 504
+    int drain_timeout_ms;       // graceful shutdown closes what is left after this
+    char **argv;                // command line, re-executed by a hot upgrade
+    const char *bundle_path;    // serve this packed docroot instead of the file system
+    const char *pack_path;      // --pack: write docroot into this bundle and exit
+    int autoindex;              // answer directory requests with a streamed listing
+} Server;
+
+typedef enum {
+    HIGH_PRIORITY,
+    MEDIUM_PRIORITY,
+    LOW_PRIORITY
+} ServerPriority;
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    size_t sequence;
+    int client_fd;
+    long long enqueued_ns;      // for the queue stage histogram
+} ClientQueueSlot;
+
+/*
+ * Bounded lock-free MPMC ring (Vyukov): each slot's sequence number says
+ * whether it is ready for the producer or the consumer at a given lap, so
+ * push and pop each cost one CAS on their own cache line. Blocking callers
+ * spin briefly and then park on a futex word.
+ */
+typedef struct {
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned int not_empty __attribute__((aligned(CACHE_LINE_SIZE)));  // futex words, bumped on
+    unsigned int not_full;                                            // every push / pop
+    unsigned int pop_waiters;
+    unsigned int push_waiters;
+    unsigned int loop_waiters;  // event loops asleep in epoll_wait() on event_fd
+    unsigned int signaled;      // event_fd written since a loop last found the ring empty
+    int event_fd;               // eventfd readable while sockets are queued, polled by the event loops
+    ClientQueueSlot slots[MAX_QUEUE_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} ClientQueue;
+
+// A precompressed representation served from a sidecar file.
+typedef struct {
+    int flag;               // ENCODING_*, 0 ends content_codings[]
+    const char *token;      // Accept-Encoding / Content-Encoding token
+    const char *suffix;     // appended to the file name, e.g. ".gz"
+    const char *headers;    // extra 200 header lines for this coding
+} ContentCoding;
+
+// A cached file: its bytes plus the 200 header, up to the Date line, for each
+// Connection token.
+typedef struct FileCacheEntry {
+    unsigned long hash;
+    char *path;
+    char *header[2];            // indexed by Connection.keep_alive
+    size_t header_len[2];
+    char *body;
+    size_t body_len;
+    int encodings;              // ENCODING_* sidecars available for this file
+    char etag[ETAG_SIZE];       // validators of the cached version
+    time_t mtime;
+    int refs;
+    int referenced;             // CLOCK bit, guarded by the shard mutex
+    struct FileCacheEntry *next;
+    struct Bundle *bundle;      // owner of a bundle response, which counts refs for it
+} FileCacheEntry;
+
+// What a docroot-joined request path resolved to, as kept by the path cache.
+typedef struct {
+    int error;                  // 0, ENOENT (404) or EACCES (403)
+    int encodings;              // ENCODING_* sidecars of a compressible file
+    char resolved[PATH_MAX];    // realpath() result when error is 0
+} ResolvedPath;
+
+// A run of bytes inside a connection's receive buffer; not NUL-terminated.
+typedef struct {
+    const char *ptr;
+    size_t len;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value;
+} HttpHeader;
+
+typedef enum {
+    HTTP_PHASE_REQUEST_LINE,
+    HTTP_PHASE_HEADERS,
+    HTTP_PHASE_DONE
+} HttpParsePhase;
+
+typedef enum {
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_DONE = 1,
+    HTTP_PARSE_BAD = -1,                // malformed: 400
+    HTTP_PARSE_LINE_TOO_LONG = -2,      // request line over max_request_line_size: 414
+    HTTP_PARSE_HEADERS_TOO_LARGE = -3   // header block does not fit: 431
+} HttpParseStatus;
+
+// Parser state and result for the request at the front of Connection.in.
+typedef struct {
+    HttpParsePhase phase;
+    HttpParseStatus status;
+    size_t scanned;         // bytes already searched for line ends
+    size_t line_start;      // offset of the line being assembled
+    size_t length;          // size of the complete header block
+    HttpSlice method;
+    HttpSlice target;
+    HttpSlice version;
+    int minor_version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int header_count;
+    long long content_length;   // -1 when absent
+    int transfer_encoding;      // a Transfer-Encoding field is present
+} HttpRequest;
+
+// One satisfiable byte range of a Range request, clamped to the file.
+typedef struct {
+    off_t start;
+    off_t length;
+} HttpRange;
+
+typedef enum {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSED
+} ConnectionState;
+
+// What a connection's timer is waiting for; see connection_deadline().
+typedef enum {
+    TIMEOUT_IDLE,           // keep-alive connection between requests: closed
+    TIMEOUT_REQUEST,        // request not complete: 408
+    TIMEOUT_SEND,           // client stopped reading the response: closed
+    TIMEOUT_UPSTREAM        // proxied request got no progress: 504 or closed
+} TimeoutKind;
+
+// A deadline linked into an event loop's TimerWheel; next is NULL while disarmed.
+typedef struct Timer {
+    struct Timer *prev;
+    struct Timer *next;
+    long long deadline_ms;
+} Timer;
+
+typedef struct {
+    Timer slots[TIMER_WHEEL_SLOTS];     // list heads
+    long long tick;                     // first tick not yet expired
+} TimerWheel;
+
+typedef enum {
+    PROXY_SENDING,          // request head and buffered body to the upstream
+    PROXY_SENDING_BODY,     // rest of the request body, client -> pipe -> upstream
+    PROXY_READING_HEAD,     // waiting for the response header
+    PROXY_RELAYING          // response header and body to the client
+} ProxyPhase;
+
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,            // Content-Length
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE        // unframed: the body ends when the upstream closes
+} BodyFraming;
+
+// Proxy-mode state of a connection, allocated with its first proxied request.
+typedef struct ProxyExchange {
+    Upstream *upstream;
+    int fd;                 // upstream socket, -1 between exchanges
+    int reused;             // fd came from the idle pool
+    int attempts;
+    ProxyPhase phase;
+    char out[PROXY_BUFFER_SIZE];    // request head for the upstream, then response head for the client
+    size_t out_len;
+    size_t out_sent;
+    char in[PROXY_BUFFER_SIZE];     // bytes read from the upstream
+    size_t in_len;
+    size_t in_ready;        // framed as far as here and ready to forward
+    size_t in_sent;
+    int expect_continue;    // client waits for 100 Continue before sending its body
+    size_t continue_sent;
+    long long body_left;    // request body still in the client socket
+    long long body_spliced; // request body taken from the client socket so far
+    int head_request;
+    int idempotent;         // method may be replayed on another connection (RFC 9110 9.2.2)
+    BodyFraming framing;
+    long long remaining;    // Content-Length bytes, or bytes of the current chunk, left
+    int chunk_state;
+    int chunk_digits;
+    int upstream_keep_alive;
+    long long sent_ns;      // last write of the request started, for the latency EWMA
+} ProxyExchange;
+
+struct Connection;
+
+// Pushes the next piece of a streamed body; returns 0 for more, 1 when done, -1 on error.
+typedef int (*StreamProducer)(struct Connection *conn, void *ctx);
+
+// A response body generated while it is sent (stream.c), one frame at a time.
+typedef struct {
+    StreamProducer produce;
+    void (*release)(void *ctx);     // frees ctx when the stream ends, may be NULL
+    void *ctx;
+    int framed;                     // chunked; 0 for HTTP/1.0, whose body ends at close
+    int finished;                   // producer is done
+    int last_frame;                 // the frame being sent ends the body
+    int splice_file;                // body is conn->file_fd, spliced through the pipe when allowed
+    int spliced;                    // this frame's data is in the pipe, not in data[]
+    char *data;                     // chunk being filled, STREAM_CHUNK_MAX bytes
+    size_t data_len;
+    size_t limit;                   // current chunk size
+    char size_line[24];
+    size_t size_line_len;
+    char tail[STREAM_TRAILER_SIZE + 16];    // CRLF after the data, last chunk, trailers
+    size_t tail_len;
+    char trailers[STREAM_TRAILER_SIZE];
+    size_t trailers_len;
+    size_t frame_len;               // header left in out[] plus this chunk's framing and data
+    size_t frame_sent;
+    int frame_writes;               // writes the frame took so far, for sizing the next
+} ResponseStream;
+
+// Per-connection state driven by handle_connection() from a worker's event loop.
+typedef struct Connection {
+    int fd;
+    ConnectionState state;
+    char *in;               // BUFFER_SIZE bytes from the I/O pool, NULL while idle
+    size_t in_len;
+    size_t request_len;     // bytes of in[] consumed by the request being served
+    HttpRequest request;
+    long long request_started_ms;   // first byte of the request being read
+    char *out;              // BUFFER_SIZE bytes, the second half of in's page
+    size_t out_len;
+    size_t out_sent;
+    int file_fd;            // body being streamed, -1 when none
+    off_t file_offset;
+    off_t file_remaining;
+    int copy_fallback;      // kernel refused sendfile/splice; use pread + send
+    ResponseStream *stream; // streamed body, if any
+    int pipe_fds[2];        // splice staging pipe, created lazily
+    size_t pipe_pending;    // bytes spliced into the pipe but not yet sent
+    HttpRange ranges[MAX_RANGES];   // multipart/byteranges parts
+    int range_count;        // > 1 while a multipart body is being sent
+    int range_next;         // next part header to queue
+    const char *range_mime; // Content-Type of each part
+    off_t range_total;      // complete length for each Content-Range
+    FileCacheEntry *cached; // response served from the file cache, if any
+    size_t cached_sent;
+    char date_line[DATE_LINE_SIZE]; // closes the header of a cached response
+    int status;             // for the access log
+    long long response_bytes;
+    char client_ip[INET6_ADDRSTRLEN];
+    unsigned long long client_key;  // peer address folded to 64 bits, for rate limiting
+    int keep_alive;
+    int requests_served;
+    int last_request;       // the loop is draining: the next response closes the connection
+    long long last_active_ms;
+    long long request_started_ns;   // first byte of the current request, for stats
+    long long response_started_ns;  // response queued, for stats
+    ProxyExchange *proxy;   // proxy mode only
+    Timer timer;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+// Request stages timed into the /__stats histograms.
+typedef enum {
+    STAGE_QUEUE,            // accepted socket waiting in client_queue
+    STAGE_PARSE,            // first byte of a request until its header is complete
+    STAGE_RESOLVE,          // prepare_response(): path lookup and response setup
+    STAGE_SEND,             // response queued until fully written
+    STAGE_UPSTREAM,         // proxied request sent until the upstream's response header
+    STAGE_COUNT
+} StatsStage;
+
+typedef enum {
+    STAT_CONNECTIONS_OPENED,
+    STAT_CONNECTIONS_CLOSED,
+    STAT_BYTES_SENT,
+    STAT_SHED_QUEUE_DELAY,  // 503s for sockets that waited past the CoDel limit
+    STAT_SHED_QUEUE_FULL,   // 503s from the acceptor when client_queue is full
+    STAT_RATE_LIMITED,      // 429s from the per-client token buckets
+    STAT_BUSY_NS,           // event loop time spent outside epoll_wait()/io_uring_enter()
+    STAT_IO_BUFFERS_MAPPED, // pages added to the per-thread I/O pools
+    STAT_IO_BUFFERS_UNMAPPED,
+    STAT_TIMEOUTS,          // one per TimeoutKind, in that order
+    STAT_TIMEOUTS_LAST = STAT_TIMEOUTS + TIMEOUT_UPSTREAM,
+    STAT_COUNTERS
+} StatsCounter;
+
+typedef enum {
+    WORKER_RUN,
+    WORKER_RETIRE,      // stop taking clients, finish open connections, exit
+    WORKER_STOP         // exit now
+} WorkerCommand;
+
+typedef struct {
+    pthread_t thread;
+    const Server *config;
+    int listen_fd;      // own SO_REUSEPORT listener, -1 when fed by client_queue
+    int cpu;            // core to pin the thread to, -1 for none
+    int wake_fd;        // eventfd poked after `command` changes
+    int command;        // WorkerCommand, written by the pool
+    int started;        // thread created and not yet joined; pool-owned
+    int exited;         // set by the thread as it returns
+    unsigned long long busy_ns;     // loop time outside the wait, written by the worker
+    unsigned long long busy_seen;   // busy_ns at the pool's previous sample
+} Worker;
+
+// Sizing state of the worker pool, published for /__stats.
+typedef struct {
+    int min_threads;
+    int max_threads;
+    int size;               // workers taking new clients
+    int utilisation_pct;    // busy share of those workers over the last sample
+    unsigned long grown;
+    unsigned long shrunk;
+} WorkerPool;
+
+// One per worker thread: its epoll set and the connections registered in it.
+typedef struct {
+    int epoll_fd;
+    Connection *connections;
+    TimerWheel timers;
+    Connection *free_connections;   // closed structs kept for the next client
+    int free_count;
+    const Server *config;
+    int listen_fd;
+    int draining;           // retiring: no new clients, idle connections close
+    long long drain_deadline_ms;
+} EventLoop;
+
+// Incremental UTF-8 validator state, carried across utf8_stream_feed() calls.
+typedef struct {
+    unsigned state;
+    unsigned long long offset;          // bytes consumed so far
+    unsigned long long sequence_start;  // lead byte of an unfinished code point
+    unsigned long long error_offset;    // first invalid byte, once rejected
+} Utf8Stream;
+
+extern const char *http_200;
+extern const char *http_200_streamed;
+extern const char *http_304;
+extern const char *http_206;
+extern const char *http_206_multipart;
+extern const char *http_416;
+
+extern const char *http_400;
+extern const char *http_404;
+extern const char *http_500;
+extern const char *http_408;
+extern const char *http_403;
+extern const char *http_414;
+extern const char *http_431;
+extern const char *http_429;
+extern const char *http_503;
+extern const char *http_411;
+extern const char *http_502;
+extern const char *http_504;
+
+extern const char *body_400;
+extern const char *body_403;
+extern const char *body_404;
+extern const char *body_500;
+extern const char *body_408;
+extern const char *body_414;
+extern const char *body_431;
+extern const char *body_416;
+extern const char *body_429;
+extern const char *body_503;
+extern const char *body_411;
+extern const char *body_502;
+extern const char *body_504;
+
+extern const ContentCoding content_codings[];
+extern const char *vary_header;
+
+extern ClientQueue client_queue;
+extern WorkerPool worker_pool;
+
+// server
+int create_server(int port, int reuseport);
+void start_server(Server* config);
+void handle_connection(Connection *conn, const Server *config);
+void handle_request_timeout(Connection *conn, const Server *config);
+int request_buffered(Connection *conn, const Server *config);
+void prepare_response(Connection *conn, const Server *config);
+void prepare_timeout_response(Connection *conn);
+void queue_response(Connection *conn, const char *header_format, const char *body);
+void reject_overloaded(int client_fd);
+int finish_response(Connection *conn, const Server *config);
+double get_one_minute_load();
+ServerPriority determine_priority(double one_min_load, int core_count);
+
+// parser
+void http_request_reset(HttpRequest *req);
+HttpParseStatus http_parse_request(HttpRequest *req, const char *buf, size_t len, size_t max_line_size);
+const HttpSlice *http_find_header(const HttpRequest *req, const char *name);
+int http_slice_equals(HttpSlice slice, const char *text);
+
+// request
+int wants_keep_alive(const HttpRequest *request);
+int accepted_encodings(const HttpRequest *request);
+int request_not_modified(const HttpRequest *request, const char *etag, time_t mtime);
+int range_applies(const HttpRequest *request, const char *etag, time_t mtime);
+int parse_byte_ranges(const HttpSlice *value, off_t size, HttpRange *ranges, int max);
+const char *range_boundary(void);
+int format_range_part(char *buf, size_t size, const Connection *conn, int index);
+int send_file(Connection *conn);
+int send_ranges(Connection *conn);
+int queue_next_range_part(Connection *conn);
+int zero_copy_refused(int err);
+void close_file(Connection *conn);
+int cached_response_iov(const Connection *conn, struct iovec *iov);
+int send_cached(Connection *conn);
+
+// stream
+int stream_begin(Connection *conn, const char *mime_type, const char *extra_headers,
+                 StreamProducer produce, void *ctx, void (*release)(void *ctx));
+void *stream_buffer(Connection *conn, size_t *room);
+void stream_commit(Connection *conn, size_t len);
+size_t stream_write(Connection *conn, const void *data, size_t len);
+int stream_trailer(Connection *conn, const char *name, const char *value);
+int stream_iov(Connection *conn, struct iovec *iov);
+size_t stream_spliced(const Connection *conn);
+int stream_more(const Connection *conn);
+void stream_sent(Connection *conn, size_t sent);
+void stream_close(Connection *conn);
+int send_stream(Connection *conn);
+int stream_file(Connection *conn, int file_fd, const char *mime_type, const char *extra_headers);
+
+// listing
+int serve_listing(Connection *conn, const char *path, const char *request_path);
+
+// response
+const char *http_date_line(void);
+int format_response_header(char *buf, size_t size, const char *format, ...);
+
+// cache
+void file_cache_init(const Server *config);
+FileCacheEntry *file_cache_lookup(const char *path);
+FileCacheEntry *file_cache_insert(const char *path, int fd, const struct stat *st, const char *mime_type,
+                                  const char *extra_headers, int encodings, unsigned long generation);
+void file_cache_release(FileCacheEntry *entry);
+void file_cache_invalidate(const char *path);
+unsigned long file_cache_generation(void);
+int path_cache_lookup(const char *key, ResolvedPath *out);
+FileCacheEntry *file_cache_detached(char *body, size_t body_len, const char *mime_type, const char *extra_headers);
+void path_cache_store(const char *key, const ResolvedPath *value, unsigned long generation);
+
+// bundle
+int bundle_pack(const Server *config);
+int bundle_load(const Server *config);
+FileCacheEntry *bundle_lookup(const char *path, const HttpRequest *request);
+void bundle_release(struct Bundle *bundle);
+void bundle_thread_release(void);
+
+// logging
+void log_message(const char *filename, const char *message);
+void log_error(const char *message);
+void log_connection(const char *message);
+void log_init(void);
+void log_shutdown(void);
+
+// queue
+void client_queue_init(ClientQueue *q);
+void client_queue_push(ClientQueue *q, int client_fd);
+int client_queue_pop(ClientQueue *q);
+int client_queue_try_push(ClientQueue *q, int client_fd);
+int client_queue_try_pop(ClientQueue *q);
+int client_queue_try_pop_timed(ClientQueue *q, long long *enqueued_ns);
+int client_queue_pop_woken(ClientQueue *q, long long *enqueued_ns);
+void client_queue_loop_sleeping(ClientQueue *q, int sleeping);
+size_t client_queue_depth(const ClientQueue *q);
+
+// event
+void *worker_thread(void *arg);
+void worker_pin(const Worker *worker);
+void connection_init(Connection *conn, int client_fd, const Server *config);
+Connection *connection_open(EventLoop *loop, int client_fd);
+void connection_close(EventLoop *loop, Connection *conn);
+
+// timer
+void timer_wheel_init(TimerWheel *wheel, long long now_ms);
+void timer_arm(TimerWheel *wheel, Timer *timer, long long deadline_ms);
+void timer_cancel(Timer *timer);
+Connection *timer_wheel_expired(TimerWheel *wheel, long long now_ms);
+long long connection_deadline(const Connection *conn, const Server *config, TimeoutKind *kind);
+void connection_schedule(TimerWheel *wheel, Connection *conn, const Server *config);
+
+// pool
+void *io_buffer_get(void);
+void io_buffer_put(void *page);
+void io_pool_release_thread(void);
+int connection_attach_buffers(Connection *conn);
+void connection_release_buffers(Connection *conn);
+
+// uring
+int uring_available(void);
+void *uring_worker_thread(void *arg);
+
+// proxy
+int upstream_resolve(Upstream *upstream);
+Upstream *select_upstream(Upstream *upstreams, int count);
+void proxy_init(const Server *config);
+void proxy_thread_init(int epoll_fd);
+void proxy_thread_shutdown(void);
+int proxy_request(Connection *conn);
+int proxy_exchange(Connection *conn);
+void handle_upstream_timeout(Connection *conn, const Server *config);
+void proxy_close(Connection *conn);
+
+// admission
+void admission_init(const Server *config);
+int admission_admit(long long sojourn_ns);
+int admission_overloaded(void);
+int client_rate_allows(unsigned long long client_key);
+
+// stats
+void stats_record(StatsStage stage, long long ns);
+void stats_add(StatsCounter counter, unsigned long long n);
+void stats_count_response(int status);
+char *stats_render(const Server *config, size_t *len);
+
+// upgrade
+int upgrade_inherit(int *fds, int max);
+void upgrade_ready(void);
+pid_t upgrade_spawn(char *const argv[], const int *fds, int count);
+
+// utils
+void parse_arguments(int argc, char *argv[], Server *config);
+const char* get_mime_type(const char *filename);
+int load_mime_types(const char *path);
+int is_compressible_type(const char *mime_type);
+void format_etag(char *buf, size_t size, const struct stat *st);
+void format_http_date(char *buf, size_t size, time_t t);
+int set_nonblocking(int fd);
+long long monotonic_ms(void);
+long long monotonic_ns(void);
+
+// parseutf
+int validate_utf8(const void *input, const unsigned maxlen);
+int validate_utf16(const void *input, const unsigned maxlen, const int big_endian);
+int validate_utf32(const void *input, const unsigned maxlen, const int big_endian);
+void utf8_stream_init(Utf8Stream *stream);
+int utf8_stream_feed(Utf8Stream *stream, const void *data, size_t len);
+int utf8_stream_finish(Utf8Stream *stream);
+int utf_select_kernel(const char *name);
+const char *utf_kernel_name(void);
+
+
+#endif  // SWE_SERVER_H
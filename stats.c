@@ -0,0 +1,304 @@
+// stats.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "server.h"
+
+/*
+ * Every thread that records anything gets its own block of counters and
+ * latency histograms. Only the owner writes to it, so recording is a plain
+ * load and a relaxed store with no locked instruction or shared cache
+ * line. stats_render() walks the blocks on demand and sums them into
+ * Prometheus text. Blocks are never freed, so counters stay monotonic.
+ *
+ * Histograms are log-linear: each power of two of nanoseconds from 1us to
+ * 17s is split into four buckets, which keeps every bucket within 25% of
+ * its value. Bucket 0 holds anything under 1.024us and the last bucket
+ * anything past the top octave.
+ */
+
+#define STATS_MIN_SHIFT 10                  // first octave starts at 1024ns
+#define STATS_SUB_BITS 2                    // four buckets per octave
+#define STATS_OCTAVES 24
+#define STATS_BUCKETS (1 + (STATS_OCTAVES << STATS_SUB_BITS) + 1)
+#define STATS_STATUS_CLASSES 6              // [0] collects codes outside 1xx-5xx
+
+typedef struct ThreadStats {
+    unsigned long long counters[STAT_COUNTERS];
+    unsigned long long responses[STATS_STATUS_CLASSES];
+    unsigned long long stage_sum_ns[STAGE_COUNT];
+    unsigned long long buckets[STAGE_COUNT][STATS_BUCKETS];
+    int id;
+    struct ThreadStats *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ThreadStats;
+
+static const char *stage_names[STAGE_COUNT] = {"queue", "parse", "resolve", "send", "upstream"};
+
+static ThreadStats *thread_stats_list;
+static int thread_stats_count;
+static pthread_mutex_t thread_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadStats *thread_stats;
+
+static ThreadStats *get_thread_stats(void) {
+    if (thread_stats != NULL) {
+        return thread_stats;
+    }
+
+    ThreadStats *stats = aligned_alloc(CACHE_LINE_SIZE, sizeof(ThreadStats));
+    if (stats == NULL) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&thread_stats_mutex);
+    stats->id = thread_stats_count++;
+    stats->next = thread_stats_list;
+    __atomic_store_n(&thread_stats_list, stats, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&thread_stats_mutex);
+
+    thread_stats = stats;
+    return stats;
+}
+
+// Single-writer increment: no other thread stores to `counter`.
+static inline void bump(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long peek(const unsigned long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(unsigned long long ns) {
+    if (ns < (1ULL << STATS_MIN_SHIFT)) {
+        return 0;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= STATS_MIN_SHIFT + STATS_OCTAVES) {
+        return STATS_BUCKETS - 1;
+    }
+    int sub = (int)(ns >> (exponent - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+    return 1 + ((exponent - STATS_MIN_SHIFT) << STATS_SUB_BITS) + sub;
+}
+
+// Exclusive upper bound of a finite bucket, in nanoseconds.
+static unsigned long long bucket_limit(int index) {
+    if (index == 0) {
+        return 1ULL << STATS_MIN_SHIFT;
+    }
+    int exponent = STATS_MIN_SHIFT + ((index - 1) >> STATS_SUB_BITS);
+    unsigned long long sub = (unsigned long long)((index - 1) & ((1 << STATS_SUB_BITS) - 1));
+    return ((1ULL << STATS_SUB_BITS) + sub + 1) << (exponent - STATS_SUB_BITS);
+}
+
+void stats_record(StatsStage stage, long long ns) {
+    ThreadStats *stats = get_thread_stats();
+    if (stats == NULL) {
+        return;
+    }
+    unsigned long long value = ns > 0 ? (unsigned long long)ns : 0;
+    bump(&stats->buckets[stage][bucket_index(value)], 1);
+    bump(&stats->stage_sum_ns[stage], value);
+}
+
+void stats_add(StatsCounter counter, unsigned long long n) {
+    ThreadStats *stats = get_thread_stats();
+    if (stats != NULL) {
+        bump(&stats->counters[counter], n);
+    }
+}
+
+void stats_count_response(int status) {
+    ThreadStats *stats = get_thread_stats();
+    if (stats != NULL) {
+        int class = status / 100;
+        bump(&stats->responses[class >= 1 && class <= 5 ? class : 0], 1);
+    }
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} TextBuffer;
+
+static void emit(TextBuffer *out, const char *format, ...) {
+    while (!out->failed) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(out->data + out->len, out->capacity - out->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            out->failed = 1;
+        } else if ((size_t)n < out->capacity - out->len) {
+            out->len += (size_t)n;
+            return;
+        } else {
+            char *grown = realloc(out->data, out->capacity * 2);
+            if (grown == NULL) {
+                out->failed = 1;
+            } else {
+                out->data = grown;
+                out->capacity *= 2;
+            }
+        }
+    }
+}
+
+static void emit_counter(TextBuffer *out, const char *name, const char *help, unsigned long long value) {
+    emit(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+static void emit_gauge(TextBuffer *out, const char *name, const char *help, long long value) {
+    emit(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, value);
+}
+
+// Per-upstream series of proxy mode, read straight from the shared counters.
+static void emit_upstreams(TextBuffer *out, const Server *config) {
+    if (config->upstream_count == 0) {
+        return;
+    }
+    emit(out, "# HELP webserver_upstream_requests_total Requests sent to each upstream, retries included.\n"
+              "# TYPE webserver_upstream_requests_total counter\n");
+    for (int i = 0; i < config->upstream_count; i++) {
+        emit(out, "webserver_upstream_requests_total{upstream=\"%s\"} %llu\n", config->upstreams[i].name,
+             __atomic_load_n(&config->upstreams[i].requests, __ATOMIC_RELAXED));
+    }
+    emit(out, "# HELP webserver_upstream_failures_total Refused connections, broken exchanges and timeouts.\n"
+              "# TYPE webserver_upstream_failures_total counter\n");
+    for (int i = 0; i < config->upstream_count; i++) {
+        emit(out, "webserver_upstream_failures_total{upstream=\"%s\"} %llu\n", config->upstreams[i].name,
+             __atomic_load_n(&config->upstreams[i].failures, __ATOMIC_RELAXED));
+    }
+    emit(out, "# HELP webserver_upstream_in_flight Requests waiting on each upstream.\n"
+              "# TYPE webserver_upstream_in_flight gauge\n");
+    for (int i = 0; i < config->upstream_count; i++) {
+        emit(out, "webserver_upstream_in_flight{upstream=\"%s\"} %d\n", config->upstreams[i].name,
+             __atomic_load_n(&config->upstreams[i].in_flight, __ATOMIC_RELAXED));
+    }
+    emit(out, "# HELP webserver_upstream_latency_ewma_seconds Smoothed time to response header, as used to pick upstreams.\n"
+              "# TYPE webserver_upstream_latency_ewma_seconds gauge\n");
+    for (int i = 0; i < config->upstream_count; i++) {
+        emit(out, "webserver_upstream_latency_ewma_seconds{upstream=\"%s\"} %.6f\n", config->upstreams[i].name,
+             __atomic_load_n(&config->upstreams[i].latency_ewma_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+}
+
+/*
+ * Sums every thread's block into the Prometheus text exposition format.
+ * Returns a malloc()ed body and its length, or NULL if memory ran out.
+ */
+char *stats_render(const Server *config, size_t *len) {
+    unsigned long long counters[STAT_COUNTERS] = {0};
+    unsigned long long responses[STATS_STATUS_CLASSES] = {0};
+    unsigned long long stage_sum_ns[STAGE_COUNT] = {0};
+    unsigned long long buckets[STAGE_COUNT][STATS_BUCKETS] = {{0}};
+
+    TextBuffer out = {.data = malloc(16384), .len = 0, .capacity = 16384, .failed = 0};
+    if (out.data == NULL) {
+        return NULL;
+    }
+
+    ThreadStats *head = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE);
+    emit(&out, "# HELP webserver_thread_busy_seconds_total Time a worker spent handling events rather than waiting.\n"
+               "# TYPE webserver_thread_busy_seconds_total counter\n");
+    for (ThreadStats *stats = head; stats != NULL; stats = stats->next) {
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            counters[i] += peek(&stats->counters[i]);
+        }
+        for (int i = 0; i < STATS_STATUS_CLASSES; i++) {
+            responses[i] += peek(&stats->responses[i]);
+        }
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            stage_sum_ns[stage] += peek(&stats->stage_sum_ns[stage]);
+            for (int i = 0; i < STATS_BUCKETS; i++) {
+                buckets[stage][i] += peek(&stats->buckets[stage][i]);
+            }
+        }
+        unsigned long long busy_ns = peek(&stats->counters[STAT_BUSY_NS]);
+        if (busy_ns > 0) {
+            emit(&out, "webserver_thread_busy_seconds_total{thread=\"%d\"} %.6f\n", stats->id, busy_ns / 1e9);
+        }
+    }
+
+    emit(&out, "# HELP webserver_responses_total Responses sent, by status class.\n"
+               "# TYPE webserver_responses_total counter\n");
+    for (int i = 1; i < STATS_STATUS_CLASSES; i++) {
+        emit(&out, "webserver_responses_total{code=\"%dxx\"} %llu\n", i, responses[i]);
+    }
+    if (responses[0] > 0) {
+        emit(&out, "webserver_responses_total{code=\"other\"} %llu\n", responses[0]);
+    }
+    emit_counter(&out, "webserver_response_bytes_total", "Header and body bytes of completed responses.",
+                 counters[STAT_BYTES_SENT]);
+    emit_counter(&out, "webserver_connections_accepted_total", "Client connections accepted.",
+                 counters[STAT_CONNECTIONS_OPENED]);
+    emit_gauge(&out, "webserver_connections_open", "Client connections currently open.",
+               (long long)(counters[STAT_CONNECTIONS_OPENED] - counters[STAT_CONNECTIONS_CLOSED]));
+    emit_gauge(&out, "webserver_io_buffer_bytes", "Memory mapped for the per-thread connection buffer pools.",
+               (long long)(counters[STAT_IO_BUFFERS_MAPPED] - counters[STAT_IO_BUFFERS_UNMAPPED]) * IO_BUFFER_SIZE);
+    emit_gauge(&out, "webserver_client_queue_depth", "Accepted sockets waiting for a worker.",
+               (long long)client_queue_depth(&client_queue));
+    emit_gauge(&out, "webserver_client_queue_capacity", "Slots in the client queue.", MAX_QUEUE_SIZE);
+    emit(&out, "# HELP webserver_rejected_total Requests refused by admission control.\n"
+               "# TYPE webserver_rejected_total counter\n"
+               "webserver_rejected_total{reason=\"queue_delay\"} %llu\n"
+               "webserver_rejected_total{reason=\"queue_full\"} %llu\n"
+               "webserver_rejected_total{reason=\"rate_limit\"} %llu\n",
+         counters[STAT_SHED_QUEUE_DELAY], counters[STAT_SHED_QUEUE_FULL], counters[STAT_RATE_LIMITED]);
+    emit(&out, "# HELP webserver_timeouts_total Connections whose deadline expired, by what they were waiting for.\n"
+               "# TYPE webserver_timeouts_total counter\n"
+               "webserver_timeouts_total{kind=\"keepalive\"} %llu\n"
+               "webserver_timeouts_total{kind=\"request\"} %llu\n"
+               "webserver_timeouts_total{kind=\"send\"} %llu\n"
+               "webserver_timeouts_total{kind=\"upstream\"} %llu\n",
+         counters[STAT_TIMEOUTS + TIMEOUT_IDLE], counters[STAT_TIMEOUTS + TIMEOUT_REQUEST],
+         counters[STAT_TIMEOUTS + TIMEOUT_SEND], counters[STAT_TIMEOUTS + TIMEOUT_UPSTREAM]);
+    emit_gauge(&out, "webserver_overloaded", "1 while queue delay has stayed above the CoDel target.",
+               admission_overloaded());
+    emit_gauge(&out, "webserver_workers", "Workers taking new clients.",
+               __atomic_load_n(&worker_pool.size, __ATOMIC_RELAXED));
+    emit_gauge(&out, "webserver_workers_min", "Lower bound of the worker pool.", worker_pool.min_threads);
+    emit_gauge(&out, "webserver_workers_max", "Upper bound of the worker pool.", worker_pool.max_threads);
+    emit(&out, "# HELP webserver_worker_utilisation_ratio Busy share of the workers at the pool's last sample.\n"
+               "# TYPE webserver_worker_utilisation_ratio gauge\n"
+               "webserver_worker_utilisation_ratio %.2f\n",
+         __atomic_load_n(&worker_pool.utilisation_pct, __ATOMIC_RELAXED) / 100.0);
+    emit_counter(&out, "webserver_workers_started_total", "Workers added by the pool.",
+                 __atomic_load_n(&worker_pool.grown, __ATOMIC_RELAXED));
+    emit_counter(&out, "webserver_workers_retired_total", "Workers retired by the pool.",
+                 __atomic_load_n(&worker_pool.shrunk, __ATOMIC_RELAXED));
+
+    emit(&out, "# HELP webserver_stage_seconds Latency of each request stage: queue (accept to worker), "
+               "parse (first byte to complete header), resolve (path lookup and response setup), "
+               "send (response queued to fully written), upstream (proxied request sent to response header).\n"
+               "# TYPE webserver_stage_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        unsigned long long cumulative = 0;
+        for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+            cumulative += buckets[stage][i];
+            emit(&out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                 stage_names[stage], bucket_limit(i) / 1e9, cumulative);
+        }
+        cumulative += buckets[stage][STATS_BUCKETS - 1];
+        emit(&out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                   "webserver_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                   "webserver_stage_seconds_count{stage=\"%s\"} %llu\n",
+             stage_names[stage], cumulative, stage_names[stage], stage_sum_ns[stage] / 1e9,
+             stage_names[stage], cumulative);
+    }
+
+    emit_upstreams(&out, config);
+
+    if (out.failed) {
+        free(out.data);
+        return NULL;
+    }
+    *len = out.len;
+    return out.data;
+}
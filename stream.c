@@ -0,0 +1,428 @@
+// stream.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "server.h"
+
+/*
+ * Streamed responses: a body generated while it is sent, for handlers that
+ * do not know its length up front. The handler supplies a producer that
+ * the connection calls whenever the stream has room; the producer pushes
+ * bytes with stream_write() (or fills stream_buffer() directly) until the
+ * chunk is full, and says when it is done. It is never called while the
+ * socket still holds back the previous chunk, so a fast producer and a
+ * slow client cost a buffer, not a blocked worker.
+ *
+ * Each chunk goes out as one frame: size line, data, the CRLF closing it
+ * and, after the last one, the zero chunk and any trailers, all in one
+ * scatter list, behind the response header for the first. Chunks start at
+ * STREAM_CHUNK_MIN and double while a frame leaves in a single write, up
+ * to STREAM_CHUNK_MAX or half the socket send buffer, which TCP grows as
+ * the transfer goes on; a frame the socket takes in pieces halves the
+ * next one.
+ *
+ * A file body (stream_file()) skips the chunk buffer: each chunk is
+ * spliced file -> pipe -> socket, so only the size line and the CRLFs
+ * around it pass through user space.
+ *
+ * HTTP/1.0 clients get the bytes unframed and the connection closes after
+ * them; trailers are dropped.
+ */
+
+static const char *transfer_chunked = "Transfer-Encoding: chunked\r\n";
+
+// Largest chunk worth framing for this socket: half its send buffer, within bounds.
+static size_t chunk_cap(int fd) {
+    int sndbuf = 0;
+    socklen_t optlen = sizeof(sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) != 0 || (size_t)sndbuf / 2 > STREAM_CHUNK_MAX) {
+        return STREAM_CHUNK_MAX;
+    }
+    return (size_t)sndbuf / 2 > STREAM_CHUNK_MIN ? (size_t)sndbuf / 2 : STREAM_CHUNK_MIN;
+}
+
+/*
+ * Queues a 200 header for a streamed body and attaches the stream. A
+ * handler that adds trailers should announce them with a Trailer line in
+ * `extra_headers`. `release`, if not NULL, is called on `ctx` once the
+ * stream is done with it, also when this fails. Returns 0, or -1 with
+ * nothing queued.
+ */
+int stream_begin(Connection *conn, const char *mime_type, const char *extra_headers,
+                 StreamProducer produce, void *ctx, void (*release)(void *ctx)) {
+    ResponseStream *stream = calloc(1, sizeof(ResponseStream));
+    if (stream != NULL) {
+        stream->data = malloc(STREAM_CHUNK_MAX);
+    }
+    if (stream == NULL || stream->data == NULL) {
+        perror("malloc failed");
+        free(stream);
+        if (release != NULL) {
+            release(ctx);
+        }
+        return -1;
+    }
+    stream->produce = produce;
+    stream->release = release;
+    stream->ctx = ctx;
+    stream->framed = conn->request.minor_version >= 1;
+    if (!stream->framed) {
+        conn->keep_alive = 0;
+    }
+    stream->limit = STREAM_CHUNK_MIN;
+
+    // Each frame is already one write. Left to Nagle, a frame that does not
+    // fill a segment waits for the ACK of the one before, which a client
+    // may delay by tens of milliseconds. stream_close() turns it off again.
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int header_len = format_response_header(conn->out, BUFFER_SIZE, http_200_streamed, mime_type,
+                                            stream->framed ? transfer_chunked : "", extra_headers,
+                                            conn->keep_alive ? "keep-alive" : "close");
+    if (header_len < 0) {
+        conn->stream = stream;
+        stream_close(conn);
+        return -1;
+    }
+    conn->out_len = (size_t)header_len;
+    conn->out_sent = 0;
+    conn->stream = stream;
+    conn->state = CONN_WRITING;
+    conn->status = 200;
+    conn->response_bytes = 0;
+    return 0;
+}
+
+// Room left in the chunk being filled; a producer may write up to *room bytes there.
+void *stream_buffer(Connection *conn, size_t *room) {
+    ResponseStream *stream = conn->stream;
+    *room = stream->limit - stream->data_len;
+    return stream->data + stream->data_len;
+}
+
+// Adds `len` bytes written into stream_buffer() to the chunk.
+void stream_commit(Connection *conn, size_t len) {
+    conn->stream->data_len += len;
+}
+
+/*
+ * Copies as much of `data` as the chunk has room for. Returns the bytes
+ * taken; fewer than `len` means the chunk is full, and the producer should
+ * return 0 and offer the rest when it is called again.
+ */
+size_t stream_write(Connection *conn, const void *data, size_t len) {
+    size_t room;
+    char *dst = stream_buffer(conn, &room);
+    if (len > room) {
+        len = room;
+    }
+    memcpy(dst, data, len);
+    stream_commit(conn, len);
+    return len;
+}
+
+// Adds a trailer field sent after the last chunk. Returns -1 if the trailers are full.
+int stream_trailer(Connection *conn, const char *name, const char *value) {
+    ResponseStream *stream = conn->stream;
+    size_t room = sizeof(stream->trailers) - stream->trailers_len;
+    int n = snprintf(stream->trailers + stream->trailers_len, room, "%s: %s\r\n", name, value);
+    if (n < 0 || (size_t)n >= room) {
+        stream->trailers[stream->trailers_len] = '\0';
+        return -1;
+    }
+    stream->trailers_len += (size_t)n;
+    return 0;
+}
+
+// Bytes of the current frame before its data: header left in out[] and the size line.
+static size_t frame_head(const ResponseStream *stream) {
+    return stream->frame_len - stream->data_len - stream->tail_len;
+}
+
+static int produce_file(Connection *conn, void *ctx);
+
+// Splices the next chunk of conn->file_fd into the pipe; returns like a producer.
+static int splice_file_chunk(Connection *conn, ResponseStream *stream) {
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        conn->copy_fallback = 1;
+        return produce_file(conn, NULL);
+    }
+    while (1) {
+        ssize_t n = splice(conn->file_fd, &conn->file_offset, conn->pipe_fds[1], NULL, stream->limit,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            conn->pipe_pending = (size_t)n;
+            stream->data_len = (size_t)n;
+            stream->spliced = 1;
+            return 0;
+        }
+        if (n == 0) {
+            close_file(conn);
+            return 1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (zero_copy_refused(errno)) {
+            conn->copy_fallback = 1;
+            return produce_file(conn, NULL);
+        }
+        perror("Failed to read file");
+        return -1;
+    }
+}
+
+// Runs the producer and frames what it wrote. Returns 1, 0 once nothing is left, or -1.
+static int build_frame(Connection *conn, ResponseStream *stream) {
+    if (stream->last_frame) {
+        return 0;
+    }
+    stream->spliced = 0;
+    if (!stream->finished) {
+        int status = stream->splice_file && !conn->copy_fallback ? splice_file_chunk(conn, stream)
+                                                                  : stream->produce(conn, stream->ctx);
+        if (status < 0) {
+            log_error("Stream producer failed");
+            errno = EIO;
+            return -1;
+        }
+        if (status == 0 && stream->data_len == 0) {
+            log_error("Stream producer made no progress");
+            errno = EIO;
+            return -1;
+        }
+        stream->finished = status > 0;
+    }
+
+    stream->size_line_len = 0;
+    stream->tail_len = 0;
+    if (stream->framed) {
+        if (stream->data_len > 0) {
+            stream->size_line_len = (size_t)snprintf(stream->size_line, sizeof(stream->size_line), "%zx\r\n",
+                                                     stream->data_len);
+            memcpy(stream->tail, "\r\n", 2);
+            stream->tail_len = 2;
+        }
+        if (stream->finished) {
+            memcpy(stream->tail + stream->tail_len, "0\r\n", 3);
+            memcpy(stream->tail + stream->tail_len + 3, stream->trailers, stream->trailers_len);
+            memcpy(stream->tail + stream->tail_len + 3 + stream->trailers_len, "\r\n", 2);
+            stream->tail_len += 3 + stream->trailers_len + 2;
+        }
+    }
+    stream->last_frame = stream->finished;
+    stream->frame_len = (conn->out_len - conn->out_sent) + stream->size_line_len + stream->data_len +
+                        stream->tail_len;
+    stream->frame_sent = 0;
+    stream->frame_writes = 0;
+    return stream->frame_len > 0 ? 1 : 0;
+}
+
+/*
+ * Fills `iov` with the unsent rest of the current frame, building the next
+ * one when it is out. Data waiting in the pipe ends the list; callers ask
+ * stream_spliced() first and splice it themselves. Returns the number of
+ * entries used (at most STREAM_IOV_MAX), 0 once the whole body is sent, or
+ * -1 if the producer failed.
+ */
+int stream_iov(Connection *conn, struct iovec *iov) {
+    ResponseStream *stream = conn->stream;
+    if (stream->frame_sent == stream->frame_len) {
+        int status = build_frame(conn, stream);
+        if (status <= 0) {
+            return status;
+        }
+    }
+
+    struct iovec segments[STREAM_IOV_MAX] = {
+        {conn->out + conn->out_sent, conn->out_len - conn->out_sent},
+        {stream->size_line, stream->size_line_len},
+        {stream->data, stream->data_len},
+        {stream->tail, stream->tail_len},
+    };
+    size_t skip = stream->frame_sent;
+    int iovcnt = 0;
+    for (int i = 0; i < STREAM_IOV_MAX; i++) {
+        if (skip >= segments[i].iov_len) {
+            skip -= segments[i].iov_len;
+            continue;
+        }
+        if (i == 2 && stream->spliced) {
+            break;
+        }
+        iov[iovcnt].iov_base = (char *)segments[i].iov_base + skip;
+        iov[iovcnt].iov_len = segments[i].iov_len - skip;
+        iovcnt++;
+        skip = 0;
+    }
+    return iovcnt;
+}
+
+/*
+ * Bytes of the current frame waiting in the connection's pipe, which go
+ * pipe -> socket before stream_iov() has anything more; 0 otherwise.
+ */
+size_t stream_spliced(const Connection *conn) {
+    const ResponseStream *stream = conn->stream;
+    size_t head = frame_head(stream);
+    if (!stream->spliced || stream->frame_sent < head || stream->frame_sent >= head + stream->data_len) {
+        return 0;
+    }
+    return conn->pipe_pending;
+}
+
+// 1 while what stream_iov() returns is followed by spliced data, for MSG_MORE.
+int stream_more(const Connection *conn) {
+    return conn->stream->spliced && conn->stream->frame_sent < frame_head(conn->stream);
+}
+
+// Accounts for `sent` bytes of the current frame and resizes chunks once it is out.
+void stream_sent(Connection *conn, size_t sent) {
+    ResponseStream *stream = conn->stream;
+    stream->frame_sent += sent;
+    stream->frame_writes++;
+    conn->response_bytes += (long long)sent;
+    if (stream->frame_sent < stream->frame_len) {
+        return;
+    }
+
+    if (stream->frame_writes == 1 && stream->data_len == stream->limit && stream->limit < STREAM_CHUNK_MAX) {
+        size_t cap = chunk_cap(conn->fd);
+        if (cap > stream->limit) {
+            stream->limit = stream->limit * 2 < cap ? stream->limit * 2 : cap;
+        }
+    } else if (stream->frame_writes > 1 && stream->limit > STREAM_CHUNK_MIN) {
+        stream->limit /= 2;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    stream->data_len = 0;
+}
+
+// The socket refused the frame outright; it will take more than one write.
+static void stream_blocked(Connection *conn) {
+    conn->stream->frame_writes++;
+}
+
+void stream_close(Connection *conn) {
+    ResponseStream *stream = conn->stream;
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->release != NULL) {
+        stream->release(stream->ctx);
+    }
+    free(stream->data);
+    free(stream);
+    conn->stream = NULL;
+
+    // Whatever follows on a kept-alive connection goes out in one write of
+    // its own and gains nothing from TCP_NODELAY; let Nagle coalesce again.
+    int zero = 0;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &zero, sizeof(zero));
+}
+
+/*
+ * Sends the streamed body, one sendmsg() per frame (around a splice() for
+ * file chunks), until the producer is done or the socket would block.
+ * Returns 1 when complete, 0 to wait for the socket and -1 on error.
+ */
+int send_stream(Connection *conn) {
+    while (1) {
+        ssize_t sent;
+        size_t spliced = stream_spliced(conn);
+        if (spliced > 0) {
+            sent = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, spliced,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (conn->stream->framed ? SPLICE_F_MORE : 0));
+        } else {
+            struct iovec iov[STREAM_IOV_MAX];
+            int iovcnt = stream_iov(conn, iov);
+            if (iovcnt < 0) {
+                return -1;
+            }
+            if (iovcnt == 0) {
+                stream_close(conn);
+                return 1;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)iovcnt;
+
+            int flags = stream_more(conn) ? MSG_MORE : 0;
+#ifdef MSG_NOSIGNAL
+            flags |= MSG_NOSIGNAL;
+#endif
+            sent = sendmsg(conn->fd, &msg, flags);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stream_blocked(conn);
+                return 0;
+            }
+            int send_errno = errno;
+            if (send_errno != EPIPE && send_errno != ECONNRESET) {
+                perror("Failed to send stream");
+            }
+            errno = send_errno;
+            return -1;
+        }
+        if (spliced > 0) {
+            conn->pipe_pending -= (size_t)sent;
+        }
+        stream_sent(conn, (size_t)sent);
+    }
+}
+
+// Copy fallback of splice_file_chunk(): reads the next piece of conn->file_fd into the chunk.
+static int produce_file(Connection *conn, void *ctx) {
+    (void)ctx;
+    size_t room;
+    char *dst = stream_buffer(conn, &room);
+    ssize_t n;
+    do {
+        n = pread(conn->file_fd, dst, room, conn->file_offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("Failed to read file");
+        return -1;
+    }
+    if (n == 0) {
+        close_file(conn);
+        return 1;
+    }
+    conn->file_offset += n;
+    stream_commit(conn, (size_t)n);
+    return 0;
+}
+
+/*
+ * Sends an open file, which the connection now owns, as a chunked body
+ * that ends wherever the file does. Returns 0, or -1 with the file closed
+ * and nothing queued.
+ */
+int stream_file(Connection *conn, int file_fd, const char *mime_type, const char *extra_headers) {
+    conn->file_fd = file_fd;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    if (stream_begin(conn, mime_type, extra_headers, produce_file, NULL, NULL) < 0) {
+        close_file(conn);
+        return -1;
+    }
+    conn->stream->splice_file = 1;
+    return 0;
+}
@@ -0,0 +1,97 @@
+// timer.c
+
+#include <stddef.h>
+#include "server.h"
+
+/*
+ * Hashed timer wheel holding one deadline per connection. Slot i lists
+ * the timers whose deadline falls in a tick congruent to i, so arming and
+ * cancelling are a list link and unlink whatever the number of
+ * connections. timer_wheel_expired() walks only the ticks that have fully
+ * passed; a timer due a whole turn or more later stays in its slot until
+ * its turn comes round. No timer costs a system call.
+ *
+ * Connections re-arm lazily: a later deadline leaves the timer where it is,
+ * and the loop recomputes the deadline when the timer fires. A busy
+ * connection therefore touches the wheel only when its deadline moves
+ * earlier, for example when it goes from proxying to keep-alive idle.
+ */
+
+void timer_wheel_init(TimerWheel *wheel, long long now_ms) {
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->tick = now_ms / TIMER_TICK_MS;
+}
+
+void timer_cancel(Timer *timer) {
+    if (timer->next != NULL) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = NULL;
+        timer->next = NULL;
+    }
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, long long deadline_ms) {
+    timer_cancel(timer);
+    long long tick = deadline_ms / TIMER_TICK_MS;
+    if (tick < wheel->tick) {
+        tick = wheel->tick;     // already due: fires with the current tick
+    }
+    Timer *head = &wheel->slots[tick % TIMER_WHEEL_SLOTS];
+    timer->deadline_ms = deadline_ms;
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// Takes one timer whose tick has passed off the wheel, or returns NULL once none is left.
+Connection *timer_wheel_expired(TimerWheel *wheel, long long now_ms) {
+    long long now_tick = now_ms / TIMER_TICK_MS;
+    while (wheel->tick < now_tick) {
+        Timer *head = &wheel->slots[wheel->tick % TIMER_WHEEL_SLOTS];
+        for (Timer *timer = head->next; timer != head; timer = timer->next) {
+            if (timer->deadline_ms / TIMER_TICK_MS <= wheel->tick) {
+                timer_cancel(timer);
+                return (Connection *)((char *)timer - offsetof(Connection, timer));
+            }
+        }
+        wheel->tick++;
+    }
+    return NULL;
+}
+
+/*
+ * When `conn` times out if nothing happens first, and what kind of timeout
+ * that is: keep-alive idle between requests, an incomplete request
+ * (answered with a 408), an upstream gone silent, or a client that stopped
+ * reading its response.
+ */
+long long connection_deadline(const Connection *conn, const Server *config, TimeoutKind *kind) {
+    if (conn->state == CONN_READING && conn->in_len == 0) {
+        *kind = TIMEOUT_IDLE;
+        return conn->last_active_ms + config->keepalive_timeout_ms;
+    }
+    if (conn->state == CONN_READING) {
+        *kind = TIMEOUT_REQUEST;
+        return conn->request_started_ms + config->request_timeout_ms;
+    }
+    if (conn->proxy != NULL && conn->proxy->fd >= 0) {
+        *kind = TIMEOUT_UPSTREAM;
+        return conn->last_active_ms + config->upstream_timeout_ms;
+    }
+    *kind = TIMEOUT_SEND;
+    return conn->last_active_ms + config->request_timeout_ms;
+}
+
+// Arms the connection's timer unless it is already due no later than the new deadline.
+void connection_schedule(TimerWheel *wheel, Connection *conn, const Server *config) {
+    TimeoutKind kind;
+    long long deadline = connection_deadline(conn, config, &kind);
+    if (conn->timer.next == NULL || deadline < conn->timer.deadline_ms) {
+        timer_arm(wheel, &conn->timer, deadline);
+    }
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# tools/gen_mime_table.py
+#
+# Prints the built-in MIME table for utils.c. It searches for a seed with
+# which mime_slot() gives every extension below a slot of its own, so a
+# lookup is one hash and one string compare. Edit BUILTIN, re-run, and
+# paste the output over the block between the markers in utils.c.
+#
+#   tools/gen_mime_table.py > /tmp/table.c
+
+BUILTIN = [
+    ("html", "text/html"),
+    ("htm", "text/html"),
+    ("css", "text/css"),
+    ("js", "application/javascript"),
+    ("mjs", "application/javascript"),
+    ("json", "application/json"),
+    ("map", "application/json"),
+    ("webmanifest", "application/manifest+json"),
+    ("xml", "application/xml"),
+    ("txt", "text/plain"),
+    ("md", "text/markdown"),
+    ("csv", "text/csv"),
+    ("svg", "image/svg+xml"),
+    ("png", "image/png"),
+    ("jpg", "image/jpeg"),
+    ("jpeg", "image/jpeg"),
+    ("gif", "image/gif"),
+    ("webp", "image/webp"),
+    ("avif", "image/avif"),
+    ("ico", "image/x-icon"),
+    ("bmp", "image/bmp"),
+    ("woff", "font/woff"),
+    ("woff2", "font/woff2"),
+    ("ttf", "font/ttf"),
+    ("otf", "font/otf"),
+    ("wasm", "application/wasm"),
+    ("pdf", "application/pdf"),
+    ("zip", "application/zip"),
+    ("gz", "application/gzip"),
+    ("tar", "application/x-tar"),
+    ("mp3", "audio/mpeg"),
+    ("ogg", "audio/ogg"),
+    ("wav", "audio/wav"),
+    ("mp4", "video/mp4"),
+    ("webm", "video/webm"),
+]
+
+SLOTS = 128
+MASK = 0xFFFFFFFF
+
+
+def mime_slot(ext, seed):
+    # Must match mime_slot() in utils.c: 32-bit FNV-1a from `seed`, with
+    # the high half folded in because the low bits ignore the seed's.
+    h = seed
+    for c in ext.encode():
+        h ^= c
+        h = (h * 16777619) & MASK
+    return (h ^ (h >> 16)) % SLOTS
+
+
+def main():
+    for seed in range(2166136261, 2166136261 + 1000000):
+        slots = {}
+        for ext, mime in BUILTIN:
+            slot = mime_slot(ext, seed)
+            if slot in slots:
+                break
+            slots[slot] = (ext, mime)
+        else:
+            print("#define MIME_SLOTS %d" % SLOTS)
+            print("#define MIME_SEED %uU" % seed)
+            print("")
+            print("static const MimeType builtin_mime_types[MIME_SLOTS] = {")
+            for slot in sorted(slots):
+                ext, mime = slots[slot]
+                print('    [%d] = {"%s", "%s"},' % (slot, ext, mime))
+            print("};")
+            return
+    raise SystemExit("no collision-free seed found; raise SLOTS")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,87 @@
+#!/bin/bash
+# tools/precompress.sh
+#
+# Writes .gz (and, when the brotli CLI is installed, .br) sidecars next to
+# the compressible files of a docroot so the server can send them without
+# compressing anything at request time. A sidecar is kept only if it
+# saves at least MIN_SAVING percent. Its mtime is copied from the source:
+# the server ignores sidecars older than the file they were made from, so
+# re-run this script after editing assets. Up-to-date sidecars are skipped.
+#
+#   tools/precompress.sh [--clean] [--min-size BYTES] [--min-saving PERCENT] DOCROOT
+
+set -euo pipefail
+
+MIN_SIZE=256
+MIN_SAVING=5
+CLEAN=0
+
+usage() {
+    echo "Usage: $0 [--clean] [--min-size BYTES] [--min-saving PERCENT] DOCROOT" >&2
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --clean) CLEAN=1; shift ;;
+        --min-size) MIN_SIZE=$2; shift 2 ;;
+        --min-saving) MIN_SAVING=$2; shift 2 ;;
+        -h|--help) usage ;;
+        -*) usage ;;
+        *) break ;;
+    esac
+done
+[ $# -eq 1 ] || usage
+DOCROOT=$1
+
+if [ "$CLEAN" -eq 1 ]; then
+    find "$DOCROOT" -type f \( -name '*.gz' -o -name '*.br' \) -print0 | while IFS= read -r -d '' sidecar; do
+        # Only remove files that are sidecars of something, not downloads.
+        if [ -f "${sidecar%.*}" ]; then
+            rm -f "$sidecar"
+        fi
+    done
+    exit 0
+fi
+
+HAVE_BROTLI=0
+if command -v brotli > /dev/null 2>&1; then
+    HAVE_BROTLI=1
+fi
+
+# compress SOURCE SUFFIX COMMAND...: writes SOURCE.SUFFIX unless it is current.
+compress() {
+    local source=$1 suffix=$2
+    shift 2
+    local sidecar="$source.$suffix"
+    if [ -f "$sidecar" ] && [ ! "$source" -nt "$sidecar" ] && [ ! "$sidecar" -nt "$source" ]; then
+        return 0
+    fi
+
+    local tmp="$sidecar.tmp.$$"
+    "$@" < "$source" > "$tmp"
+    local original compressed
+    original=$(stat -c %s "$source")
+    compressed=$(stat -c %s "$tmp")
+    if [ $((compressed * 100)) -le $((original * (100 - MIN_SAVING))) ]; then
+        touch -r "$source" "$tmp"
+        mv -f "$tmp" "$sidecar"
+        written=$((written + 1))
+    else
+        rm -f "$tmp" "$sidecar"
+    fi
+}
+
+written=0
+scanned=0
+while IFS= read -r -d '' file; do
+    scanned=$((scanned + 1))
+    compress "$file" gz gzip -9 -n -c
+    if [ "$HAVE_BROTLI" -eq 1 ]; then
+        compress "$file" br brotli -q 11 -c
+    fi
+done < <(find "$DOCROOT" -type f -size +"$((MIN_SIZE - 1))"c \
+    \( -name '*.html' -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.txt' \
+       -o -name '*.json' -o -name '*.svg' \) -print0)
+
+echo "Scanned $scanned files, wrote $written sidecars$([ "$HAVE_BROTLI" -eq 1 ] || echo ' (brotli not installed: gzip only)')"
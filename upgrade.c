@@ -0,0 +1,212 @@
+// upgrade.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "server.h"
+
+/*
+ * Hot upgrade. On SIGUSR2 the server runs its binary again with the same
+ * arguments and one end of a Unix socket pair named in UPGRADE_ENV, and
+ * sends its listening sockets down the pair (SCM_RIGHTS). The new process
+ * serves from those sockets instead of binding its own, so their accept
+ * backlogs carry over and no connection attempt is refused while both run.
+ * Once its workers are up it writes one byte back; only then does the old
+ * process stop accepting and drain. A new process that fails to start is
+ * killed and the old one keeps serving.
+ */
+
+#define UPGRADE_ENV "WEBSERVER_UPGRADE_FD"
+
+extern char **environ;
+
+static int upgrade_fd = -1;     // new process: the pair end to report readiness on
+
+/*
+ * Collects the listeners passed by the process being upgraded, up to `max`
+ * of them, into fds. Returns how many arrived, 0 when this is a normal
+ * start, or -1 if the handover failed.
+ */
+int upgrade_inherit(int *fds, int max) {
+    const char *value = getenv(UPGRADE_ENV);
+    if (value == NULL) {
+        return 0;
+    }
+    upgrade_fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    if (fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC) < 0) {
+        perror("fcntl(upgrade socket)");
+        upgrade_fd = -1;
+        return -1;
+    }
+
+    int count = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(upgrade_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)sizeof(count)) {
+        perror("recvmsg(upgrade socket)");
+        return -1;
+    }
+
+    int received = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int in_message = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < in_message; i++) {
+            if (received < max) {
+                fds[received++] = passed[i];
+            } else {
+                close(passed[i]);
+            }
+        }
+    }
+    if (received != count) {
+        log_error("Upgrade handed over fewer listeners than announced");
+    }
+    return received;
+}
+
+// Tells the process being upgraded that this one is serving; a no-op on a normal start.
+void upgrade_ready(void) {
+    if (upgrade_fd < 0) {
+        return;
+    }
+    char ready = 1;
+    if (write(upgrade_fd, &ready, 1) != 1) {
+        perror("write(upgrade socket)");
+    }
+    close(upgrade_fd);
+    upgrade_fd = -1;
+}
+
+// Waits up to UPGRADE_READY_MS for the new process's ready byte.
+static int wait_ready(int fd) {
+    long long deadline = monotonic_ms() + UPGRADE_READY_MS;
+    while (1) {
+        long long left = deadline - monotonic_ms();
+        if (left <= 0) {
+            return 0;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int rc = poll(&pfd, 1, (int)left);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return 0;
+        }
+        char ready;
+        return read(fd, &ready, 1) == 1;
+    }
+}
+
+/*
+ * Starts argv[0] as the new server and hands it the `count` listeners in
+ * fds. Returns its pid once it reports ready, or -1 with this process
+ * left serving as before.
+ */
+pid_t upgrade_spawn(char *const argv[], const int *fds, int count) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    // Everything the child needs is prepared here: after fork() it may
+    // only make async-signal-safe calls.
+    size_t env_count = 0;
+    while (environ[env_count] != NULL) {
+        env_count++;
+    }
+    char **envp = malloc(sizeof(char *) * (env_count + 2));
+    if (envp == NULL) {
+        perror("malloc failed");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    char variable[64];
+    snprintf(variable, sizeof(variable), UPGRADE_ENV "=%d", pair[1]);
+    size_t kept = 0;
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+            envp[kept++] = environ[i];
+        }
+    }
+    envp[kept++] = variable;
+    envp[kept] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The signal mask survives exec; the new server must see SIGINT.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(pair[1], F_SETFD, 0);
+        execvpe(argv[0], argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(pair[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(pair[0]);
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+
+    int ready = 0;
+    if (sendmsg(pair[0], &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg(upgrade socket)");
+    } else {
+        ready = wait_ready(pair[0]);
+    }
+    close(pair[0]);
+    if (!ready) {
+        log_error("Upgraded process did not start; keeping this one");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,895 @@
+// uring.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include "server.h"
+
+/*
+ * io_uring worker: the same request handling as the epoll loops in event.c,
+ * but every socket operation is an SQE and a whole batch of them goes to the
+ * kernel in one io_uring_enter() that also collects the completions. Each
+ * worker owns a fixed table of connection slots; slot i is both file index
+ * i in the registered file table and a span of the one registered buffer,
+ * so receives and copy-path file reads land in pinned memory without a
+ * per-operation lookup. Path resolution and open() still happen inline in
+ * prepare_response(), which the file cache mostly turns into a hash lookup.
+ */
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+// Low byte of each SQE's user_data; the slot index sits above it.
+enum {
+    OP_IGNORE,      // close, files update, cancel: nothing to do on completion
+    OP_ACCEPT,
+    OP_TIMEOUT,
+    OP_RECV,
+    OP_SEND,
+    OP_SENDMSG,
+    OP_SPLICE_IN,   // file -> pipe
+    OP_SPLICE_OUT,  // pipe -> socket
+    OP_READ         // file -> out[] when splice is refused
+};
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // SQEs filled in, published to *sq_tail on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Ring;
+
+typedef struct {
+    char buffers[IO_BUFFER_SIZE];   // conn.in and conn.out, inside the registered region
+    Connection conn;
+    int in_use;
+    int inflight;               // 1 while a socket or file operation is queued
+    uint64_t inflight_data;     // its user_data, for cancellation
+    int cancelled;
+    int closing;                // release once the in-flight operation completes
+    int timed_out;              // send a 408 once the pending receive is cancelled
+    struct iovec iov[STREAM_IOV_MAX];   // cached and streamed responses, kept alive for SENDMSG
+    struct msghdr msg;
+    int next_free;
+} UringSlot;
+
+typedef struct {
+    Ring ring;
+    const Server *config;
+    int listen_fd;
+    int multishot;              // kernel supports multishot accept
+    int fixed_buffers;          // slots[] is registered as buffer 0
+    UringSlot *slots;
+    size_t slots_size;
+    int free_slot;
+    struct __kernel_timespec sweep_interval;
+    TimerWheel timers;
+    int draining;               // retiring: accept cancelled, idle connections close
+    long long drain_deadline_ms;
+} UringLoop;
+
+static const int no_file = -1;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_exit(Ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+// Creates the ring and maps its submission and completion queues.
+static int ring_init(Ring *ring, unsigned entries, unsigned cq_entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring_exit(ring);
+        return -1;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring_exit(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring_exit(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Hands every filled-in SQE to the kernel and, with `wait`, blocks until at
+ * least one completion is ready. Returns -1 with errno set on failure.
+ */
+static int ring_submit(Ring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+    return sys_io_uring_enter(ring->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// Returns a zeroed SQE, flushing the queue first if it is full; NULL if that fails.
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (ring_submit(ring, 0) < 0 ||
+            ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/*
+ * Reports whether this kernel can run the io_uring engine: the ring must
+ * come up and every opcode the worker issues must be supported.
+ */
+int uring_available(void) {
+    static const int required[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+        IORING_OP_READ_FIXED, IORING_OP_READ, IORING_OP_CLOSE, IORING_OP_FILES_UPDATE,
+        IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL
+    };
+    Ring ring;
+    if (ring_init(&ring, 4, 8) < 0) {
+        return 0;
+    }
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    int ok = probe != NULL && sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(required) / sizeof(required[0]); i++) {
+        int op = required[i];
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    ring_exit(&ring);
+    return ok;
+}
+
+static uint64_t op_data(const UringLoop *loop, const UringSlot *slot, int op) {
+    return ((uint64_t)(slot - loop->slots) << 8) | (uint64_t)op;
+}
+
+static void queue_ignored_close(UringLoop *loop, int fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = OP_IGNORE;
+}
+
+// Points fixed file `index` at fd (-1 empties it).
+static int queue_files_update(UringLoop *loop, int index, const int *fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)fd;
+    sqe->len = 1;
+    sqe->off = (uint64_t)index;
+    sqe->user_data = OP_IGNORE;
+    return 1;
+}
+
+// Returns an SQE for the slot's next socket or file operation and marks it in flight.
+static struct io_uring_sqe *slot_sqe(UringLoop *loop, UringSlot *slot, int op) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue is full");
+        return NULL;
+    }
+    slot->inflight = 1;
+    slot->inflight_data = op_data(loop, slot, op);
+    slot->cancelled = 0;
+    sqe->user_data = slot->inflight_data;
+    return sqe;
+}
+
+// Sets up an SQE that operates on the slot's socket through the fixed file table.
+static struct io_uring_sqe *socket_sqe(UringLoop *loop, UringSlot *slot, int op, int opcode) {
+    struct io_uring_sqe *sqe = slot_sqe(loop, slot, op);
+    if (sqe != NULL) {
+        sqe->opcode = (uint8_t)opcode;
+        sqe->fd = (int)(slot - loop->slots);
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    return sqe;
+}
+
+static void release_slot(UringLoop *loop, UringSlot *slot) {
+    Connection *conn = &slot->conn;
+    if (conn->file_fd >= 0) {
+        queue_ignored_close(loop, conn->file_fd);
+        conn->file_fd = -1;
+    }
+    if (conn->pipe_fds[0] >= 0) {
+        queue_ignored_close(loop, conn->pipe_fds[0]);
+        queue_ignored_close(loop, conn->pipe_fds[1]);
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    }
+    if (conn->cached != NULL) {
+        file_cache_release(conn->cached);
+        conn->cached = NULL;
+    }
+    stream_close(conn);
+
+    // The table holds its own reference to the socket, so drop it as well.
+    int index = (int)(slot - loop->slots);
+    if (!queue_files_update(loop, index, &no_file)) {
+        struct io_uring_files_update update = {.offset = (unsigned)index, .fds = (uint64_t)(uintptr_t)&no_file};
+        sys_io_uring_register(loop->ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    }
+    queue_ignored_close(loop, conn->fd);
+    timer_cancel(&conn->timer);
+    stats_add(STAT_CONNECTIONS_CLOSED, 1);
+
+    slot->in_use = 0;
+    slot->next_free = loop->free_slot;
+    loop->free_slot = index;
+}
+
+// Asks the kernel to complete the slot's in-flight operation early.
+static void cancel_inflight(UringLoop *loop, UringSlot *slot) {
+    if (slot->cancelled) {
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = slot->inflight_data;
+        sqe->user_data = OP_IGNORE;
+        slot->cancelled = 1;
+    }
+}
+
+// Closes the connection now, or once its in-flight operation has been cancelled.
+static void close_slot(UringLoop *loop, UringSlot *slot) {
+    if (!slot->inflight) {
+        release_slot(loop, slot);
+        return;
+    }
+    slot->closing = 1;
+    cancel_inflight(loop, slot);
+}
+
+static void queue_recv(UringLoop *loop, UringSlot *slot) {
+    Connection *conn = &slot->conn;
+    char *dst = conn->in + conn->in_len;
+    size_t room = BUFFER_SIZE - 1 - conn->in_len;
+    struct io_uring_sqe *sqe = socket_sqe(loop, slot, OP_RECV,
+                                          loop->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_RECV);
+    if (sqe == NULL) {
+        close_slot(loop, slot);
+        return;
+    }
+    sqe->addr = (uint64_t)(uintptr_t)dst;
+    sqe->len = (unsigned)room;
+    if (loop->fixed_buffers) {
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = 0;
+    }
+}
+
+// Queues the bytes waiting in the connection's pipe for the socket; 0 if the SQ is full.
+static int queue_splice_out(UringLoop *loop, UringSlot *slot) {
+    Connection *conn = &slot->conn;
+    struct io_uring_sqe *sqe = socket_sqe(loop, slot, OP_SPLICE_OUT, IORING_OP_SPLICE);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->off = (uint64_t)-1;
+    sqe->len = (unsigned)conn->pipe_pending;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return 1;
+}
+
+/*
+ * Queues the next piece of the slot's response: the next frame of a
+ * stream, pending header bytes, the cached body, file data through the
+ * splice pipe (or a read into out[]), multipart boundaries, and finally
+ * the next request or the close.
+ */
+static void advance(UringLoop *loop, UringSlot *slot) {
+    Connection *conn = &slot->conn;
+    const Server *config = loop->config;
+    struct io_uring_sqe *sqe;
+
+    while (1) {
+        if (conn->state == CONN_READING) {
+            if (!request_buffered(conn, config)) {
+                queue_recv(loop, slot);
+                return;
+            }
+            prepare_response(conn, config);
+        }
+
+        // A stream sends its header with the first chunk.
+        if (conn->stream != NULL) {
+            if (stream_spliced(conn) > 0) {
+                if (!queue_splice_out(loop, slot)) {
+                    break;
+                }
+                return;
+            }
+            int iovcnt = stream_iov(conn, slot->iov);
+            if (iovcnt < 0) {
+                break;
+            }
+            if (iovcnt > 0) {
+                memset(&slot->msg, 0, sizeof(slot->msg));
+                slot->msg.msg_iov = slot->iov;
+                slot->msg.msg_iovlen = (size_t)iovcnt;
+                sqe = socket_sqe(loop, slot, OP_SENDMSG, IORING_OP_SENDMSG);
+                if (sqe == NULL) {
+                    break;
+                }
+                sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL | (stream_more(conn) ? MSG_MORE : 0);
+                return;
+            }
+            stream_close(conn);
+        }
+
+        if (conn->out_sent < conn->out_len) {
+            int more = conn->file_remaining > 0 || conn->range_count > 1;
+            sqe = socket_sqe(loop, slot, OP_SEND, IORING_OP_SEND);
+            if (sqe == NULL) {
+                break;
+            }
+            sqe->addr = (uint64_t)(uintptr_t)(conn->out + conn->out_sent);
+            sqe->len = (unsigned)(conn->out_len - conn->out_sent);
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            return;
+        }
+        conn->out_len = 0;
+        conn->out_sent = 0;
+
+        if (conn->cached != NULL) {
+            FileCacheEntry *entry = conn->cached;
+            size_t total = entry->header_len[conn->keep_alive] + DATE_LINE_LEN + entry->body_len;
+            if (conn->cached_sent < total) {
+                int iovcnt = cached_response_iov(conn, slot->iov);
+                memset(&slot->msg, 0, sizeof(slot->msg));
+                slot->msg.msg_iov = slot->iov;
+                slot->msg.msg_iovlen = (size_t)iovcnt;
+                sqe = socket_sqe(loop, slot, OP_SENDMSG, IORING_OP_SENDMSG);
+                if (sqe == NULL) {
+                    break;
+                }
+                sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                return;
+            }
+            file_cache_release(entry);
+            conn->cached = NULL;
+            conn->cached_sent = 0;
+        }
+
+        if (conn->pipe_pending > 0) {
+            if (!queue_splice_out(loop, slot)) {
+                break;
+            }
+            return;
+        }
+
+        if (conn->file_fd >= 0 && conn->file_remaining > 0) {
+            if (!conn->copy_fallback && conn->pipe_fds[0] < 0 &&
+                pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+                conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+                conn->copy_fallback = 1;
+            }
+            if (!conn->copy_fallback) {
+                size_t count = conn->file_remaining > SPLICE_CHUNK ? SPLICE_CHUNK : (size_t)conn->file_remaining;
+                sqe = slot_sqe(loop, slot, OP_SPLICE_IN);
+                if (sqe == NULL) {
+                    break;
+                }
+                sqe->opcode = IORING_OP_SPLICE;
+                sqe->fd = conn->pipe_fds[1];
+                sqe->off = (uint64_t)-1;
+                sqe->splice_fd_in = conn->file_fd;
+                sqe->splice_off_in = (uint64_t)conn->file_offset;
+                sqe->len = (unsigned)count;
+                sqe->splice_flags = SPLICE_F_MOVE;
+                return;
+            }
+            size_t count = conn->file_remaining > (off_t)BUFFER_SIZE ? BUFFER_SIZE
+                                                                            : (size_t)conn->file_remaining;
+            sqe = slot_sqe(loop, slot, OP_READ);
+            if (sqe == NULL) {
+                break;
+            }
+            sqe->opcode = loop->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = conn->file_fd;
+            sqe->addr = (uint64_t)(uintptr_t)conn->out;
+            sqe->len = (unsigned)count;
+            sqe->off = (uint64_t)conn->file_offset;
+            return;
+        }
+
+        if (queue_next_range_part(conn)) {
+            continue;
+        }
+
+        // Response complete.
+        if (conn->file_fd >= 0) {
+            queue_ignored_close(loop, conn->file_fd);
+            conn->file_fd = -1;
+        }
+        conn->file_remaining = 0;
+        conn->range_count = 0;
+        if (!finish_response(conn, config)) {
+            break;
+        }
+    }
+    close_slot(loop, slot);
+}
+
+static void schedule_slot(UringLoop *loop, UringSlot *slot) {
+    if (slot->in_use && !slot->closing) {
+        connection_schedule(&loop->timers, &slot->conn, loop->config);
+    }
+}
+
+static void accept_connection(UringLoop *loop, int client_fd) {
+    if (loop->free_slot < 0) {
+        log_error("io_uring worker is at its connection limit; refusing client");
+        close(client_fd);
+        return;
+    }
+    int index = loop->free_slot;
+    UringSlot *slot = &loop->slots[index];
+    loop->free_slot = slot->next_free;
+
+    connection_init(&slot->conn, client_fd, loop->config);
+    slot->conn.in = slot->buffers;
+    slot->conn.out = slot->buffers + BUFFER_SIZE;
+    slot->in_use = 1;
+    slot->inflight = 0;
+    slot->cancelled = 0;
+    slot->closing = 0;
+    slot->timed_out = 0;
+
+    // The first receive is submitted behind the registration, in order.
+    if (!queue_files_update(loop, index, &slot->conn.fd)) {
+        release_slot(loop, slot);
+        return;
+    }
+    advance(loop, slot);
+    schedule_slot(loop, slot);
+}
+
+static void queue_accept(UringLoop *loop) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        log_error("Failed to queue accept on io_uring");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    // Left blocking: io_uring polls for readiness itself, but hands EAGAIN
+    // straight back for O_NONBLOCK files on some operations (splice).
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void queue_sweep(UringLoop *loop) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->sweep_interval;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+}
+
+// Completes when the pool writes the worker's wake eventfd, so a stop
+// command ends the wait at once instead of at the next sweep.
+static void queue_wake_poll(UringLoop *loop, int wake_fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL || wake_fd < 0) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_IGNORE;
+}
+
+// The epoll loop's expire_timers(), with cancellation of the in-flight operation.
+static void expire_timers(UringLoop *loop) {
+    long long now = monotonic_ms();
+    Connection *conn;
+    while ((conn = timer_wheel_expired(&loop->timers, now)) != NULL) {
+        UringSlot *slot = (UringSlot *)((char *)conn - offsetof(UringSlot, conn));
+        if (slot->closing || slot->timed_out) {
+            continue;
+        }
+        TimeoutKind kind;
+        long long deadline = connection_deadline(conn, loop->config, &kind);
+        if (deadline > now) {
+            timer_arm(&loop->timers, &conn->timer, deadline);
+            continue;
+        }
+        stats_add(STAT_TIMEOUTS + kind, 1);
+        if (kind != TIMEOUT_REQUEST) {
+            close_slot(loop, slot);
+        } else if (slot->inflight) {
+            // The 408 goes out once the pending receive has been cancelled.
+            slot->timed_out = 1;
+            cancel_inflight(loop, slot);
+        } else {
+            prepare_timeout_response(conn);
+            advance(loop, slot);
+            schedule_slot(loop, slot);
+        }
+    }
+}
+
+static void complete(UringLoop *loop, UringSlot *slot, int op, int res) {
+    Connection *conn = &slot->conn;
+    slot->inflight = 0;
+    if (slot->closing) {
+        release_slot(loop, slot);
+        return;
+    }
+    conn->last_active_ms = monotonic_ms();
+
+    if (slot->timed_out) {
+        slot->timed_out = 0;
+        prepare_timeout_response(conn);
+        advance(loop, slot);
+        return;
+    }
+
+    if (res < 0) {
+        errno = -res;
+        if (op == OP_SPLICE_IN && zero_copy_refused(errno)) {
+            conn->copy_fallback = 1;
+            advance(loop, slot);
+            return;
+        }
+        if (op == OP_SPLICE_IN || op == OP_READ) {
+            perror("Failed to read file");
+            log_error("Failed to read file");
+        } else if (op != OP_RECV && errno != EPIPE && errno != ECONNRESET) {
+            log_error("Failed to send response");
+        }
+        close_slot(loop, slot);
+        return;
+    }
+
+    switch (op) {
+    case OP_RECV:
+        if (res == 0) {
+            close_slot(loop, slot);
+            return;
+        }
+        if (conn->in_len == 0) {
+            conn->request_started_ms = conn->last_active_ms;
+            conn->request_started_ns = monotonic_ns();
+        }
+        conn->in_len += (size_t)res;
+        conn->in[conn->in_len] = '\0';
+        break;
+    case OP_SEND:
+        conn->out_sent += (size_t)res;
+        break;
+    case OP_SENDMSG:
+        if (conn->stream != NULL) {
+            stream_sent(conn, (size_t)res);
+        } else {
+            conn->cached_sent += (size_t)res;
+        }
+        break;
+    case OP_SPLICE_OUT:
+        conn->pipe_pending -= (size_t)res;
+        if (conn->stream != NULL) {
+            stream_sent(conn, (size_t)res);
+        }
+        break;
+    case OP_SPLICE_IN:
+    case OP_READ:
+        if (res == 0) {
+            log_error("File shrank while being sent");
+            close_slot(loop, slot);
+            return;
+        }
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        if (op == OP_SPLICE_IN) {
+            conn->pipe_pending = (size_t)res;
+        } else {
+            conn->out_len = (size_t)res;
+            conn->out_sent = 0;
+        }
+        break;
+    }
+    advance(loop, slot);
+}
+
+static void reap(UringLoop *loop) {
+    Ring *ring = &loop->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+        // Free the entry before handling it; handlers may flush the SQ.
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        int op = (int)(data & 0xff);
+        switch (op) {
+        case OP_IGNORE:
+            break;
+        case OP_ACCEPT:
+            if (res >= 0) {
+                accept_connection(loop, res);
+            } else if (res == -EINVAL && loop->multishot) {
+                loop->multishot = 0;
+            } else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED && res != -ECANCELED) {
+                errno = -res;
+                perror("accept");
+            }
+            if (!(flags & IORING_CQE_F_MORE) && !loop->draining) {
+                queue_accept(loop);
+            }
+            break;
+        case OP_TIMEOUT:
+            queue_sweep(loop);
+            break;
+        default:
+            complete(loop, &loop->slots[data >> 8], op, res);
+            schedule_slot(loop, &loop->slots[data >> 8]);
+            break;
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+// The epoll loop's start_draining(): the pending accept is cancelled, leaving the listener to others.
+static void start_draining(UringLoop *loop) {
+    loop->draining = 1;
+    loop->drain_deadline_ms = monotonic_ms() + loop->config->drain_timeout_ms;
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = OP_ACCEPT;
+        sqe->user_data = OP_IGNORE;
+    }
+}
+
+// Closes connections waiting for a request, or all of them past the deadline. Returns how many remain.
+static int close_drained_slots(UringLoop *loop) {
+    long long now = monotonic_ms();
+    int expired = now >= loop->drain_deadline_ms;
+    int remaining = 0;
+    for (int i = 0; i < URING_MAX_CONNECTIONS; i++) {
+        UringSlot *slot = &loop->slots[i];
+        if (!slot->in_use) {
+            continue;
+        }
+        Connection *conn = &slot->conn;
+        conn->last_request = 1;
+        if (!slot->closing && (expired || (conn->state == CONN_READING && conn->in_len == 0 &&
+                                           now - conn->last_active_ms >= DRAIN_IDLE_MS))) {
+            close_slot(loop, slot);
+        }
+        remaining += slot->in_use;
+    }
+    return remaining;
+}
+
+// Registers the connection slots as fixed files and as one fixed buffer.
+static int uring_loop_init(UringLoop *loop, Worker *worker) {
+    memset(loop, 0, sizeof(*loop));
+    loop->config = worker->config;
+    loop->listen_fd = worker->listen_fd;
+    loop->multishot = 1;
+    loop->sweep_interval.tv_sec = SWEEP_INTERVAL_MS / 1000;
+    loop->sweep_interval.tv_nsec = (SWEEP_INTERVAL_MS % 1000) * 1000000LL;
+    timer_wheel_init(&loop->timers, monotonic_ms());
+
+    if (ring_init(&loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    loop->slots_size = sizeof(UringSlot) * URING_MAX_CONNECTIONS;
+    loop->slots = mmap(NULL, loop->slots_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->slots == MAP_FAILED) {
+        perror("mmap");
+        ring_exit(&loop->ring);
+        return -1;
+    }
+    loop->free_slot = -1;
+    for (int i = URING_MAX_CONNECTIONS - 1; i >= 0; i--) {
+        loop->slots[i].next_free = loop->free_slot;
+        loop->free_slot = i;
+    }
+
+    int *files = malloc(sizeof(int) * URING_MAX_CONNECTIONS);
+    if (files == NULL) {
+        log_error("Failed to allocate io_uring file table");
+        munmap(loop->slots, loop->slots_size);
+        ring_exit(&loop->ring);
+        return -1;
+    }
+    for (int i = 0; i < URING_MAX_CONNECTIONS; i++) {
+        files[i] = -1;
+    }
+    int rc = sys_io_uring_register(loop->ring.fd, IORING_REGISTER_FILES, files, URING_MAX_CONNECTIONS);
+    free(files);
+    if (rc < 0) {
+        perror("io_uring_register(files)");
+        munmap(loop->slots, loop->slots_size);
+        ring_exit(&loop->ring);
+        return -1;
+    }
+
+    // Pinned memory counts against RLIMIT_MEMLOCK; plain receives work without it.
+    struct iovec region = {.iov_base = loop->slots, .iov_len = loop->slots_size};
+    if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, &region, 1) == 0) {
+        loop->fixed_buffers = 1;
+    } else {
+        perror("io_uring_register(buffers)");
+        log_error("Failed to register io_uring buffers; continuing with plain receives");
+    }
+    return 0;
+}
+
+void *uring_worker_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    worker_pin(worker);
+
+    UringLoop loop;
+    if (uring_loop_init(&loop, worker) < 0) {
+        log_error("Failed to start io_uring worker; falling back to epoll");
+        return worker_thread(arg);
+    }
+
+    queue_accept(&loop);
+    queue_sweep(&loop);
+    queue_wake_poll(&loop, worker->wake_fd);
+    long long woke_ns = monotonic_ns();
+    while (1) {
+        unsigned long long busy_ns = (unsigned long long)(monotonic_ns() - woke_ns);
+        stats_add(STAT_BUSY_NS, busy_ns);
+        __atomic_store_n(&worker->busy_ns, worker->busy_ns + busy_ns, __ATOMIC_RELAXED);
+        if (ring_submit(&loop.ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            log_error("io_uring worker failed");
+            break;
+        }
+        woke_ns = monotonic_ns();
+        reap(&loop);
+        expire_timers(&loop);
+        // The wake poll or, failing that, the sweep timer brings us here
+        // after a command. Only a shutdown retires io_uring workers.
+        int command = __atomic_load_n(&worker->command, __ATOMIC_ACQUIRE);
+        if (command == WORKER_STOP) {
+            break;
+        }
+        if (command == WORKER_RETIRE) {
+            if (!loop.draining) {
+                start_draining(&loop);
+            }
+            if (close_drained_slots(&loop) == 0) {
+                break;
+            }
+        }
+    }
+
+    munmap(loop.slots, loop.slots_size);
+    ring_exit(&loop.ring);
+    bundle_thread_release();
+    __atomic_store_n(&worker->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
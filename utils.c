@@ -1,112 +1,634 @@
-// utils.c
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
-#include <limits.h>
-#include <sys/stat.h>
-#include "server.h"
-
-void parse_arguments(int argc, char *argv[], Server *config) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <filename> [port] [core_count] [num_threads] [docroot]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    const char *default_file_arg = argv[1];
-    while (*default_file_arg == '/') {
-        default_file_arg++;
-    }
-
-    if (*default_file_arg == '\0') {
-        fprintf(stderr, "Default file must not be empty\n");
-        exit(EXIT_FAILURE);
-    }
-
-    size_t default_len = strlen(default_file_arg);
-    config->file = malloc(default_len + 1);
-    if (config->file == NULL) {
-        perror("Failed to allocate memory for default file path");
-        exit(EXIT_FAILURE);
-    }
-    memcpy(config->file, default_file_arg, default_len + 1);
-
-    if (argc > 2) {
-        char *endptr;
-        errno = 0;
-        long port = strtol(argv[2], &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || port < 1 || port > 65535) {
-            fprintf(stderr, "Invalid port number: %s\n", argv[2]);
-            exit(EXIT_FAILURE);
-        }
-        config->port = (int)port;
-    } else {
-        config->port = DEFAULT_PORT;
-    }
-
-    if (argc > 3) {
-        char *endptr;
-        errno = 0;
-        long cores = strtol(argv[3], &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || cores <= 0) {
-            fprintf(stderr, "Invalid core count: %s\n", argv[3]);
-            exit(EXIT_FAILURE);
-        }
-        config->core_count = (int)cores;
-    } else {
-        config->core_count = 16;
-    }
-
-    if (argc > 4) {
-        char *endptr;
-        errno = 0;
-        long threads = strtol(argv[4], &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || threads <= 0) {
-            fprintf(stderr, "Invalid thread count: %s\n", argv[4]);
-            exit(EXIT_FAILURE);
-        }
-        config->num_threads = (int)threads;
-    } else {
-        config->num_threads = NUM_THREADS;
-    }
-
-    if (argc > 5) {
-        char *endptr;
-        errno = 0;
-        long timeout = strtol(argv[5], &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || timeout <= 0) {
-            fprintf(stderr, "Invalid request timeout: %s\n", argv[5]);
-            exit(EXIT_FAILURE);
-        }
-        config->request_timeout_ms = (int)timeout;
-    }
-
-    if (argc > 6) {
-        char *endptr;
-        errno = 0;
-        long max_size = strtol(argv[6], &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || max_size <= 0) {
-            fprintf(stderr, "Invalid max request line size: %s\n", argv[6]);
-            exit(EXIT_FAILURE);
-        }
-        config->max_request_line_size = (size_t)max_size;
-    }
-}
-
-const char* get_mime_type(const char *filename) {
-    const char *ext = strrchr(filename, '.');
-    if (!ext) return "application/octet-stream";    
-    ext++;
-    
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) return "text/html";
-    if (strcmp(ext, "css") == 0) return "text/css";
-    if (strcmp(ext, "js") == 0) return "application/javascript";
-    if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, "png") == 0) return "image/png";
-    if (strcmp(ext, "gif") == 0) return "image/gif";
-    if (strcmp(ext, "txt") == 0) return "text/plain";
-    // ...
-
-    return "application/octet-stream";
-}
+// utils.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "server.h"
+
+enum {
+    OPT_KEEPALIVE_REQUESTS = 1,
+    OPT_KEEPALIVE_TIMEOUT,
+    OPT_CACHE_SIZE,
+    OPT_CACHE_MAX_FILE,
+    OPT_REUSEPORT,
+    OPT_ACCESS_LOG,
+    OPT_MAX_AGE,
+    OPT_IO_URING,
+    OPT_MIME_TYPES,
+    OPT_STATS_PATH,
+    OPT_NO_STATS,
+    OPT_MIN_THREADS,
+    OPT_MAX_THREADS,
+    OPT_CODEL_TARGET,
+    OPT_RATE_LIMIT,
+    OPT_RATE_BURST,
+    OPT_UPSTREAM,
+    OPT_UPSTREAM_TIMEOUT,
+    OPT_DRAIN_TIMEOUT,
+    OPT_BUNDLE,
+    OPT_PACK,
+    OPT_AUTOINDEX
+};
+
+static const struct option long_options[] = {
+    {"keepalive-requests", required_argument, NULL, OPT_KEEPALIVE_REQUESTS},
+    {"keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT},
+    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+    {"cache-max-file", required_argument, NULL, OPT_CACHE_MAX_FILE},
+    {"reuseport", no_argument, NULL, OPT_REUSEPORT},
+    {"access-log", no_argument, NULL, OPT_ACCESS_LOG},
+    {"max-age", required_argument, NULL, OPT_MAX_AGE},
+    {"io-uring", no_argument, NULL, OPT_IO_URING},
+    {"mime-types", required_argument, NULL, OPT_MIME_TYPES},
+    {"stats-path", required_argument, NULL, OPT_STATS_PATH},
+    {"no-stats", no_argument, NULL, OPT_NO_STATS},
+    {"min-threads", required_argument, NULL, OPT_MIN_THREADS},
+    {"max-threads", required_argument, NULL, OPT_MAX_THREADS},
+    {"codel-target", required_argument, NULL, OPT_CODEL_TARGET},
+    {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+    {"rate-burst", required_argument, NULL, OPT_RATE_BURST},
+    {"upstream", required_argument, NULL, OPT_UPSTREAM},
+    {"upstream-timeout", required_argument, NULL, OPT_UPSTREAM_TIMEOUT},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"bundle", required_argument, NULL, OPT_BUNDLE},
+    {"pack", required_argument, NULL, OPT_PACK},
+    {"autoindex", no_argument, NULL, OPT_AUTOINDEX},
+    {NULL, 0, NULL, 0}
+};
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <filename> [port] [core_count] [num_threads] [request_timeout_ms] [max_request_line_size] [docroot]\n", program);
+    fprintf(stderr, "       %s --pack=BUNDLE [--mime-types=FILE] <docroot>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --keepalive-requests=N   requests served per connection before closing (default %d)\n", DEFAULT_KEEPALIVE_MAX_REQUESTS);
+    fprintf(stderr, "  --keepalive-timeout=MS   idle time before a persistent connection is closed (default %d)\n", DEFAULT_KEEPALIVE_TIMEOUT_MS);
+    fprintf(stderr, "  --cache-size=BYTES       memory for cached files, K/M/G suffixes allowed, 0 disables (default %d)\n", DEFAULT_CACHE_SIZE);
+    fprintf(stderr, "  --cache-max-file=BYTES   largest file kept in the cache (default %d)\n", DEFAULT_CACHE_MAX_FILE);
+    fprintf(stderr, "  --reuseport              one SO_REUSEPORT listener per worker, pinned across core_count cores\n");
+    fprintf(stderr, "  --access-log             record each response in connect.log\n");
+    fprintf(stderr, "  --max-age=SECONDS        Cache-Control max-age for served files (default %d)\n", DEFAULT_MAX_AGE);
+    fprintf(stderr, "  --io-uring               io_uring workers instead of epoll, when the kernel supports them\n");
+    fprintf(stderr, "  --mime-types=FILE        extra extension to Content-Type map in mime.types format\n");
+    fprintf(stderr, "  --stats-path=PATH        request target that returns Prometheus metrics (default %s)\n", DEFAULT_STATS_PATH);
+    fprintf(stderr, "  --no-stats               do not answer the stats path; it is served from the docroot\n");
+    fprintf(stderr, "  --min-threads=N          fewest workers the pool shrinks to when idle (default num_threads)\n");
+    fprintf(stderr, "  --max-threads=N          most workers the pool grows to under load (default num_threads)\n");
+    fprintf(stderr, "  --codel-target=MS        queue delay that sheds clients with 503 once sustained, 0 disables (default %d)\n", DEFAULT_CODEL_TARGET_MS);
+    fprintf(stderr, "  --rate-limit=N           requests per second per client address, 0 disables (default 0)\n");
+    fprintf(stderr, "  --rate-burst=N           requests a client may send at once before --rate-limit applies (default: the rate)\n");
+    fprintf(stderr, "  --upstream=HOST:PORT     proxy requests to this backend instead of serving files; repeat for more\n");
+    fprintf(stderr, "  --upstream-timeout=MS    upstream silence before a 504 or a cut-off response (default %d)\n", DEFAULT_UPSTREAM_TIMEOUT_MS);
+    fprintf(stderr, "  --drain-timeout=MS       on SIGINT/SIGTERM or an upgrade, time left for open connections (default %d)\n", DEFAULT_DRAIN_TIMEOUT_MS);
+    fprintf(stderr, "  --bundle=FILE            serve a docroot packed with --pack instead of the file system; SIGHUP reloads it\n");
+    fprintf(stderr, "  --pack=BUNDLE            write <docroot> into BUNDLE and exit\n");
+    fprintf(stderr, "  --autoindex              list the contents of requested directories\n");
+}
+
+static long parse_positive(const char *value, const char *what) {
+    char *endptr;
+    errno = 0;
+    long parsed = strtol(value, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || parsed <= 0 || parsed > INT_MAX) {
+        fprintf(stderr, "Invalid %s: %s\n", what, value);
+        exit(EXIT_FAILURE);
+    }
+    return parsed;
+}
+
+static long parse_non_negative(const char *value, const char *what) {
+    return strcmp(value, "0") == 0 ? 0 : parse_positive(value, what);
+}
+
+// Parses a byte count with an optional K, M or G suffix; zero is allowed.
+static size_t parse_size(const char *value, const char *what) {
+    char *endptr;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &endptr, 10);
+    unsigned long long scale = 1;
+    switch (*endptr) {
+    case 'K': case 'k': scale = 1024ULL; endptr++; break;
+    case 'M': case 'm': scale = 1024ULL * 1024; endptr++; break;
+    case 'G': case 'g': scale = 1024ULL * 1024 * 1024; endptr++; break;
+    }
+    if (errno != 0 || *endptr != '\0' || value[0] == '-' || endptr == value ||
+        parsed > (unsigned long long)SIZE_MAX / scale) {
+        fprintf(stderr, "Invalid %s: %s\n", what, value);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)(parsed * scale);
+}
+
+static void add_upstream(Server *config, const char *address) {
+    Upstream *grown = realloc(config->upstreams, sizeof(Upstream) * (size_t)(config->upstream_count + 1));
+    if (grown == NULL) {
+        perror("Failed to allocate upstream list");
+        exit(EXIT_FAILURE);
+    }
+    config->upstreams = grown;
+    Upstream *upstream = &grown[config->upstream_count];
+    memset(upstream, 0, sizeof(*upstream));
+    if (strlen(address) >= sizeof(upstream->name)) {
+        fprintf(stderr, "Invalid upstream: %s (name too long)\n", address);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(upstream->name, address);
+    if (upstream_resolve(upstream) < 0) {
+        fprintf(stderr, "Invalid upstream: %s (expected HOST:PORT)\n", address);
+        exit(EXIT_FAILURE);
+    }
+    config->upstream_count++;
+}
+
+void parse_arguments(int argc, char *argv[], Server *config) {
+    const char *program = argv[0];
+
+    config->keepalive_max_requests = DEFAULT_KEEPALIVE_MAX_REQUESTS;
+    config->keepalive_timeout_ms = DEFAULT_KEEPALIVE_TIMEOUT_MS;
+    config->cache_size = DEFAULT_CACHE_SIZE;
+    config->cache_max_file = DEFAULT_CACHE_MAX_FILE;
+    config->reuseport = 0;
+    config->access_log = 0;
+    config->io_uring = 0;
+    config->mime_types = NULL;
+    config->stats_path = DEFAULT_STATS_PATH;
+    config->min_threads = 0;
+    config->max_threads = 0;
+    config->codel_target_ms = DEFAULT_CODEL_TARGET_MS;
+    config->rate_limit = 0;
+    config->rate_burst = 0;
+    config->upstreams = NULL;
+    config->upstream_count = 0;
+    config->upstream_timeout_ms = DEFAULT_UPSTREAM_TIMEOUT_MS;
+    config->drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+    config->argv = argv;
+    config->bundle_path = NULL;
+    config->pack_path = NULL;
+    config->autoindex = 0;
+    long max_age = DEFAULT_MAX_AGE;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_KEEPALIVE_REQUESTS:
+            config->keepalive_max_requests = (int)parse_positive(optarg, "keep-alive request limit");
+            break;
+        case OPT_KEEPALIVE_TIMEOUT:
+            config->keepalive_timeout_ms = (int)parse_positive(optarg, "keep-alive timeout");
+            break;
+        case OPT_CACHE_SIZE:
+            config->cache_size = parse_size(optarg, "cache size");
+            break;
+        case OPT_CACHE_MAX_FILE:
+            config->cache_max_file = parse_size(optarg, "cache max file size");
+            break;
+        case OPT_REUSEPORT:
+            config->reuseport = 1;
+            break;
+        case OPT_ACCESS_LOG:
+            config->access_log = 1;
+            break;
+        case OPT_MAX_AGE:
+            max_age = parse_non_negative(optarg, "max-age");
+            break;
+        case OPT_IO_URING:
+            config->io_uring = 1;
+            break;
+        case OPT_MIME_TYPES:
+            config->mime_types = optarg;
+            break;
+        case OPT_STATS_PATH:
+            if (optarg[0] != '/') {
+                fprintf(stderr, "Invalid stats path: %s (must start with /)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            config->stats_path = optarg;
+            break;
+        case OPT_NO_STATS:
+            config->stats_path = NULL;
+            break;
+        case OPT_MIN_THREADS:
+            config->min_threads = (int)parse_positive(optarg, "minimum thread count");
+            break;
+        case OPT_MAX_THREADS:
+            config->max_threads = (int)parse_positive(optarg, "maximum thread count");
+            break;
+        case OPT_CODEL_TARGET:
+            config->codel_target_ms = (int)parse_non_negative(optarg, "CoDel target");
+            break;
+        case OPT_RATE_LIMIT:
+            config->rate_limit = (int)parse_non_negative(optarg, "rate limit");
+            break;
+        case OPT_RATE_BURST:
+            config->rate_burst = (int)parse_positive(optarg, "rate burst");
+            break;
+        case OPT_UPSTREAM:
+            add_upstream(config, optarg);
+            break;
+        case OPT_UPSTREAM_TIMEOUT:
+            config->upstream_timeout_ms = (int)parse_positive(optarg, "upstream timeout");
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            config->drain_timeout_ms = (int)parse_non_negative(optarg, "drain timeout");
+            break;
+        case OPT_BUNDLE:
+            config->bundle_path = optarg;
+            break;
+        case OPT_PACK:
+            config->pack_path = optarg;
+            break;
+        case OPT_AUTOINDEX:
+            config->autoindex = 1;
+            break;
+        default:
+            usage(program);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config->rate_burst == 0) {
+        config->rate_burst = config->rate_limit;
+    }
+    snprintf(config->cache_control, sizeof(config->cache_control), "public, max-age=%ld", max_age);
+
+    // Positional arguments keep their historical numbering from argv[1].
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (config->pack_path != NULL) {
+        if (argc != 2) {
+            usage(program);
+            exit(EXIT_FAILURE);
+        }
+        config->docroot = realpath(argv[1], NULL);
+        if (config->docroot == NULL) {
+            fprintf(stderr, "Invalid docroot: %s (%s)\n", argv[1], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    if (argc < 2) {
+        usage(program);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *default_file_arg = argv[1];
+    while (*default_file_arg == '/') {
+        default_file_arg++;
+    }
+
+    if (*default_file_arg == '\0') {
+        fprintf(stderr, "Default file must not be empty\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t default_len = strlen(default_file_arg);
+    config->file = malloc(default_len + 1);
+    if (config->file == NULL) {
+        perror("Failed to allocate memory for default file path");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(config->file, default_file_arg, default_len + 1);
+
+    if (argc > 2) {
+        char *endptr;
+        errno = 0;
+        long port = strtol(argv[2], &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid port number: %s\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        config->port = (int)port;
+    } else {
+        config->port = DEFAULT_PORT;
+    }
+
+    if (argc > 3) {
+        char *endptr;
+        errno = 0;
+        long cores = strtol(argv[3], &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || cores <= 0) {
+            fprintf(stderr, "Invalid core count: %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        config->core_count = (int)cores;
+    } else {
+        config->core_count = 16;
+    }
+
+    if (argc > 4) {
+        char *endptr;
+        errno = 0;
+        long threads = strtol(argv[4], &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || threads <= 0) {
+            fprintf(stderr, "Invalid thread count: %s\n", argv[4]);
+            exit(EXIT_FAILURE);
+        }
+        config->num_threads = (int)threads;
+    } else {
+        config->num_threads = NUM_THREADS;
+    }
+
+    // num_threads is where the pool starts; the bounds default to it.
+    if (config->min_threads == 0) {
+        config->min_threads = (config->max_threads != 0 && config->max_threads < config->num_threads)
+                                  ? config->max_threads : config->num_threads;
+    }
+    if (config->max_threads == 0) {
+        config->max_threads = config->num_threads > config->min_threads ? config->num_threads : config->min_threads;
+    }
+    if (config->min_threads > config->max_threads) {
+        fprintf(stderr, "Invalid thread bounds: --min-threads=%d exceeds --max-threads=%d\n",
+                config->min_threads, config->max_threads);
+        exit(EXIT_FAILURE);
+    }
+    if (config->num_threads < config->min_threads) {
+        config->num_threads = config->min_threads;
+    } else if (config->num_threads > config->max_threads) {
+        config->num_threads = config->max_threads;
+    }
+
+    if (argc > 5) {
+        char *endptr;
+        errno = 0;
+        long timeout = strtol(argv[5], &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || timeout <= 0) {
+            fprintf(stderr, "Invalid request timeout: %s\n", argv[5]);
+            exit(EXIT_FAILURE);
+        }
+        config->request_timeout_ms = (int)timeout;
+    } else {
+        config->request_timeout_ms = DEFAULT_REQUEST_TIMEOUT_MS;
+    }
+
+    if (argc > 6) {
+        char *endptr;
+        errno = 0;
+        long max_size = strtol(argv[6], &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || max_size <= 0) {
+            fprintf(stderr, "Invalid max request line size: %s\n", argv[6]);
+            exit(EXIT_FAILURE);
+        }
+        // Anything longer could never arrive whole in the connection buffer.
+        if (max_size > MAX_REQUEST_LINE_LIMIT) {
+            fprintf(stderr, "Max request line size %ld exceeds the %d-byte request buffer; using %d\n",
+                    max_size, BUFFER_SIZE, MAX_REQUEST_LINE_LIMIT);
+            max_size = MAX_REQUEST_LINE_LIMIT;
+        }
+        config->max_request_line_size = (size_t)max_size;
+    } else {
+        config->max_request_line_size = DEFAULT_MAX_REQUEST_LINE_SIZE;
+    }
+
+    // Resolved once so request paths can be checked for containment with a
+    // plain prefix comparison against realpath() results.
+    const char *docroot_arg = (argc > 7) ? argv[7] : DEFAULT_DOCROOT;
+    config->docroot = realpath(docroot_arg, NULL);
+    if (config->docroot == NULL) {
+        fprintf(stderr, "Invalid docroot: %s (%s)\n", docroot_arg, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} MimeType;
+
+#define MIME_EXT_MAX 16
+
+// Generated by tools/gen_mime_table.py; edit the list there, not here.
+// --- begin generated MIME table ---
+#define MIME_SLOTS 128
+#define MIME_SEED 2166136593U
+
+static const MimeType builtin_mime_types[MIME_SLOTS] = {
+    [1] = {"wav", "audio/wav"},
+    [7] = {"bmp", "image/bmp"},
+    [8] = {"txt", "text/plain"},
+    [11] = {"webm", "video/webm"},
+    [13] = {"map", "application/json"},
+    [15] = {"gz", "application/gzip"},
+    [28] = {"webp", "image/webp"},
+    [30] = {"mjs", "application/javascript"},
+    [31] = {"html", "text/html"},
+    [34] = {"js", "application/javascript"},
+    [46] = {"jpeg", "image/jpeg"},
+    [51] = {"jpg", "image/jpeg"},
+    [55] = {"zip", "application/zip"},
+    [56] = {"csv", "text/csv"},
+    [57] = {"woff", "font/woff"},
+    [59] = {"pdf", "application/pdf"},
+    [70] = {"md", "text/markdown"},
+    [73] = {"xml", "application/xml"},
+    [74] = {"otf", "font/otf"},
+    [85] = {"avif", "image/avif"},
+    [87] = {"ico", "image/x-icon"},
+    [88] = {"gif", "image/gif"},
+    [91] = {"mp3", "audio/mpeg"},
+    [94] = {"mp4", "video/mp4"},
+    [95] = {"htm", "text/html"},
+    [96] = {"png", "image/png"},
+    [97] = {"ttf", "font/ttf"},
+    [100] = {"woff2", "font/woff2"},
+    [105] = {"json", "application/json"},
+    [114] = {"wasm", "application/wasm"},
+    [116] = {"ogg", "audio/ogg"},
+    [119] = {"css", "text/css"},
+    [124] = {"tar", "application/x-tar"},
+    [125] = {"webmanifest", "application/manifest+json"},
+    [127] = {"svg", "image/svg+xml"},
+};
+// --- end generated MIME table ---
+
+// Extension -> type pairs from --mime-types, consulted before the built-ins.
+// Filled once before the workers start and read-only afterwards.
+static MimeType *extra_mime_types;
+static size_t extra_mime_mask;
+
+static unsigned mime_hash(const char *ext, unsigned seed) {
+    unsigned h = seed;
+    for (const unsigned char *p = (const unsigned char *)ext; *p; p++) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+    return h ^ (h >> 16);
+}
+
+static unsigned mime_slot(const char *ext) {
+    return mime_hash(ext, MIME_SEED) % MIME_SLOTS;
+}
+
+// Copies the lower-cased extension of filename into ext; 0 if there is none.
+static int lower_extension(const char *filename, char ext[MIME_EXT_MAX]) {
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return 0;
+    }
+    size_t len = strlen(dot + 1);
+    if (len == 0 || len >= MIME_EXT_MAX) {
+        return 0;
+    }
+    for (size_t i = 0; i <= len; i++) {
+        ext[i] = (char)tolower((unsigned char)dot[1 + i]);
+    }
+    return 1;
+}
+
+const char* get_mime_type(const char *filename) {
+    char ext[MIME_EXT_MAX];
+    if (!lower_extension(filename, ext)) {
+        return "application/octet-stream";
+    }
+
+    if (extra_mime_types != NULL) {
+        for (size_t i = mime_hash(ext, 0) & extra_mime_mask; extra_mime_types[i].ext != NULL;
+             i = (i + 1) & extra_mime_mask) {
+            if (strcmp(extra_mime_types[i].ext, ext) == 0) {
+                return extra_mime_types[i].type;
+            }
+        }
+    }
+
+    const MimeType *builtin = &builtin_mime_types[mime_slot(ext)];
+    if (builtin->ext != NULL && strcmp(builtin->ext, ext) == 0) {
+        return builtin->type;
+    }
+    return "application/octet-stream";
+}
+
+static int add_extra_mime_type(const char *ext, const char *type) {
+    size_t i = mime_hash(ext, 0) & extra_mime_mask;
+    while (extra_mime_types[i].ext != NULL) {
+        if (strcmp(extra_mime_types[i].ext, ext) == 0) {
+            // Later lines win, as in the file's usual reading order.
+            extra_mime_types[i].type = type;
+            return 0;
+        }
+        i = (i + 1) & extra_mime_mask;
+    }
+    extra_mime_types[i].ext = strdup(ext);
+    extra_mime_types[i].type = type;
+    return extra_mime_types[i].ext == NULL ? -1 : 0;
+}
+
+/*
+ * Loads an Apache/nginx-style mime.types file ("type ext ext ..." per line,
+ * '#' comments) on top of the built-in table; its entries take precedence.
+ * Must run before any worker starts. Returns -1 with errno set on failure.
+ */
+int load_mime_types(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    // Size the table from a first pass so it never has to grow.
+    size_t words = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        for (char *p = line; *p && *p != '#'; p++) {
+            if (!isspace((unsigned char)*p) && (p == line || isspace((unsigned char)p[-1]))) {
+                words++;
+            }
+        }
+    }
+    size_t slots = 16;
+    while (slots < words * 2) {
+        slots *= 2;
+    }
+    extra_mime_types = calloc(slots, sizeof(MimeType));
+    if (extra_mime_types == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return -1;
+    }
+    extra_mime_mask = slots - 1;
+
+    rewind(file);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *saveptr;
+        char *type = strtok_r(line, " \t\r\n;", &saveptr);
+        if (type == NULL || strchr(type, '/') == NULL) {
+            continue;
+        }
+        const char *type_copy = strdup(type);
+        if (type_copy == NULL) {
+            fclose(file);
+            errno = ENOMEM;
+            return -1;
+        }
+        for (char *word = strtok_r(NULL, " \t\r\n;", &saveptr); word != NULL;
+             word = strtok_r(NULL, " \t\r\n;", &saveptr)) {
+            char ext[MIME_EXT_MAX];
+            size_t len = strlen(word);
+            if (len >= MIME_EXT_MAX) {
+                continue;
+            }
+            for (size_t i = 0; i <= len; i++) {
+                ext[i] = (char)tolower((unsigned char)word[i]);
+            }
+            if (add_extra_mime_type(ext, type_copy) < 0) {
+                fclose(file);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Types worth serving from a .gz/.br sidecar; already-compressed media is not.
+int is_compressible_type(const char *mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 ||
+           strcmp(mime_type, "application/javascript") == 0 ||
+           strcmp(mime_type, "application/json") == 0 ||
+           strcmp(mime_type, "image/svg+xml") == 0;
+}
+
+// Strong validator from inode, size and nanosecond mtime, quoted for the header.
+void format_etag(char *buf, size_t size, const struct stat *st) {
+    unsigned long long mtime_ns = (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+                                  (unsigned long long)st->st_mtim.tv_nsec;
+    snprintf(buf, size, "\"%llx-%llx-%llx\"", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size, mtime_ns);
+}
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+void format_http_date(char *buf, size_t size, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}